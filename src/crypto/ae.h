@@ -175,6 +175,51 @@ int ae_decrypt(ae_ctx     *ctx,
  *
  * ----------------------------------------------------------------------- */
 
+/* ----------------------------------------------------------------------- */
+/* Mosh: several whole messages at once, without associated data and with
+ * the tag after the ciphertext, as ae_encrypt() and ae_decrypt() do given
+ * a NULL tag and AE_FINALIZE. The messages' AES work is interleaved, which
+ * keeps the pipeline full when they are short. Each out_len is set to what
+ * the single-message call would have returned. */
+
+typedef struct {
+    const void *nonce;
+    const void *in;
+    int         in_len;
+    void       *out;
+    int         out_len;
+} ae_batch;
+
+int ae_encrypt_batch(ae_ctx *ctx, ae_batch *msgs, int count);
+int ae_decrypt_batch(ae_ctx *ctx, ae_batch *msgs, int count);
+
+/* ----------------------------------------------------------------------- */
+/* Mosh: the functions above go to one of several builds of the OCB code,
+ * the fastest this CPU supports, chosen on first use (see ocb_dispatch.cc).
+ * ae_backend_name() says which, e.g. "OCB (AES-NI)", and
+ * ae_backend_hardware_aes() whether it has the CPU's AES instructions. */
+
+typedef struct {
+    const char *name;
+    int hardware_aes;
+    int (*ctx_sizeof)(void);
+    int (*init)(ae_ctx *, const void *, int, int, int);
+    int (*clear)(ae_ctx *);
+    int (*encrypt)(ae_ctx *, const void *, const void *, int, const void *, int,
+                   void *, void *, int);
+    int (*decrypt)(ae_ctx *, const void *, const void *, int, const void *, int,
+                   void *, const void *, int);
+    int (*encrypt_batch)(ae_ctx *, ae_batch *, int);
+    int (*decrypt_batch)(ae_ctx *, ae_batch *, int);
+} ae_backend;
+
+const char *ae_backend_name(void);
+int ae_backend_hardware_aes(void);
+
+/* Every backend this CPU can run, for benchmarks; NULL past the last. The
+ * one in use is index 0. */
+const ae_backend *ae_backend_at(int index);
+
 #ifdef __cplusplus
 } /* closing brace for extern "C" */
 #endif
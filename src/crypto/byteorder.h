@@ -46,6 +46,8 @@
 # include <libkern/OSByteOrder.h>
 # define htobe64 OSSwapHostToBigInt64
 # define be64toh OSSwapBigToHostInt64
+# define htobe32 OSSwapHostToBigInt32
+# define be32toh OSSwapBigToHostInt32
 # define htobe16 OSSwapHostToBigInt16
 # define be16toh OSSwapBigToHostInt16
 
@@ -58,6 +60,8 @@
 /* Make sure they aren't macros */
 #undef htobe64
 #undef be64toh
+#undef htobe32
+#undef be32toh
 #undef htobe16
 #undef be16toh
 
@@ -97,6 +101,32 @@ inline uint64_t be64toh( uint64_t x ) {
        | ( uint64_t( u.p8[ 7 ] ) );
 }
 
+inline uint32_t htobe32( uint32_t x ) {
+  uint8_t xs[ 4 ] = {
+    ( x >> 24 ) & 0xFF,
+    ( x >> 16 ) & 0xFF,
+    ( x >>  8 ) & 0xFF,
+      x         & 0xFF };
+  union {
+    const uint8_t  *p8;
+    const uint32_t *p32;
+  } u;
+  u.p8 = xs;
+  return *u.p32;
+}
+
+inline uint32_t be32toh( uint32_t x ) {
+  union {
+    const uint8_t  *p8;
+    const uint32_t *p32;
+  } u;
+  u.p32 = &x;
+  return ( uint32_t( u.p8[ 0 ] ) << 24 )
+       | ( uint32_t( u.p8[ 1 ] ) << 16 )
+       | ( uint32_t( u.p8[ 2 ] ) <<  8 )
+       | ( uint32_t( u.p8[ 3 ] ) );
+}
+
 inline uint16_t htobe16( uint16_t x ) {
   uint8_t xs[ 2 ] = {
     ( x >> 8 ) & 0xFF,
@@ -0,0 +1,135 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include "config.h"
+
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "chacha20poly1305.h"
+#include "crypto.h"
+
+using namespace Crypto;
+
+#ifdef HAVE_CHACHA20_POLY1305
+
+/* SHA-256 of a fixed label and the Mosh key. The label keeps the result
+   from meaning anything else, and OCB never sees the derived key. */
+static void derive_key( const char *mosh_key, size_t mosh_key_len, unsigned char *out )
+{
+  static const char label[] = "mosh chacha20-poly1305 key";
+  EVP_MD_CTX *md = EVP_MD_CTX_create();
+  unsigned int out_len = 0;
+
+  if ( !md
+       || !EVP_DigestInit_ex( md, EVP_sha256(), NULL )
+       || !EVP_DigestUpdate( md, label, sizeof( label ) - 1 )
+       || !EVP_DigestUpdate( md, mosh_key, mosh_key_len )
+       || !EVP_DigestFinal_ex( md, out, &out_len )
+       || (out_len != ChaCha20Poly1305::KEY_LEN) ) {
+    EVP_MD_CTX_destroy( md );
+    throw CryptoException( "Could not derive ChaCha20-Poly1305 key.", true );
+  }
+
+  EVP_MD_CTX_destroy( md );
+}
+
+bool ChaCha20Poly1305::available( void ) { return true; }
+
+ChaCha20Poly1305::ChaCha20Poly1305( const char *mosh_key, size_t mosh_key_len )
+  : ctx( EVP_CIPHER_CTX_new() )
+{
+  unsigned char key[ KEY_LEN ];
+  derive_key( mosh_key, mosh_key_len, key );
+
+  /* the key is set once, and each packet only supplies a nonce */
+  bool ok = ctx && EVP_CipherInit_ex( ctx, EVP_chacha20_poly1305(), NULL, key, NULL, 1 );
+  memset( key, 0, sizeof( key ) );
+  if ( !ok ) {
+    EVP_CIPHER_CTX_free( ctx );
+    throw CryptoException( "Could not initialize ChaCha20-Poly1305 context." );
+  }
+}
+
+ChaCha20Poly1305::~ChaCha20Poly1305()
+{
+  EVP_CIPHER_CTX_free( ctx );
+}
+
+void ChaCha20Poly1305::encrypt( const char *nonce, char *text, size_t text_len )
+{
+  unsigned char *buf = (unsigned char *)text;
+  int len;
+
+  if ( !EVP_CipherInit_ex( ctx, NULL, NULL, NULL, (const unsigned char *)nonce, 1 )
+       || !EVP_CipherUpdate( ctx, buf, &len, buf, text_len )
+       || !EVP_CipherFinal_ex( ctx, buf + len, &len )
+       || !EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, buf + text_len ) ) {
+    throw CryptoException( "ChaCha20-Poly1305 encryption failed." );
+  }
+}
+
+bool ChaCha20Poly1305::decrypt( const char *nonce, char *text, size_t ciphertext_len )
+{
+  if ( ciphertext_len < size_t( TAG_LEN ) ) {
+    return false;
+  }
+
+  unsigned char *buf = (unsigned char *)text;
+  size_t text_len = ciphertext_len - TAG_LEN;
+  int len;
+
+  return EVP_CipherInit_ex( ctx, NULL, NULL, NULL, (const unsigned char *)nonce, 0 )
+    && EVP_CIPHER_CTX_ctrl( ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN, buf + text_len )
+    && EVP_CipherUpdate( ctx, buf, &len, buf, text_len )
+    && (EVP_CipherFinal_ex( ctx, buf + len, &len ) > 0);
+}
+
+#else
+
+bool ChaCha20Poly1305::available( void ) { return false; }
+
+ChaCha20Poly1305::ChaCha20Poly1305( const char *, size_t ) : ctx( NULL ) {}
+ChaCha20Poly1305::~ChaCha20Poly1305() {}
+
+void ChaCha20Poly1305::encrypt( const char *, char *, size_t )
+{
+  throw CryptoException( "ChaCha20-Poly1305 is not available.", true );
+}
+
+bool ChaCha20Poly1305::decrypt( const char *, char *, size_t )
+{
+  return false;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#ifndef CHACHA20POLY1305_HPP
+#define CHACHA20POLY1305_HPP
+
+#include <stddef.h>
+
+/* as in OpenSSL's ossl_typ.h, so that users needn't see all of evp.h */
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace Crypto {
+  /* ChaCha20-Poly1305 (RFC 8439) through OpenSSL, for CPUs where AES-OCB
+     has no hardware help. The same 12-byte nonces and 16-byte tags as
+     Session's AES-OCB, so packets are laid out the same way. */
+  class ChaCha20Poly1305 {
+  private:
+    EVP_CIPHER_CTX *ctx;
+
+  public:
+    static const int KEY_LEN = 32;
+    static const int TAG_LEN = 16;
+
+    /* Whether this build of OpenSSL has it; if not, nothing else works */
+    static bool available( void );
+
+    /* The 32-byte key is derived from Mosh's usual 16-byte one, so that
+       MOSH_KEY stays as it is. */
+    ChaCha20Poly1305( const char *mosh_key, size_t mosh_key_len );
+    ~ChaCha20Poly1305();
+
+    /* In place; the tag goes after the text, and comes after the
+       ciphertext when decrypting. decrypt() returns false, leaving the text
+       garbled, if the packet fails its integrity check. */
+    void encrypt( const char *nonce, char *text, size_t text_len );
+    bool decrypt( const char *nonce, char *text, size_t ciphertext_len );
+
+    ChaCha20Poly1305( const ChaCha20Poly1305 & );
+    ChaCha20Poly1305 & operator=( const ChaCha20Poly1305 & );
+  };
+}
+
+#endif
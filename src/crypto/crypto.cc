@@ -36,8 +36,15 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "byteorder.h"
+
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 #include "crypto.h"
 #include "base64.h"
 
@@ -96,6 +103,20 @@ AlignedBuffer::AlignedBuffer( size_t len, const char *data )
   }
 }
 
+void AlignedBuffer::discard( void )
+{
+#ifdef MADV_DONTNEED
+  /* only pages wholly ours; the allocator keeps its own bookkeeping
+     at either end */
+  uintptr_t page = sysconf( _SC_PAGESIZE );
+  uintptr_t start = ( (uintptr_t) m_data + page - 1 ) & ~( page - 1 );
+  uintptr_t end = ( (uintptr_t) m_data + m_len ) & ~( page - 1 );
+  if ( end > start ) {
+    madvise( (void *) start, end - start, MADV_DONTNEED );
+  }
+#endif
+}
+
 Base64Key::Base64Key( string printable_key )
 {
   if ( printable_key.length() != 22 ) {
@@ -121,18 +142,7 @@ Base64Key::Base64Key( string printable_key )
 
 Base64Key::Base64Key()
 {
-  FILE *devrandom = fopen( rdev, "r" );
-  if ( devrandom == NULL ) {
-    throw CryptoException( string( rdev ) + ": " + strerror( errno ) );
-  }
-
-  if ( 1 != fread( key, 16, 1, devrandom ) ) {
-    throw CryptoException( "Could not read from " + string( rdev ) );
-  }
-
-  if ( 0 != fclose( devrandom ) ) {
-    throw CryptoException( string( rdev ) + ": " + strerror( errno ) );
-  }
+  kernel_random( key, 16 );
 }
 
 string Base64Key::printable_key( void ) const
@@ -152,10 +162,10 @@ string Base64Key::printable_key( void ) const
 
 Session::Session( Base64Key s_key )
   : key( s_key ), ctx_buf( ae_ctx_sizeof() ),
-    ctx( (ae_ctx *)ctx_buf.data() ), blocks_encrypted( 0 ),
-    plaintext_buffer( RECEIVE_MTU ),
-    ciphertext_buffer( RECEIVE_MTU ),
-    nonce_buffer( Nonce::NONCE_LEN )
+    ctx( (ae_ctx *)ctx_buf.data() ), chacha20( (const char *)key.data(), 16 ), blocks_encrypted( 0 ),
+    scratch_buffer( HEADROOM + RECEIVE_MTU ),
+    nonce_buffer( Nonce::NONCE_LEN ),
+    batch_nonces( NONCE_BATCH * 16 )
 {
   if ( AE_SUCCESS != ae_init( ctx, key.data(), 16, 12, 16 ) ) {
     throw CryptoException( "Could not initialize AES-OCB context." );
@@ -177,7 +187,7 @@ Nonce::Nonce( uint64_t val )
   memcpy( bytes + 4, &val_net, 8 );
 }
 
-uint64_t Nonce::val( void )
+uint64_t Nonce::val( void ) const
 {
   uint64_t ret;
   memcpy( &ret, bytes + 4, 8 );
@@ -205,31 +215,10 @@ Message::Message( Nonce s_nonce, string s_text )
     text( s_text )
 {}
 
-string Session::encrypt( Message plaintext )
+void Session::count_blocks( size_t text_len )
 {
-  const size_t pt_len = plaintext.text.size();
-  const int ciphertext_len = pt_len + 16;
-
-  assert( (size_t)ciphertext_len <= ciphertext_buffer.len() );
-  assert( pt_len <= plaintext_buffer.len() );
-
-  memcpy( plaintext_buffer.data(), plaintext.text.data(), pt_len );
-  memcpy( nonce_buffer.data(), plaintext.nonce.data(), Nonce::NONCE_LEN );
-
-  if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
-				     nonce_buffer.data(),                     /* nonce */
-				     plaintext_buffer.data(),                 /* pt */
-				     pt_len,                                  /* pt_len */
-				     NULL,                                    /* ad */
-				     0,                                       /* ad_len */
-				     ciphertext_buffer.data(),                /* ct */
-				     NULL,                                    /* tag */
-				     AE_FINALIZE ) ) {                        /* final */
-    throw CryptoException( "ae_encrypt() returned error." );
-  }
-
-  blocks_encrypted += pt_len >> 4;
-  if ( pt_len & 0xF ) {
+  blocks_encrypted += text_len >> 4;
+  if ( text_len & 0xF ) {
     /* partial block */
     blocks_encrypted++;
   }
@@ -249,50 +238,267 @@ string Session::encrypt( Message plaintext )
   if ( blocks_encrypted >> 47 ) {
     throw CryptoException( "Encrypted 2^47 blocks.", true );
   }
+}
+
+size_t Session::encrypt_in_place( const Nonce &nonce, char *text, size_t text_len )
+{
+  assert( !( (uintptr_t)text & 0xF ) );
+
+  memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
+  memcpy( text - NONCE_WIRE_LEN, nonce.data() + 4, NONCE_WIRE_LEN );
+
+  const int ciphertext_len = text_len + TAG_LEN;
+
+  if ( nonce.val() & CHACHA20_NONCE_BIT ) {
+    chacha20.encrypt( nonce_buffer.data(), text, text_len );
+    return NONCE_WIRE_LEN + ciphertext_len;
+  }
+
+  if ( ciphertext_len != ae_encrypt( ctx,                                     /* ctx */
+				     nonce_buffer.data(),                     /* nonce */
+				     text,                                    /* pt */
+				     text_len,                                /* pt_len */
+				     NULL,                                    /* ad */
+				     0,                                       /* ad_len */
+				     text,                                    /* ct */
+				     NULL,                                    /* tag */
+				     AE_FINALIZE ) ) {                        /* final */
+    throw CryptoException( "ae_encrypt() returned error." );
+  }
 
-  string text( ciphertext_buffer.data(), ciphertext_len );
+  count_blocks( text_len );
 
-  return plaintext.nonce.cc_str() + text;
+  return NONCE_WIRE_LEN + ciphertext_len;
 }
 
-Message Session::decrypt( string ciphertext )
+size_t Session::decrypt_in_place( char *text, size_t wire_len, uint64_t *nonce_val )
 {
-  if ( ciphertext.size() < 24 ) {
+  assert( !( (uintptr_t)text & 0xF ) );
+
+  if ( wire_len < size_t( NONCE_WIRE_LEN + TAG_LEN ) ) {
     throw CryptoException( "Ciphertext must contain nonce and tag." );
   }
 
-  char *str = (char *)ciphertext.data();
-
-  int body_len = ciphertext.size() - 8;
-  int pt_len = body_len - 16;
+  int body_len = wire_len - NONCE_WIRE_LEN;
+  int pt_len = body_len - TAG_LEN;
 
   if ( pt_len < 0 ) { /* super-assertion that pt_len does not equal AE_INVALID */
     fprintf( stderr, "BUG.\n" );
     exit( 1 );
   }
 
-  assert( (size_t)body_len <= ciphertext_buffer.len() );
-  assert( (size_t)pt_len <= plaintext_buffer.len() );
-
-  Nonce nonce( str, 8 );
-  memcpy( ciphertext_buffer.data(), str + 8, body_len );
+  Nonce nonce( text - NONCE_WIRE_LEN, NONCE_WIRE_LEN );
   memcpy( nonce_buffer.data(), nonce.data(), Nonce::NONCE_LEN );
 
-  if ( pt_len != ae_decrypt( ctx,                      /* ctx */
-			     nonce_buffer.data(),      /* nonce */
-			     ciphertext_buffer.data(), /* ct */
-			     body_len,                 /* ct_len */
-			     NULL,                     /* ad */
-			     0,                        /* ad_len */
-			     plaintext_buffer.data(),  /* pt */
-			     NULL,                     /* tag */
-			     AE_FINALIZE ) ) {         /* final */
+  bool ok;
+  if ( nonce.val() & CHACHA20_NONCE_BIT ) {
+    ok = chacha20.decrypt( nonce_buffer.data(), text, body_len );
+  } else {
+    ok = pt_len == ae_decrypt( ctx,                      /* ctx */
+			       nonce_buffer.data(),      /* nonce */
+			       text,                     /* ct */
+			       body_len,                 /* ct_len */
+			       NULL,                     /* ad */
+			       0,                        /* ad_len */
+			       text,                     /* pt */
+			       NULL,                     /* tag */
+			       AE_FINALIZE );            /* final */
+  }
+
+  if ( !ok ) {
     throw CryptoException( "Packet failed integrity check." );
   }
 
-  Message ret( nonce, string( plaintext_buffer.data(), pt_len ) );
+  *nonce_val = nonce.val();
+  return pt_len;
+}
 
-  return ret;
+/* ChaCha20-Poly1305 packets have nothing to interleave with, and go
+   through one at a time as they come; the rest are batched for OCB. */
+void Session::encrypt_batch( InPlacePacket *packets, int count )
+{
+  while ( count > 0 ) {
+    ae_batch msgs[ NONCE_BATCH ];
+    InPlacePacket *batched[ NONCE_BATCH ];
+    int n = count < NONCE_BATCH ? count : NONCE_BATCH;
+    int m = 0;
+
+    for ( int i = 0; i < n; i++ ) {
+      InPlacePacket &p = packets[ i ];
+      Nonce nonce( p.nonce_val );
+
+      if ( p.nonce_val & CHACHA20_NONCE_BIT ) {
+	p.len = encrypt_in_place( nonce, p.text, p.len );
+	continue;
+      }
+
+      assert( !( (uintptr_t)p.text & 0xF ) );
+
+      char *nonce_bytes = batch_nonces.data() + 16 * m;
+      memcpy( nonce_bytes, nonce.data(), Nonce::NONCE_LEN );
+      memcpy( p.text - NONCE_WIRE_LEN, nonce.data() + 4, NONCE_WIRE_LEN );
+
+      msgs[ m ].nonce = nonce_bytes;
+      msgs[ m ].in = msgs[ m ].out = p.text;
+      msgs[ m ].in_len = p.len;
+      batched[ m++ ] = &p;
+      count_blocks( p.len );
+    }
+
+    if ( m ) {
+      ae_encrypt_batch( ctx, msgs, m );
+    }
+
+    for ( int i = 0; i < m; i++ ) {
+      if ( msgs[ i ].out_len != int( batched[ i ]->len + TAG_LEN ) ) {
+	throw CryptoException( "ae_encrypt_batch() returned error." );
+      }
+      batched[ i ]->len = NONCE_WIRE_LEN + msgs[ i ].out_len;
+    }
+
+    packets += n;
+    count -= n;
+  }
+}
+
+void Session::decrypt_batch( InPlacePacket *packets, int count )
+{
+  while ( count > 0 ) {
+    ae_batch msgs[ NONCE_BATCH ];
+    InPlacePacket *batched[ NONCE_BATCH ];
+    int n = count < NONCE_BATCH ? count : NONCE_BATCH;
+    int m = 0;
+
+    for ( int i = 0; i < n; i++ ) {
+      InPlacePacket &p = packets[ i ];
+      assert( !( (uintptr_t)p.text & 0xF ) );
+
+      p.valid = false;
+      if ( p.len < size_t( NONCE_WIRE_LEN + TAG_LEN ) ) {
+	continue;
+      }
+
+      char *nonce_bytes = batch_nonces.data() + 16 * m;
+      memset( nonce_bytes, 0, 4 );
+      memcpy( nonce_bytes + 4, p.text - NONCE_WIRE_LEN, NONCE_WIRE_LEN );
+      Nonce nonce( nonce_bytes + 4, NONCE_WIRE_LEN );
+      p.nonce_val = nonce.val();
+
+      if ( p.nonce_val & CHACHA20_NONCE_BIT ) {
+	p.len -= NONCE_WIRE_LEN;
+	p.valid = chacha20.decrypt( nonce_bytes, p.text, p.len );
+	p.len -= TAG_LEN;
+	continue;
+      }
+
+      msgs[ m ].nonce = nonce_bytes;
+      msgs[ m ].in = msgs[ m ].out = p.text;
+      msgs[ m ].in_len = p.len - NONCE_WIRE_LEN;
+      batched[ m++ ] = &p;
+    }
+
+    if ( m ) {
+      ae_decrypt_batch( ctx, msgs, m );
+    }
+
+    for ( int i = 0; i < m; i++ ) {
+      batched[ i ]->valid = (msgs[ i ].out_len == msgs[ i ].in_len - TAG_LEN);
+      batched[ i ]->len = msgs[ i ].in_len - TAG_LEN;
+    }
+
+    packets += n;
+    count -= n;
+  }
+}
+
+bool Session::prefers_chacha20( void )
+{
+  static const bool prefers = ChaCha20Poly1305::available()
+    && ( getenv( "MOSH_CHACHA20" ) || !ae_backend_hardware_aes() );
+  return prefers;
+}
+
+/* The copying versions use a packet buffer of the session's own */
+string Session::encrypt( const Message &plaintext )
+{
+  const size_t pt_len = plaintext.text.size();
+  char *text = scratch_buffer.data() + HEADROOM;
+
+  assert( buffer_len( pt_len ) <= scratch_buffer.len() );
+
+  memcpy( text, plaintext.text.data(), pt_len );
+
+  size_t wire_len = encrypt_in_place( plaintext.nonce, text, pt_len );
+
+  return string( text - NONCE_WIRE_LEN, wire_len );
+}
+
+Message Session::decrypt( const char *ciphertext, size_t len )
+{
+  char *text = scratch_buffer.data() + HEADROOM;
+
+  if ( len < size_t( NONCE_WIRE_LEN + TAG_LEN ) ) {
+    throw CryptoException( "Ciphertext must contain nonce and tag." );
+  }
+  if ( HEADROOM - NONCE_WIRE_LEN + len > scratch_buffer.len() ) {
+    throw CryptoException( "Ciphertext too long." );
+  }
+
+  memcpy( text - NONCE_WIRE_LEN, ciphertext, len );
+
+  uint64_t nonce_val;
+  size_t pt_len = decrypt_in_place( text, len, &nonce_val );
+
+  return Message( Nonce( nonce_val ), string( text, pt_len ) );
+}
+
+/* The file is only opened for as long as it takes to read, so a
+   chrooted server without it fails here rather than at startup. */
+static void read_urandom( char *dest, size_t len )
+{
+  int fd = open( rdev, O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 ) {
+    throw CryptoException( string( rdev ) + ": " + strerror( errno ) );
+  }
+
+  while ( len > 0 ) {
+    ssize_t n = read( fd, dest, len );
+    if ( n < 0 && errno == EINTR ) {
+      continue;
+    } else if ( n <= 0 ) {
+      close( fd );
+      throw CryptoException( "Could not read from " + string( rdev ) );
+    }
+    dest += n;
+    len -= n;
+  }
+
+  close( fd );
+}
+
+void Crypto::kernel_random( void *dest, size_t len )
+{
+  char *out = static_cast<char *>( dest );
+
+#ifdef HAVE_GETRANDOM
+  while ( len > 0 ) {
+    ssize_t n = getrandom( out, len, 0 );
+    if ( n < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      } else if ( errno == ENOSYS ) {
+	break; /* older kernel than libc */
+      }
+      throw CryptoException( string( "getrandom: " ) + strerror( errno ) );
+    }
+    out += n;
+    len -= n;
+  }
+#endif
+
+  if ( len > 0 ) {
+    read_urandom( out, len );
+  }
 }
 
 static rlim_t saved_core_rlimit;
@@ -34,6 +34,7 @@
 #define CRYPTO_HPP
 
 #include "ae.h"
+#include "chacha20poly1305.h"
 #include <string>
 #include <string.h>
 #include <stdint.h>
@@ -69,6 +70,10 @@ namespace Crypto {
     char * data( void ) const { return m_data; }
     size_t len( void )  const { return m_len;  }
 
+    /* Hands the memory back to the kernel until it is next touched;
+       the contents are lost */
+    void discard( void );
+
   private:
     /* Not implemented */
     AlignedBuffer( const AlignedBuffer& );
@@ -99,7 +104,8 @@ namespace Crypto {
     
     string cc_str( void ) { return string( (char *)( bytes + 4 ), 8 ); }
     char *data( void ) { return bytes; }
-    uint64_t val( void );
+    const char *data( void ) const { return bytes; }
+    uint64_t val( void ) const;
   };
   
   class Message {
@@ -112,30 +118,79 @@ namespace Crypto {
     Message( Nonce s_nonce, string s_text );
   };
   
+  /* One packet of a batch for Session, in a packet buffer laid out as for
+     Session::encrypt_in_place() */
+  class InPlacePacket {
+  public:
+    char *text;
+    size_t len; /* text length to encrypt, then wire length; the reverse to decrypt */
+    uint64_t nonce_val;
+    bool valid; /* decrypted and authenticated */
+
+    InPlacePacket() : text( NULL ), len( 0 ), nonce_val( 0 ), valid( false ) {}
+  };
+
   class Session {
   private:
     Base64Key key;
     AlignedBuffer ctx_buf;
     ae_ctx *ctx;
+    ChaCha20Poly1305 chacha20;
     uint64_t blocks_encrypted;
 
-    AlignedBuffer plaintext_buffer;
-    AlignedBuffer ciphertext_buffer;
+    AlignedBuffer scratch_buffer; /* for the copying versions */
     AlignedBuffer nonce_buffer;
+
+    static const int NONCE_BATCH = 16; /* packets per ae_*_batch() call */
+    AlignedBuffer batch_nonces;
+
+    void count_blocks( size_t text_len );
     
   public:
     static const int RECEIVE_MTU = 2048;
+    static const int NONCE_WIRE_LEN = 8; /* the nonce as sent, ahead of the ciphertext */
+    static const int TAG_LEN = 16;
+    /* room to leave ahead of the text in a packet buffer: the nonce,
+       padded so that the text stays 16-byte aligned */
+    static const int HEADROOM = 16;
+
+    /* Nonces with this bit set are for ChaCha20-Poly1305 instead of AES-OCB.
+       Either can be decrypted at any time; the sender chooses. */
+    static const uint64_t CHACHA20_NONCE_BIT = uint64_t( 1 ) << 61;
+    /* No AES instructions here (or MOSH_CHACHA20 is set), and OpenSSL has
+       ChaCha20-Poly1305 */
+    static bool prefers_chacha20( void );
+
+    /* Size of a packet buffer for text_len bytes of text */
+    static size_t buffer_len( size_t text_len ) { return HEADROOM + text_len + TAG_LEN; }
 
     Session( Base64Key s_key );
     ~Session();
     
-    string encrypt( Message plaintext );
-    Message decrypt( string ciphertext );
+    /* Encrypt and decrypt in place, in a packet buffer. text is HEADROOM
+       bytes into the buffer, 16-byte aligned, with TAG_LEN bytes free after
+       it for the tag. The datagram is [text - NONCE_WIRE_LEN, text + len),
+       len being what encrypt_in_place() returns or wire_len. */
+    size_t encrypt_in_place( const Nonce &nonce, char *text, size_t text_len );
+    size_t decrypt_in_place( char *text, size_t wire_len, uint64_t *nonce_val );
+
+    /* The same for several packets, with their AES work interleaved.
+       A packet that fails to decrypt is left invalid instead of throwing. */
+    void encrypt_batch( InPlacePacket *packets, int count );
+    void decrypt_batch( InPlacePacket *packets, int count );
+
+    /* Copying versions, for callers without a packet buffer */
+    string encrypt( const Message &plaintext );
+    Message decrypt( const char *ciphertext, size_t len );
+    Message decrypt( const string &ciphertext ) { return decrypt( ciphertext.data(), ciphertext.size() ); }
     
     Session( const Session & );
     Session & operator=( const Session & );
   };
 
+  /* From getrandom(), or /dev/urandom without it; for keys and seeds */
+  void kernel_random( void *dest, size_t len );
+
   void disable_dumping_core( void );
   void reenable_dumping_core( void );
 }
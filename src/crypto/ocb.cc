@@ -47,10 +47,26 @@
 #define OCB_TAG_LEN         16  /* 0 to 16. 0 means set in ae_init         */
 
 /* This implementation has built-in support for multiple AES APIs. Set any
-/  one of the following to non-zero to specify which to use.               */
+/  one of the following to non-zero to specify which to use.
+/  Mosh: ocb_openssl.cc and ocb_aesni.cc each build this file for one of
+/  them, under names given by OCB_NAME, and ocb_dispatch.cc picks one of
+/  those builds at run time.                                               */
+#ifndef OCB_NAME
 #define USE_OPENSSL_AES      1  /* http://openssl.org                      */
 #define USE_REFERENCE_AES    0  /* Internet search: rijndael-alg-fst.c     */
 #define USE_AES_NI           0  /* Uses compiler's intrinsics              */
+#else
+#define ae_allocate          OCB_NAME(allocate)
+#define ae_free              OCB_NAME(free)
+#define ae_clear             OCB_NAME(clear)
+#define ae_ctx_sizeof        OCB_NAME(ctx_sizeof)
+#define ae_init              OCB_NAME(init)
+#define ae_encrypt           OCB_NAME(encrypt)
+#define ae_decrypt           OCB_NAME(decrypt)
+#define ae_encrypt_batch     OCB_NAME(encrypt_batch)
+#define ae_decrypt_batch     OCB_NAME(decrypt_batch)
+#define infoString           OCB_NAME(info)
+#endif
 
 /* During encryption and decryption, various "L values" are required.
 /  The L values can be precomputed during initialization (requiring extra
@@ -420,7 +436,7 @@ static void AES_ecb_encrypt_blks(block *blks, unsigned nblks, AES_KEY *key) {
     x3 = _mm_xor_si128(x3,_mm_shuffle_epi32(x0, 255));                      \
     kp[idx+2] = x0; tmp = x3
 
-void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
+static void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2;
     __m128i *kp = (__m128i *)key;
@@ -438,7 +454,7 @@ void AES_128_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND_ASSIST(x0,x1,x2,x0,255,54);  kp[10] = x0;
 }
 
-void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
+static void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2,x3,tmp,*kp = (__m128i *)key;
     kp[0] = x0 = _mm_loadu_si128((__m128i*)userkey);
@@ -450,7 +466,7 @@ void AES_192_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND192_STEP(10,64);
 }
 
-void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
+static void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
 {
     __m128i x0,x1,x2,x3,*kp = (__m128i *)key;
     kp[0] = x0 = _mm_loadu_si128((__m128i*)userkey   );
@@ -471,7 +487,7 @@ void AES_256_Key_Expansion(const unsigned char *userkey, void *key)
     EXPAND_ASSIST(x0,x1,x2,x3,255,64); kp[14] = x0;
 }
 
-int AES_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
+static int AES_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
 {
     if (bits == 128) {
         AES_128_Key_Expansion (userKey,key);
@@ -486,7 +502,7 @@ int AES_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *k
     return 0;
 }
 
- void AES_set_decrypt_key_fast(AES_KEY *dkey, const AES_KEY *ekey)
+static void AES_set_decrypt_key_fast(AES_KEY *dkey, const AES_KEY *ekey)
 {
     int j = 0;
     int i = ROUNDS(ekey);
@@ -499,14 +515,6 @@ int AES_set_encrypt_key(const unsigned char *userKey, const int bits, AES_KEY *k
     dkey->rd_key[i] = ekey->rd_key[j];
 }
 
-int AES_set_decrypt_key(const unsigned char *userKey, const int bits, AES_KEY *key)
-{
-    AES_KEY temp_key;
-    AES_set_encrypt_key(userKey,bits,&temp_key);
-    AES_set_decrypt_key_fast(key, &temp_key);
-    return 0;
-}
-
 static inline void AES_encrypt(const unsigned char *in,
                         unsigned char *out, const AES_KEY *key)
 {
@@ -710,7 +718,7 @@ static block gen_offset_from_nonce(ae_ctx *ctx, const void *nonce)
 	return gen_offset(ctx->KtopStr, idx);
 }
 
- void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
+static void process_ad(ae_ctx *ctx, const void *ad, int ad_len, int final)
 {
 	union { uint32_t u32[4]; uint8_t u8[16]; block bl; } tmp;
     block ad_offset, ad_checksum;
@@ -1205,6 +1213,212 @@ int ae_decrypt(ae_ctx     *ctx,
     return ct_len;
  }
 
+/* ----------------------------------------------------------------------- */
+/* Mosh: batches of whole messages                                         */
+/* ----------------------------------------------------------------------- */
+
+/* Messages here have no associated data and carry the tag after the
+/  ciphertext, as with a NULL tag and AE_FINALIZE above. Every AES input of
+/  several messages is gathered before any is computed, so that one
+/  pass of AES_ecb_*_blks() calls covers them all; short messages otherwise
+/  spend most of their time waiting on a few blocks for the tag. Messages
+/  longer than AE_BATCH_MAX_LEN fill the pipeline on their own, and go
+/  through ae_encrypt() and ae_decrypt() one by one.                       */
+
+#define AE_BATCH_BLOCKS 256            /* AES inputs gathered per pass    */
+#define AE_BATCH_MAX_LEN (2*BPI*16)    /* Longest message worth batching  */
+
+#if (OCB_TAG_LEN > 0)
+#define BATCH_TAG_LEN(ctx) OCB_TAG_LEN
+#else
+#define BATCH_TAG_LEN(ctx) ((int)(ctx)->tag_len)
+#endif
+
+/* ECB over a whole pass, BPI blocks at a time so they stay in registers */
+static void batch_ecb_encrypt(block *blks, unsigned nblks, AES_KEY *key)
+{
+	for (; nblks >= BPI; blks += BPI, nblks -= BPI)
+		AES_ecb_encrypt_blks(blks, BPI, key);
+	if (nblks)
+		AES_ecb_encrypt_blks(blks, nblks, key);
+}
+
+static void batch_ecb_decrypt(block *blks, unsigned nblks, AES_KEY *key)
+{
+	for (; nblks >= BPI; blks += BPI, nblks -= BPI)
+		AES_ecb_decrypt_blks(blks, BPI, key);
+	if (nblks)
+		AES_ecb_decrypt_blks(blks, nblks, key);
+}
+
+/* Queue the AES inputs of one message to encrypt: one per block, then the
+/  tag's. The offsets of the full blocks go in oa. Returns how many.       */
+static unsigned encrypt_batch_start(ae_ctx *ctx, const ae_batch *m,
+                                    block *ta, block *oa)
+{
+	union { uint32_t u32[4]; uint8_t u8[16]; block bl; } tmp;
+	const block *ptp = (const block *)m->in;
+	unsigned i, full = (unsigned)m->in_len / 16;
+	unsigned remaining = (unsigned)m->in_len % 16;
+	block offset = gen_offset_from_nonce(ctx, m->nonce);
+	block checksum = zero_block();
+
+	for (i = 0; i < full; i++) {
+		offset = oa[i] = xor_block(offset, getL(ctx, ntz(i+1)));
+		ta[i] = xor_block(offset, ptp[i]);
+		checksum = xor_block(checksum, ptp[i]);
+	}
+	if (remaining) {
+		tmp.bl = zero_block();
+		memcpy(tmp.u8, ptp+i, remaining);
+		tmp.u8[remaining] = (unsigned char)0x80u;
+		checksum = xor_block(checksum, tmp.bl);
+		offset = ta[i++] = xor_block(offset, ctx->Lstar);
+	}
+	ta[i++] = xor_block(xor_block(offset, ctx->Ldollar), checksum);
+	return i;
+}
+
+/* Write out one message from its encrypted inputs. Returns how many.     */
+static unsigned encrypt_batch_finish(ae_batch *m, const block *ta,
+                                     const block *oa, int tag_len)
+{
+	union { uint32_t u32[4]; uint8_t u8[16]; block bl; } tmp;
+	const block *ptp = (const block *)m->in;
+	block *ctp = (block *)m->out;
+	unsigned i, full = (unsigned)m->in_len / 16;
+	unsigned remaining = (unsigned)m->in_len % 16;
+
+	for (i = 0; i < full; i++)
+		ctp[i] = xor_block(ta[i], oa[i]);
+	if (remaining) {
+		tmp.bl = zero_block();
+		memcpy(tmp.u8, ptp+i, remaining);
+		tmp.bl = xor_block(tmp.bl, ta[i++]);
+		memcpy(ctp+full, tmp.u8, remaining);
+	}
+	tmp.bl = ta[i++];
+	memcpy((char *)m->out + m->in_len, tmp.u8, tag_len);
+	m->out_len = m->in_len + tag_len;
+	return i;
+}
+
+int ae_encrypt_batch(ae_ctx *ctx, ae_batch *msgs, int count)
+{
+	block ta[AE_BATCH_BLOCKS], oa[AE_BATCH_BLOCKS];
+	int pass[AE_BATCH_BLOCKS];
+	unsigned used = 0, need, k;
+	int n, npass = 0;
+
+	for (n = 0; n <= count; n++) {
+		need = 0;
+		if (n < count) {
+			need = ((unsigned)msgs[n].in_len + 15) / 16 + 1;
+			if (msgs[n].in_len > AE_BATCH_MAX_LEN) {
+				msgs[n].out_len = ae_encrypt(ctx, msgs[n].nonce, msgs[n].in,
+				                             msgs[n].in_len, NULL, 0,
+				                             msgs[n].out, NULL, AE_FINALIZE);
+				continue;
+			}
+		}
+		if ((n == count) || (used + need > AE_BATCH_BLOCKS)) {
+			batch_ecb_encrypt(ta, used, &ctx->encrypt_key);
+			for (k = 0, used = 0; k < (unsigned)npass; k++)
+				used += encrypt_batch_finish(&msgs[pass[k]], ta+used, oa+used,
+				                             BATCH_TAG_LEN(ctx));
+			used = npass = 0;
+		}
+		if (n < count) {
+			pass[npass++] = n;
+			used += encrypt_batch_start(ctx, &msgs[n], ta+used, oa+used);
+		}
+	}
+	return AE_SUCCESS;
+}
+
+int ae_decrypt_batch(ae_ctx *ctx, ae_batch *msgs, int count)
+{
+	union { uint32_t u32[4]; uint8_t u8[16]; block bl; } tmp;
+	block da[AE_BATCH_BLOCKS], oa[AE_BATCH_BLOCKS]; /* Full blocks         */
+	block pa[AE_BATCH_BLOCKS], fa[AE_BATCH_BLOCKS]; /* Pads, final offsets */
+	block ta[AE_BATCH_BLOCKS];                      /* Tags                */
+	int pass[AE_BATCH_BLOCKS];
+	unsigned used = 0, need, blocks = 0, pads = 0, i, k, d, p;
+	int n, npass = 0;
+
+	for (n = 0; n <= count; n++) {
+		need = 0;
+		if (n < count) {
+			if (msgs[n].in_len < BATCH_TAG_LEN(ctx)) {
+				msgs[n].out_len = AE_INVALID;
+				continue;
+			}
+			need = ((unsigned)(msgs[n].in_len - BATCH_TAG_LEN(ctx)) + 15) / 16 + 1;
+			if (msgs[n].in_len - BATCH_TAG_LEN(ctx) > AE_BATCH_MAX_LEN) {
+				msgs[n].out_len = ae_decrypt(ctx, msgs[n].nonce, msgs[n].in,
+				                             msgs[n].in_len, NULL, 0,
+				                             msgs[n].out, NULL, AE_FINALIZE);
+				continue;
+			}
+		}
+		if ((n == count) || (used + need > AE_BATCH_BLOCKS)) {
+			/* Full blocks and pads first; the tags need their plaintext */
+			batch_ecb_decrypt(da, blocks, &ctx->decrypt_key);
+			batch_ecb_encrypt(pa, pads, &ctx->encrypt_key);
+			for (k = 0, d = 0, p = 0; k < (unsigned)npass; k++) {
+				ae_batch *m = &msgs[pass[k]];
+				const block *ctp = (const block *)m->in;
+				block *ptp = (block *)m->out;
+				int ct_len = m->in_len - BATCH_TAG_LEN(ctx);
+				unsigned full = (unsigned)ct_len / 16;
+				unsigned remaining = (unsigned)ct_len % 16;
+				block checksum = zero_block();
+
+				for (i = 0; i < full; i++, d++) {
+					ptp[i] = xor_block(da[d], oa[d]);
+					checksum = xor_block(checksum, ptp[i]);
+				}
+				if (remaining) {
+					tmp.bl = pa[p++];
+					memcpy(tmp.u8, ctp+full, remaining);
+					tmp.bl = xor_block(tmp.bl, pa[p-1]);
+					tmp.u8[remaining] = (unsigned char)0x80u;
+					memcpy(ptp+full, tmp.u8, remaining);
+					checksum = xor_block(checksum, tmp.bl);
+				}
+				ta[k] = xor_block(xor_block(fa[k], ctx->Ldollar), checksum);
+			}
+			batch_ecb_encrypt(ta, npass, &ctx->encrypt_key);
+			for (k = 0; k < (unsigned)npass; k++) {
+				ae_batch *m = &msgs[pass[k]];
+				int ct_len = m->in_len - BATCH_TAG_LEN(ctx);
+				if (memcmp((const char *)m->in + ct_len, &ta[k], BATCH_TAG_LEN(ctx)) != 0)
+					m->out_len = AE_INVALID;
+				else
+					m->out_len = ct_len;
+			}
+			used = blocks = pads = npass = 0;
+		}
+		if (n < count) {
+			const block *ctp = (const block *)msgs[n].in;
+			unsigned full = (unsigned)(msgs[n].in_len - BATCH_TAG_LEN(ctx)) / 16;
+			block offset = gen_offset_from_nonce(ctx, msgs[n].nonce);
+
+			for (i = 0; i < full; i++, blocks++) {
+				offset = oa[blocks] = xor_block(offset, getL(ctx, ntz(i+1)));
+				da[blocks] = xor_block(offset, ctp[i]);
+			}
+			if ((msgs[n].in_len - BATCH_TAG_LEN(ctx)) % 16) {
+				offset = pa[pads++] = xor_block(offset, ctx->Lstar);
+			}
+			fa[npass] = offset;
+			pass[npass++] = n;
+			used += need;
+		}
+	}
+	return AE_SUCCESS;
+}
+
 #if USE_AES_NI
 char infoString[] = "OCB (AES-NI)";
 #elif USE_REFERENCE_AES
@@ -1212,3 +1426,10 @@ char infoString[] = "OCB (Reference AES)";
 #elif USE_OPENSSL_AES
 char infoString[] = "OCB (OpenSSL AES)";
 #endif
+
+#ifdef OCB_NAME
+extern "C" const ae_backend OCB_NAME(backend) = {
+    infoString, USE_AES_NI, ae_ctx_sizeof, ae_init, ae_clear, ae_encrypt, ae_decrypt,
+    ae_encrypt_batch, ae_decrypt_batch
+};
+#endif
@@ -0,0 +1,109 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+#include "config.h"
+
+#include <stddef.h>
+
+#include "ae.h"
+
+extern "C" {
+  extern const ae_backend ocb_openssl_backend;
+#if HAVE_AES_NI
+  extern const ae_backend ocb_aesni_backend;
+#endif
+}
+
+#if HAVE_AES_NI
+static bool cpu_has_aes_ni( void )
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports( "aes" ) && __builtin_cpu_supports( "ssse3" );
+}
+#endif
+
+/* The builds of the OCB code that this CPU can run, fastest first */
+const ae_backend *ae_backend_at( int index )
+{
+#if HAVE_AES_NI
+  if ( cpu_has_aes_ni() ) {
+    if ( index == 0 ) {
+      return &ocb_aesni_backend;
+    }
+    index--;
+  }
+#endif
+
+  return index == 0 ? &ocb_openssl_backend : NULL;
+}
+
+/* Chosen once; an ae_ctx only makes sense to the build that initialized it */
+static const ae_backend &backend( void )
+{
+  static const ae_backend *chosen = ae_backend_at( 0 );
+  return *chosen;
+}
+
+const char *ae_backend_name( void ) { return backend().name; }
+int ae_backend_hardware_aes( void ) { return backend().hardware_aes; }
+
+int ae_ctx_sizeof( void ) { return backend().ctx_sizeof(); }
+
+int ae_clear( ae_ctx *ctx ) { return backend().clear( ctx ); }
+
+int ae_init( ae_ctx *ctx, const void *key, int key_len, int nonce_len, int tag_len )
+{
+  return backend().init( ctx, key, key_len, nonce_len, tag_len );
+}
+
+int ae_encrypt( ae_ctx *ctx, const void *nonce, const void *pt, int pt_len,
+		const void *ad, int ad_len, void *ct, void *tag, int final )
+{
+  return backend().encrypt( ctx, nonce, pt, pt_len, ad, ad_len, ct, tag, final );
+}
+
+int ae_decrypt( ae_ctx *ctx, const void *nonce, const void *ct, int ct_len,
+		const void *ad, int ad_len, void *pt, const void *tag, int final )
+{
+  return backend().decrypt( ctx, nonce, ct, ct_len, ad, ad_len, pt, tag, final );
+}
+
+int ae_encrypt_batch( ae_ctx *ctx, ae_batch *msgs, int count )
+{
+  return backend().encrypt_batch( ctx, msgs, count );
+}
+
+int ae_decrypt_batch( ae_ctx *ctx, ae_batch *msgs, int count )
+{
+  return backend().decrypt_batch( ctx, msgs, count );
+}
@@ -0,0 +1,140 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <openssl/evp.h>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "prng.h"
+
+/* Changes in a child after fork(). Counted by an atfork handler where
+   there is one, since getpid() is a system call on every fill(). */
+#if HAVE_PTHREAD
+static volatile unsigned long forks_seen;
+
+static void count_fork( void ) { forks_seen++; }
+
+static unsigned long fork_count( void )
+{
+  static const int registered = pthread_atfork( NULL, NULL, count_fork );
+  if ( registered != 0 ) {
+    return getpid();
+  }
+  return forks_seen;
+}
+#else
+static unsigned long fork_count( void ) { return getpid(); }
+#endif
+
+PRNG::PRNG()
+  : ctx( EVP_CIPHER_CTX_new() ), buffer(), used( BUFFER_LEN ), since_reseed( 0 ), forks( 0 )
+{
+  if ( ctx == NULL ) {
+    throw CryptoException( "Could not allocate PRNG context." );
+  }
+
+  reseed();
+}
+
+PRNG::~PRNG()
+{
+  memset( buffer, 0, sizeof( buffer ) );
+  EVP_CIPHER_CTX_free( ctx );
+}
+
+void PRNG::rekey( const unsigned char *key )
+{
+  if ( !EVP_EncryptInit_ex( ctx, EVP_aes_128_ctr(), NULL, key, key + 16 ) ) {
+    throw CryptoException( "Could not key PRNG." );
+  }
+}
+
+void PRNG::reseed( void )
+{
+  unsigned char key[ KEY_LEN ];
+  kernel_random( key, sizeof( key ) );
+  rekey( key );
+  memset( key, 0, sizeof( key ) );
+
+  used = BUFFER_LEN; /* discard anything left from before */
+  since_reseed = 0;
+  forks = fork_count();
+}
+
+/* Next block of keystream, of which the first KEY_LEN bytes become the
+   next key and are wiped */
+void PRNG::refill( void )
+{
+  if ( since_reseed >= RESEED_INTERVAL ) {
+    reseed();
+  }
+
+  int len;
+  memset( buffer, 0, sizeof( buffer ) );
+  if ( !EVP_EncryptUpdate( ctx, buffer, &len, buffer, sizeof( buffer ) )
+       || (len != int( sizeof( buffer ) )) ) {
+    throw CryptoException( "Could not run PRNG." );
+  }
+
+  rekey( buffer );
+  memset( buffer, 0, KEY_LEN );
+  used = KEY_LEN;
+  since_reseed += BUFFER_LEN;
+}
+
+void PRNG::fill( void *dest, size_t size )
+{
+  if ( fork_count() != forks ) {
+    reseed();
+  }
+
+  unsigned char *out = static_cast<unsigned char *>( dest );
+  while ( size > 0 ) {
+    if ( used == BUFFER_LEN ) {
+      refill();
+    }
+
+    size_t n = std::min( size, BUFFER_LEN - used );
+    memcpy( out, buffer + used, n );
+    memset( buffer + used, 0, n ); /* handed out once only */
+    used += n;
+    out += n;
+    size -= n;
+  }
+}
@@ -34,52 +34,48 @@
 #define PRNG_HPP
 
 #include <string>
-#include <stdio.h>
-#include <errno.h>
-#include <string.h>
 #include <stdint.h>
 
 #include "crypto.h"
 
-/* Read random bytes from /dev/urandom.
+/* Random bytes for chaff and tests, from a buffered AES-CTR keystream.
 
-   We rely on stdio buffering for efficiency. */
+   The key comes from the kernel (see Crypto::kernel_random()), and is
+   replaced from the head of each new block of keystream, so earlier
+   output can't be recovered from the state. A fresh key is fetched from
+   the kernel every RESEED_INTERVAL bytes, and after a fork() so that
+   parent and child never share output. Keys for sessions come straight
+   from the kernel instead. */
 
-static const char rdev[] = "/dev/urandom";
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
 
 using namespace Crypto;
 
 class PRNG {
  private:
-  FILE *randfile;
+  static const size_t BUFFER_LEN = 4096;
+  static const size_t KEY_LEN = 16 + 16; /* AES-128 key and counter block */
+  static const uint64_t RESEED_INTERVAL = 1 << 20;
+
+  EVP_CIPHER_CTX *ctx;
+  unsigned char buffer[ BUFFER_LEN ];
+  size_t used; /* from the front of buffer */
+  uint64_t since_reseed;
+  unsigned long forks; /* fork_count() when last seeded */
+
+  void rekey( const unsigned char *key );
+  void reseed( void );
+  void refill( void );
 
   /* unimplemented to satisfy -Weffc++ */
   PRNG( const PRNG & );
   PRNG & operator=( const PRNG & );
 
  public:
-  PRNG() : randfile( fopen( rdev, "rb" ) )
-  {
-    if ( randfile == NULL ) {
-      throw CryptoException( std::string( rdev ) + ": " + strerror( errno ) );
-    }
-  }
+  PRNG();
+  ~PRNG();
 
-  ~PRNG() {
-    if ( 0 != fclose( randfile ) ) {
-      throw CryptoException( std::string( rdev ) + ": " + strerror( errno ) );
-    }
-  }
-
-  void fill( void *dest, size_t size ) {
-    if ( 0 == size ) {
-      return;
-    }
-
-    if ( 1 != fread( dest, size, 1, randfile ) ) {
-      throw CryptoException( "Could not read from " + std::string( rdev ) );
-    }
-  }
+  void fill( void *dest, size_t size );
 
   uint8_t uint8() {
     uint8_t x;
@@ -0,0 +1,309 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+
+/* Measures the crypto layer: ns per packet and GB/s of plaintext for
+   ae_encrypt()/ae_decrypt() on every OCB backend this CPU can run, their
+   batched versions, and Session encrypt/decrypt round trips with each
+   cipher, over single packet sizes and mixes of them.
+
+   "warm" reuses one context throughout. "cold" sets up a new one for
+   every packet, after evicting the caches, as a server juggling many
+   sessions might see.
+
+   Output is tab-separated, one result per line after a header, so that
+   runs can be compared to catch regressions. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "ae.h"
+#include "crypto.h"
+#include "fatal_assert.h"
+
+using namespace Crypto;
+using namespace std;
+
+/* Plaintext sizes, cycled through in order */
+struct Workload {
+  const char *name;
+  vector<int> sizes;
+
+  Workload( const char *s_name ) : name( s_name ), sizes() {}
+  Workload &add( int size, int count ) { sizes.insert( sizes.end(), count, size ); return *this; }
+  double mean_size( void ) const
+  {
+    double total = 0;
+    for ( size_t i = 0; i < sizes.size(); i++ ) {
+      total += sizes[ i ];
+    }
+    return total / sizes.size();
+  }
+};
+
+static vector<Workload> workloads( void )
+{
+  vector<Workload> w;
+  w.push_back( Workload( "ack" ).add( 32, 1 ) ); /* empty instruction */
+  w.push_back( Workload( "keystroke" ).add( 80, 1 ) ); /* small echo */
+  w.push_back( Workload( "fragment" ).add( 1400, 1 ) ); /* full-size */
+  w.push_back( Workload( "interactive" ).add( 32, 19 ).add( 80, 10 ).add( 400, 2 ).add( 1400, 1 ) );
+  w.push_back( Workload( "bulk" ).add( 1400, 28 ).add( 32, 4 ) );
+  return w;
+}
+
+static const int MAX_SIZE = 1400;
+static const int MAX_WORKLOAD = 32; /* sizes in a workload */
+static const int BATCH = 16;
+static const size_t CACHE_FLUSH_LEN = 32 << 20;
+
+static double now_ns( void )
+{
+  struct timespec ts;
+  fatal_assert( 0 == clock_gettime( CLOCK_MONOTONIC, &ts ) );
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report( const char *backend, const char *op, const Workload &w, const char *context,
+		    long packets, double elapsed_ns )
+{
+  double per_packet = elapsed_ns / packets;
+  printf( "%s\t%s\t%s\t%s\t%ld\t%.1f\t%.3f\n", backend, op, w.name, context, packets,
+	  per_packet, w.mean_size() / per_packet );
+}
+
+static char *flush_buffer;
+
+/* Push everything else out of the caches */
+static void evict_caches( void )
+{
+  for ( size_t i = 0; i < CACHE_FLUSH_LEN; i += 64 ) {
+    flush_buffer[ i ]++;
+  }
+}
+
+class Bench {
+private:
+  long packets;
+  Base64Key key;
+  AlignedBuffer ctx_buf;
+  /* plaintexts, their ciphertexts, then output, one slot per workload entry */
+  AlignedBuffer slots;
+  char nonces[ MAX_WORKLOAD ][ 16 ];
+
+  char *slot( int region, int i ) { return slots.data() + (region * MAX_WORKLOAD + i) * 2048; }
+
+public:
+  Bench( long s_packets )
+    : packets( s_packets ), key(), ctx_buf( 4096 ), slots( 3 * MAX_WORKLOAD * 2048 ), nonces()
+  {
+    for ( int i = 0; i < MAX_WORKLOAD; i++ ) {
+      memset( slot( 0, i ), 'x' + i, MAX_SIZE );
+      memset( nonces[ i ], 0, 16 );
+      nonces[ i ][ 11 ] = i;
+    }
+  }
+
+  ae_ctx *ctx( void ) { return (ae_ctx *)ctx_buf.data(); }
+
+  void init( const ae_backend *b )
+  {
+    fatal_assert( b->ctx_sizeof() <= int( ctx_buf.len() ) );
+    fatal_assert( AE_SUCCESS == b->init( ctx(), key.data(), 16, 12, 16 ) );
+  }
+
+  /* ciphertext of each workload entry, for the decrypt runs */
+  void encrypt_slots( const ae_backend *b, const Workload &w )
+  {
+    fatal_assert( w.sizes.size() <= size_t( MAX_WORKLOAD ) );
+    for ( size_t i = 0; i < w.sizes.size(); i++ ) {
+      int len = w.sizes[ i ];
+      fatal_assert( len + 16 == b->encrypt( ctx(), nonces[ i ], slot( 0, i ), len, NULL, 0,
+					     slot( 1, i ), NULL, AE_FINALIZE ) );
+    }
+  }
+
+  void ae_single( const ae_backend *b, const Workload &w, bool decrypt, bool cold )
+  {
+    init( b );
+    encrypt_slots( b, w );
+
+    long n = cold ? packets / 1000 + 1 : packets;
+    double elapsed = 0, start = now_ns();
+    for ( long p = 0; p < n; p++ ) {
+      int i = p % w.sizes.size();
+      int len = w.sizes[ i ];
+      if ( cold ) {
+	evict_caches();
+	start = now_ns();
+	init( b );
+      }
+      if ( decrypt ) {
+	fatal_assert( len == b->decrypt( ctx(), nonces[ i ], slot( 1, i ), len + 16, NULL, 0,
+					 slot( 2, i ), NULL, AE_FINALIZE ) );
+      } else {
+	fatal_assert( len + 16 == b->encrypt( ctx(), nonces[ i ], slot( 0, i ), len, NULL, 0,
+					       slot( 2, i ), NULL, AE_FINALIZE ) );
+      }
+      if ( cold ) {
+	elapsed += now_ns() - start;
+      }
+    }
+    if ( !cold ) {
+      elapsed = now_ns() - start;
+    }
+
+    report( b->name, decrypt ? "ae_decrypt" : "ae_encrypt", w, cold ? "cold" : "warm", n, elapsed );
+  }
+
+  void ae_batched( const ae_backend *b, const Workload &w, bool decrypt )
+  {
+    init( b );
+    encrypt_slots( b, w );
+
+    ae_batch msgs[ BATCH ];
+    long n = packets / BATCH;
+    double start = now_ns();
+    for ( long p = 0; p < n; p++ ) {
+      for ( int i = 0; i < BATCH; i++ ) {
+	int k = (p * BATCH + i) % w.sizes.size();
+	int len = w.sizes[ k ];
+	msgs[ i ].nonce = nonces[ k ];
+	msgs[ i ].in = slot( decrypt ? 1 : 0, k );
+	msgs[ i ].in_len = decrypt ? len + 16 : len;
+	msgs[ i ].out = slot( 2, i );
+      }
+      if ( decrypt ) {
+	b->decrypt_batch( ctx(), msgs, BATCH );
+      } else {
+	b->encrypt_batch( ctx(), msgs, BATCH );
+      }
+      for ( int i = 0; i < BATCH; i++ ) {
+	fatal_assert( msgs[ i ].out_len == msgs[ i ].in_len + (decrypt ? -16 : 16) );
+      }
+    }
+
+    report( b->name, decrypt ? "ae_decrypt_batch" : "ae_encrypt_batch", w, "warm",
+	    n * BATCH, now_ns() - start );
+  }
+
+  /* One packet each way through the copying Session calls, as the
+     examples and tests use them */
+  void session_round_trip( const char *name, uint64_t nonce_bits, const Workload &w, bool cold )
+  {
+    vector<string> texts;
+    for ( size_t i = 0; i < w.sizes.size(); i++ ) {
+      texts.push_back( string( slot( 0, 0 ), w.sizes[ i ] ) );
+    }
+
+    Session *session = new Session( key );
+    long n = cold ? packets / 1000 + 1 : packets;
+    double elapsed = 0, start = now_ns();
+    for ( long p = 0; p < n; p++ ) {
+      const string &text = texts[ p % texts.size() ];
+      if ( cold ) {
+	delete session;
+	evict_caches();
+	start = now_ns();
+	session = new Session( key );
+      }
+      string ciphertext = session->encrypt( Message( Nonce( nonce_bits | p ), text ) );
+      fatal_assert( session->decrypt( ciphertext ).text.size() == text.size() );
+      if ( cold ) {
+	elapsed += now_ns() - start;
+      }
+    }
+    if ( !cold ) {
+      elapsed = now_ns() - start;
+    }
+    delete session;
+
+    report( name, "session_round_trip", w, cold ? "cold" : "warm", n, elapsed );
+  }
+
+  Bench( const Bench & );
+  Bench & operator=( const Bench & );
+};
+
+int main( int argc, char *argv[] )
+{
+  long packets = 100000;
+  int opt;
+
+  while ( (opt = getopt( argc, argv, "n:" )) != -1 ) {
+    if ( opt == 'n' ) {
+      packets = myatoi( optarg );
+    } else {
+      fprintf( stderr, "Usage: %s [-n PACKETS]\n", argv[ 0 ] );
+      return 1;
+    }
+  }
+  fatal_assert( packets >= BATCH );
+
+  flush_buffer = (char *)calloc( CACHE_FLUSH_LEN, 1 );
+  fatal_assert( flush_buffer );
+
+  vector<Workload> w = workloads();
+  Bench bench( packets );
+
+  printf( "backend\top\tworkload\tcontext\tpackets\tns_per_packet\tgb_per_s\n" );
+
+  for ( int i = 0; const ae_backend *b = ae_backend_at( i ); i++ ) {
+    for ( size_t j = 0; j < w.size(); j++ ) {
+      for ( int cold = 0; cold < 2; cold++ ) {
+	bench.ae_single( b, w[ j ], false, cold );
+	bench.ae_single( b, w[ j ], true, cold );
+      }
+      bench.ae_batched( b, w[ j ], false );
+      bench.ae_batched( b, w[ j ], true );
+    }
+  }
+
+  for ( size_t j = 0; j < w.size(); j++ ) {
+    for ( int cold = 0; cold < 2; cold++ ) {
+      bench.session_round_trip( ae_backend_name(), 0, w[ j ], cold );
+      if ( ChaCha20Poly1305::available() ) {
+	bench.session_round_trip( "ChaCha20-Poly1305", Session::CHACHA20_NONCE_BIT, w[ j ], cold );
+      }
+    }
+  }
+
+  free( flush_buffer );
+  return 0;
+}
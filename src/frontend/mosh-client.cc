@@ -126,6 +126,15 @@ int main( int argc, char *argv[] )
   char *predict_mode = getenv( "MOSH_PREDICTION_DISPLAY" );
   /* can be NULL */
 
+  /* Read session id, given by a mosh-server daemon */
+  char *session_id = getenv( "MOSH_SESSION_ID" );
+  if ( session_id
+       && ( ( strlen( session_id ) != 8 )
+	    || ( strspn( session_id, "0123456789abcdef" ) != 8 ) ) ) {
+    fprintf( stderr, "%s: Bad MOSH_SESSION_ID (%s)\n", argv[ 0 ], session_id );
+    exit( 1 );
+  }
+
   char *key = strdup( env_key );
   if ( key == NULL ) {
     perror( "strdup" );
@@ -141,7 +150,7 @@ int main( int argc, char *argv[] )
   set_native_locale();
 
   try {
-    STMClient client( ip, port, key, predict_mode );
+    STMClient client( ip, port, key, predict_mode, session_id );
     client.init();
 
     try {
@@ -53,17 +53,29 @@
 #include <getopt.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#include <poll.h>
+#endif
 
 #ifdef HAVE_PATHS_H
 #include <paths.h>
 #endif
 
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
 #include "completeterminal.h"
 #include "swrite.h"
 #include "user.h"
 #include "fatal_assert.h"
 #include "locale_utils.h"
 #include "select.h"
+#include "spscqueue.h"
 #include "timestamp.h"
 
 #if HAVE_PTY_H
@@ -81,22 +93,44 @@
 #endif
 
 #include "networktransport.cc"
-
-typedef Network::Transport< Terminal::Complete, Network::UserStream > ServerConnection;
+#include "serverdaemon.h"
 
 void serve( int host_fd,
 	    Terminal::Complete &terminal,
 	    ServerConnection &network );
 
+#if HAVE_PTHREAD
+void serve_threaded( int host_fd,
+		     Terminal::Complete &terminal,
+		     ServerConnection &network );
+#endif
+
 int run_server( const char *desired_ip, const char *desired_port,
 		const string &command_path, char *command_argv[],
-		const int colors, bool verbose, bool with_motd );
+		const int colors, bool verbose, bool with_motd, bool threaded,
+		int hibernate_after );
+
+int run_in_daemon( int daemon_fd,
+		   const string &command_path, char *command_argv[],
+		   const int colors, bool with_motd );
+
+int run_daemon( const char *desired_ip, const char *desired_port,
+		const char *socket_path, bool verbose, int hibernate_after );
+
+int attach_in_daemon( int daemon_fd, const char *session_id );
+
+int list_daemon_sessions( int daemon_fd );
+
+void exec_command( const string &command_path, char *command_argv[],
+		   const int colors, bool with_motd, const char *utmp_entry );
 
 using namespace std;
 
 void print_usage( const char *argv0 )
 {
-  fprintf( stderr, "Usage: %s new [-s] [-v] [-i LOCALADDR] [-p PORT] [-c COLORS] [-l NAME=VALUE] [-- COMMAND...]\n", argv0 );
+  fprintf( stderr, "Usage: %s new [-s] [-v] [-t] [-i LOCALADDR] [-p PORT] [-c COLORS] [-l NAME=VALUE] [-H SECONDS] [-d] [-D SOCKET] [-A SESSION] [-- COMMAND...]\n", argv0 );
+  fprintf( stderr, "       %s daemon [-v] [-i LOCALADDR] [-p PORT] [-H SECONDS] [-D SOCKET]\n", argv0 );
+  fprintf( stderr, "       %s list [-D SOCKET]\n", argv0 );
 }
 
 void print_motd( void );
@@ -159,6 +193,14 @@ int main( int argc, char *argv[] )
   char **command_argv = NULL;
   int colors = 0;
   bool verbose = false; /* don't close stdin/stdout/stderr */
+  bool threaded = false; /* terminal emulator on its own thread */
+  bool daemon = false; /* host other servers' sessions */
+  bool use_daemon = false; /* hand the session to a running daemon */
+  char *daemon_socket = NULL;
+  const char *own_server_option = NULL; /* one that a daemon can't honor */
+  char *attach_id = NULL; /* watch a daemon's session instead */
+  int hibernate_after = 0; /* s of silence from the client; 0 never */
+  bool list_sessions = false;
   /* Will cause mosh-server not to correctly detach on old versions of sshd. */
   list<string> locale_vars;
 
@@ -178,13 +220,15 @@ int main( int argc, char *argv[] )
        && (strcmp( argv[ 1 ], "new" ) == 0) ) {
     /* new option syntax */
     int opt;
-    while ( (opt = getopt( argc - 1, argv + 1, "i:p:c:svl:" )) != -1 ) {
+    while ( (opt = getopt( argc - 1, argv + 1, "i:p:c:svtl:H:dD:A:" )) != -1 ) {
       switch ( opt ) {
       case 'i':
 	desired_ip = optarg;
+	own_server_option = "-i";
 	break;
       case 'p':
 	desired_port = optarg;
+	own_server_option = "-p";
 	break;
       case 's':
 	desired_ip = strdup( get_SSH_IP().c_str() );
@@ -195,15 +239,77 @@ int main( int argc, char *argv[] )
 	break;
       case 'v':
 	verbose = true;
+	own_server_option = "-v";
+	break;
+      case 't':
+	own_server_option = "-t";
+#if HAVE_PTHREAD
+	threaded = true;
+#else
+	fprintf( stderr, "%s: Built without thread support; ignoring -t.\n", argv[ 0 ] );
+#endif
 	break;
       case 'l':
 	locale_vars.push_back( string( optarg ) );
 	break;
+      case 'H':
+	hibernate_after = myatoi( optarg );
+	own_server_option = "-H";
+	break;
+      case 'd':
+	use_daemon = true;
+	break;
+      case 'D':
+	daemon_socket = optarg;
+	break;
+      case 'A':
+	attach_id = optarg;
+	break;
       default:
 	print_usage( argv[ 0 ] );
 	/* don't die on unknown options */
       }
     }
+  } else if ( (argc >= 2)
+	      && (strcmp( argv[ 1 ], "daemon" ) == 0) ) {
+    daemon = true;
+    int opt;
+    while ( (opt = getopt( argc - 1, argv + 1, "i:p:H:D:v" )) != -1 ) {
+      switch ( opt ) {
+      case 'i':
+	desired_ip = optarg;
+	break;
+      case 'p':
+	desired_port = optarg;
+	break;
+      case 'D':
+	daemon_socket = optarg;
+	break;
+      case 'H':
+	hibernate_after = myatoi( optarg );
+	break;
+      case 'v':
+	verbose = true;
+	break;
+      default:
+	print_usage( argv[ 0 ] );
+	exit( 1 );
+      }
+    }
+  } else if ( (argc >= 2)
+	      && (strcmp( argv[ 1 ], "list" ) == 0) ) {
+    list_sessions = true;
+    int opt;
+    while ( (opt = getopt( argc - 1, argv + 1, "D:" )) != -1 ) {
+      switch ( opt ) {
+      case 'D':
+	daemon_socket = optarg;
+	break;
+      default:
+	print_usage( argv[ 0 ] );
+	exit( 1 );
+      }
+    }
   } else if ( argc == 1 ) {
     /* legacy argument parsing for older client wrapper script */
     /* do nothing */
@@ -232,6 +338,12 @@ int main( int argc, char *argv[] )
     exit( 1 );
   }
 
+  if ( hibernate_after < 0 ) {
+    fprintf( stderr, "%s: Bad hibernation delay (%d)\n", argv[ 0 ], hibernate_after );
+    print_usage( argv[ 0 ] );
+    exit( 1 );
+  }
+
   bool with_motd = false;
 
   /* Get shell */
@@ -308,7 +420,42 @@ int main( int argc, char *argv[] )
   }
 
   try {
-    return run_server( desired_ip, desired_port, command_path, command_argv, colors, verbose, with_motd );
+    if ( daemon ) {
+      return run_daemon( desired_ip, desired_port, daemon_socket, verbose, hibernate_after );
+    }
+
+    /* -s is fine: the daemon only listens where it listens. */
+    if ( (use_daemon || daemon_socket || attach_id) && own_server_option ) {
+      fprintf( stderr, "%s: %s does not apply to a session in a daemon\n", argv[ 0 ], own_server_option );
+      print_usage( argv[ 0 ] );
+      return 1;
+    }
+
+    if ( attach_id || list_sessions ) {
+      const char *socket_path = daemon_socket ? daemon_socket : MOSH_DAEMON_SOCKET;
+      int daemon_fd = ServerDaemon::connect_to_daemon( socket_path );
+      if ( daemon_fd < 0 ) {
+	fprintf( stderr, "%s: No mosh-server daemon at %s\n", argv[ 0 ], socket_path );
+	return 1;
+      }
+      return attach_id ? attach_in_daemon( daemon_fd, attach_id ) : list_daemon_sessions( daemon_fd );
+    }
+
+    /* Only on request, since the session then reports an id that
+       older mosh scripts and clients don't expect. With -d and no
+       daemon running, start a server of our own as usual. */
+    if ( use_daemon || daemon_socket ) {
+      int daemon_fd = ServerDaemon::connect_to_daemon( daemon_socket ? daemon_socket : MOSH_DAEMON_SOCKET );
+      if ( daemon_fd >= 0 ) {
+	return run_in_daemon( daemon_fd, command_path, command_argv, colors, with_motd );
+      } else if ( daemon_socket ) {
+	fprintf( stderr, "%s: No mosh-server daemon at %s\n", argv[ 0 ], daemon_socket );
+	return 1;
+      }
+    }
+
+    return run_server( desired_ip, desired_port, command_path, command_argv, colors, verbose, with_motd, threaded,
+		       hibernate_after );
   } catch ( const Network::NetworkException& e ) {
     fprintf( stderr, "Network exception: %s: %s\n",
 	     e.function.c_str(), strerror( e.the_errno ) );
@@ -322,7 +469,8 @@ int main( int argc, char *argv[] )
 
 int run_server( const char *desired_ip, const char *desired_port,
 		const string &command_path, char *command_argv[],
-		const int colors, bool verbose, bool with_motd ) {
+		const int colors, bool verbose, bool with_motd, bool threaded,
+		int hibernate_after ) {
   /* get initial window size */
   struct winsize window_size;
   if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ) {
@@ -341,6 +489,7 @@ int run_server( const char *desired_ip, const char *desired_port,
   if ( verbose ) {
     network->set_verbose();
   }
+  network->set_hibernate_after( uint64_t( hibernate_after ) * 1000 );
 
   printf( "\nMOSH CONNECT %d %s\n", network->port(), network->get_key().c_str() );
   fflush( stdout );
@@ -378,6 +527,9 @@ int run_server( const char *desired_ip, const char *desired_port,
   fprintf( stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>.\nThis is free software: you are free to change and redistribute it.\nThere is NO WARRANTY, to the extent permitted by law.\n\n" );
 
   fprintf( stderr, "[mosh-server detached, pid = %d]\n", (int)getpid() );
+  if ( verbose ) {
+    fprintf( stderr, "[mosh-server crypto: %s]\n", ae_backend_name() );
+  }
 
   int master;
 
@@ -434,45 +586,21 @@ int run_server( const char *desired_ip, const char *desired_port,
     /* close server-related file descriptors */
     delete network;
 
-    /* set TERM */
-    const char default_term[] = "xterm";
-    const char color_term[] = "xterm-256color";
-
-    if ( setenv( "TERM", (colors == 256) ? color_term : default_term, true ) < 0 ) {
-      perror( "setenv" );
-      exit( 1 );
-    }
-
-    /* ask ncurses to send UTF-8 instead of ISO 2022 for line-drawing chars */
-    if ( setenv( "NCURSES_NO_UTF8_ACS", "1", true ) < 0 ) {
-      perror( "setenv" );
-      exit( 1 );
-    }
-
-    /* clear STY environment variable so GNU screen regards us as top level */
-    if ( unsetenv( "STY" ) < 0 ) {
-      perror( "unsetenv" );
-      exit( 1 );
-    }
-
-    chdir_homedir();
-
-    if ( with_motd && (!motd_hushed()) ) {
-      print_motd();
-      warn_unattached( utmp_entry );
-    }
-
-    Crypto::reenable_dumping_core();
-
-    if ( execvp( command_path.c_str(), command_argv ) < 0 ) {
-      perror( "execvp" );
-      _exit( 1 );
-    }
+    exec_command( command_path, command_argv, colors, with_motd, utmp_entry );
   } else {
     /* parent */
 
     try {
+#if HAVE_PTHREAD
+      if ( threaded ) {
+	serve_threaded( master, terminal, *network );
+      } else {
+	serve( master, terminal, *network );
+      }
+#else
+      fatal_assert( !threaded );
       serve( master, terminal, *network );
+#endif
     } catch ( const Network::NetworkException& e ) {
       fprintf( stderr, "Network exception: %s: %s\n",
 	       e.function.c_str(), strerror( e.the_errno ) );
@@ -490,6 +618,14 @@ int run_server( const char *desired_ip, const char *desired_port,
       exit( 1 );
     }
 
+    if ( verbose ) {
+      const Network::DropCounts &drops = network->get_drop_counts();
+      fprintf( stderr, "Dropped %llu datagrams: %llu malformed, %llu misdirected, %llu replayed, %llu forged.\n",
+	       (unsigned long long)drops.total(), (unsigned long long)drops.malformed,
+	       (unsigned long long)drops.misdirected, (unsigned long long)drops.replayed,
+	       (unsigned long long)drops.forged );
+    }
+
     delete network;
   }
 
@@ -498,12 +634,192 @@ int run_server( const char *desired_ip, const char *desired_port,
   return 0;
 }
 
+/* Starts the command much as run_server() does, but leaves its pty to the
+   daemon on daemon_fd instead of serving it from a process of its own */
+int run_in_daemon( int daemon_fd,
+		   const string &command_path, char *command_argv[],
+		   const int colors, bool with_motd )
+{
+  struct winsize window_size;
+  if ( ioctl( STDIN_FILENO, TIOCGWINSZ, &window_size ) < 0 ) {
+    perror( "ioctl TIOCGWINSZ" );
+    fprintf( stderr, "If running with ssh, please use -t argument to provide a PTY.\n" );
+    exit( 1 );
+  }
+
+  struct termios child_termios;
+  if ( tcgetattr( STDIN_FILENO, &child_termios ) < 0 ) {
+    perror( "tcgetattr" );
+    exit( 1 );
+  }
+
+#ifdef HAVE_IUTF8
+  child_termios.c_iflag |= IUTF8;
+#endif
+
+  char utmp_entry[ 64 ] = { 0 };
+
+#ifdef HAVE_UTEMPTER
+  /* the daemon makes the entry, under our pid, as run_server() would */
+  snprintf( utmp_entry, 64, "mosh [%d]", getpid() );
+#endif
+
+  int master;
+  pid_t child = forkpty( &master, NULL, &child_termios, &window_size );
+
+  if ( child == -1 ) {
+    perror( "forkpty" );
+    exit( 1 );
+  }
+
+  if ( child == 0 ) {
+    /* the daemon connection is close-on-exec */
+    exec_command( command_path, command_argv, colors, with_motd, utmp_entry );
+  }
+
+  string connect_line;
+  bool handed_off = ServerDaemon::hand_off( daemon_fd, master, &connect_line );
+
+  /* without a daemon holding it too, the shell gets SIGHUP */
+  close( master );
+  close( daemon_fd );
+
+  if ( !handed_off ) {
+    return 1;
+  }
+
+  printf( "\n%s\n", connect_line.c_str() );
+  fflush( stdout );
+
+  fprintf( stderr, "\nmosh-server (%s)\n", PACKAGE_STRING );
+  fprintf( stderr, "[mosh-server daemon has the session, shell pid = %d]\n", (int)child );
+
+  return 0;
+}
+
+/* Another client for a session the daemon already has */
+int attach_in_daemon( int daemon_fd, const char *session_id )
+{
+  string connect_line;
+  bool attached = ServerDaemon::attach( daemon_fd, session_id, &connect_line );
+  close( daemon_fd );
+
+  if ( !attached ) {
+    return 1;
+  }
+
+  printf( "\n%s\n", connect_line.c_str() );
+  fflush( stdout );
+
+  fprintf( stderr, "\nmosh-server (%s)\n", PACKAGE_STRING );
+  fprintf( stderr, "[mosh-server daemon attached another client to session %s]\n", session_id );
+
+  return 0;
+}
+
+int list_daemon_sessions( int daemon_fd )
+{
+  string listing;
+  bool listed = ServerDaemon::request_list( daemon_fd, &listing );
+  close( daemon_fd );
+
+  if ( !listed ) {
+    return 1;
+  }
+
+  printf( "SESSION   SIZE     CLIENTS\n" );
+  for ( size_t start = 0, end; ( end = listing.find( '\n', start ) ) != string::npos; start = end + 1 ) {
+    unsigned int id, width, height, clients;
+    if ( 4 == sscanf( listing.substr( start, end - start ).c_str(), "MOSH SESSION %x %ux%u %u",
+		      &id, &width, &height, &clients ) ) {
+      char size[ 32 ];
+      snprintf( size, sizeof( size ), "%ux%u", width, height );
+      printf( "%08x  %-7s  %u\n", id, size, clients );
+    }
+  }
+
+  return 0;
+}
+
+int run_daemon( const char *desired_ip, const char *desired_port,
+		const char *socket_path, bool verbose, int hibernate_after )
+{
+  ServerDaemon daemon( desired_ip, desired_port ? desired_port : MOSH_DAEMON_PORT,
+		       socket_path ? socket_path : MOSH_DAEMON_SOCKET, verbose,
+		       uint64_t( hibernate_after ) * 1000 );
+
+  /* don't let a hangup or a vanished pty kill every session */
+  struct sigaction sa;
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = 0;
+  fatal_assert( 0 == sigfillset( &sa.sa_mask ) );
+  fatal_assert( 0 == sigaction( SIGHUP, &sa, NULL ) );
+  fatal_assert( 0 == sigaction( SIGPIPE, &sa, NULL ) );
+
+  daemon.run();
+
+  return 0;
+}
+
+/* In the child of forkpty(): the environment, then the command */
+void exec_command( const string &command_path, char *command_argv[],
+		   const int colors, bool with_motd, const char *utmp_entry )
+{
+  /* set TERM */
+  const char default_term[] = "xterm";
+  const char color_term[] = "xterm-256color";
+
+  if ( setenv( "TERM", (colors == 256) ? color_term : default_term, true ) < 0 ) {
+    perror( "setenv" );
+    exit( 1 );
+  }
+
+  /* ask ncurses to send UTF-8 instead of ISO 2022 for line-drawing chars */
+  if ( setenv( "NCURSES_NO_UTF8_ACS", "1", true ) < 0 ) {
+    perror( "setenv" );
+    exit( 1 );
+  }
+
+  /* clear STY environment variable so GNU screen regards us as top level */
+  if ( unsetenv( "STY" ) < 0 ) {
+    perror( "unsetenv" );
+    exit( 1 );
+  }
+
+  chdir_homedir();
+
+  if ( with_motd && (!motd_hushed()) ) {
+    print_motd();
+    warn_unattached( utmp_entry );
+  }
+
+  Crypto::reenable_dumping_core();
+
+  if ( execvp( command_path.c_str(), command_argv ) < 0 ) {
+    perror( "execvp" );
+    _exit( 1 );
+  }
+}
+
+/* What a hibernating server can do without until the client is back */
+static void release_memory( void )
+{
+  Network::get_compressor().release();
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim( 0 );
+#endif
+}
+
 void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network )
 {
   /* prepare to poll for events */
   Select &sel = Select::get_instance();
+  if ( getenv( "MOSH_IO_URING" ) && !sel.use_io_uring() ) {
+    fprintf( stderr, "io_uring not available; using select.\n" );
+  }
   sel.add_fd( network.fd() );
   sel.add_fd( host_fd );
+  sel.add_read_buffer( host_fd, 16384 );
   sel.add_signal( SIGTERM );
   sel.add_signal( SIGINT );
 
@@ -534,7 +850,7 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
       now = Network::timestamp();
       uint64_t time_since_remote_state = now - network.get_latest_remote_state().timestamp;
 
-      if ( sel.read( network.fd() ) ) {
+      if ( sel.read( network.fd() ) || network.recv_pending() ) {
 	/* packet received from the network */
 	network.recv();
 	
@@ -577,7 +893,7 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
 	  }
 	  
 	  /* write any writeback octets back to the host */
-	  if ( swrite( host_fd, terminal_to_host.c_str(), terminal_to_host.length() ) < 0 ) {
+	  if ( sel.queue_write( host_fd, terminal_to_host.data(), terminal_to_host.length() ) < 0 ) {
 	    break;
 	  }
 
@@ -601,11 +917,10 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
       
       if ( sel.read( host_fd ) ) {
 	/* input from the host needs to be fed to the terminal */
-	const int buf_size = 16384;
-	char buf[ buf_size ];
+	const char *buf;
 	
 	/* fill buffer if possible */
-	ssize_t bytes_read = read( host_fd, buf, buf_size );
+	ssize_t bytes_read = sel.read_data( host_fd, &buf );
 
         /* If the pty slave is closed, reading from the master can fail with
            EIO (see #264).  So we treat errors on read() like EOF. */
@@ -626,7 +941,7 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
 	}
 
 	/* write any writeback octets back to the host */
-	if ( swrite( host_fd, terminal_to_host.c_str(), terminal_to_host.length() ) < 0 ) {
+	if ( sel.queue_write( host_fd, terminal_to_host.data(), terminal_to_host.length() ) < 0 ) {
 	  break;
 	}
       }
@@ -698,7 +1013,11 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
         break;
       }
 
+      bool was_hibernating = network.hibernating();
       network.tick();
+      if ( network.hibernating() && !was_hibernating ) {
+	release_memory();
+      }
     } catch ( const Network::NetworkException& e ) {
       fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
       spin();
@@ -710,8 +1029,387 @@ void serve( int host_fd, Terminal::Complete &terminal, ServerConnection &network
       }
     }
   }
+
+  sel.flush_writes();
 }
 
+#if HAVE_PTHREAD
+/* With -t, the pty and the terminal emulator get a thread of their own,
+   and the network thread only ever sees copies of the terminal that the
+   emulator has finished with. Everything between the two goes through a
+   pair of queues, with a byte down a pipe to wake up the other side. */
+
+struct HostEvent {
+  enum Type { SNAPSHOT, HOST_CLOSED, HOST_FAILED };
+
+  Type type;
+  Terminal::Complete *snapshot; /* for SNAPSHOT, owned by the receiver */
+
+  HostEvent() : type( SNAPSHOT ), snapshot( NULL ) {}
+  HostEvent( Type s_type, Terminal::Complete *s_snapshot = NULL )
+    : type( s_type ), snapshot( s_snapshot ) {}
+};
+
+struct ClientInput {
+  string diff; /* of the UserStream */
+  uint64_t frame_num;
+
+  ClientInput() : diff(), frame_num( 0 ) {}
+  ClientInput( const string &s_diff, uint64_t s_frame_num )
+    : diff( s_diff ), frame_num( s_frame_num ) {}
+};
+
+class HostPipeline {
+private:
+  /* not implemented */
+  HostPipeline( const HostPipeline & );
+  HostPipeline &operator=( const HostPipeline & );
+
+  static void make_wakeup_pipe( int fds[ 2 ] )
+  {
+    fatal_assert( 0 == pipe( fds ) );
+    for ( int i = 0; i < 2; i++ ) {
+      fatal_assert( 0 == fcntl( fds[ i ], F_SETFD, FD_CLOEXEC ) );
+      fatal_assert( 0 == fcntl( fds[ i ], F_SETFL, O_NONBLOCK ) );
+    }
+  }
+
+  static void wake( int fd )
+  {
+    char c = 0;
+    /* a full pipe will wake the other side anyway */
+    ssize_t unused __attribute((unused)) = write( fd, &c, 1 );
+  }
+
+public:
+  int host_fd;
+  Terminal::Complete &terminal; /* the host thread's alone */
+
+  SPSCQueue<HostEvent> to_network;
+  SPSCQueue<ClientInput> to_host;
+  int network_wakeup[ 2 ], host_wakeup[ 2 ];
+  volatile int quit;
+
+  HostPipeline( int s_host_fd, Terminal::Complete &s_terminal )
+    : host_fd( s_host_fd ), terminal( s_terminal ), to_network(), to_host(), quit( 0 )
+  {
+    make_wakeup_pipe( network_wakeup );
+    make_wakeup_pipe( host_wakeup );
+  }
+
+  ~HostPipeline()
+  {
+    HostEvent event;
+    while ( to_network.pop( event ) ) {
+      delete event.snapshot;
+    }
+
+    close( network_wakeup[ 0 ] );
+    close( network_wakeup[ 1 ] );
+    close( host_wakeup[ 0 ] );
+    close( host_wakeup[ 1 ] );
+  }
+
+  static void drain( int fd )
+  {
+    char buf[ 64 ];
+    while ( read( fd, buf, sizeof( buf ) ) > 0 ) {}
+  }
+
+  void post( const HostEvent &event ) { to_network.push( event ); wake( network_wakeup[ 1 ] ); }
+  void post( const ClientInput &input ) { to_host.push( input ); wake( host_wakeup[ 1 ] ); }
+  void stop( void ) { quit = 1; __sync_synchronize(); wake( host_wakeup[ 1 ] ); }
+};
+
+static void *host_thread( void *arg )
+{
+  HostPipeline &pipeline = *static_cast<HostPipeline *>( arg );
+  Terminal::Complete &terminal = pipeline.terminal;
+  int host_fd = pipeline.host_fd;
+  bool host_open = true;
+
+  while ( 1 ) {
+    __sync_synchronize();
+    if ( pipeline.quit ) {
+      break;
+    }
+
+    struct pollfd fds[ 2 ];
+    fds[ 0 ].fd = pipeline.host_wakeup[ 0 ];
+    fds[ 1 ].fd = host_fd;
+    fds[ 0 ].events = fds[ 1 ].events = POLLIN;
+    fds[ 0 ].revents = fds[ 1 ].revents = 0;
+
+    int timeout = terminal.wait_time( timestamp() );
+    if ( poll( fds, host_open ? 2 : 1, (timeout == INT_MAX) ? -1 : timeout ) < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      perror( "poll" );
+      pipeline.post( HostEvent( HostEvent::HOST_FAILED ) );
+      break;
+    }
+
+    freeze_timestamp();
+    uint64_t now = timestamp();
+
+    bool changed = false;
+    string terminal_to_host;
+
+    /* keystrokes and resizes from the client */
+    HostPipeline::drain( pipeline.host_wakeup[ 0 ] );
+    ClientInput input;
+    while ( pipeline.to_host.pop( input ) ) {
+      Network::UserStream us;
+      us.apply_string( input.diff );
+      for ( size_t i = 0; i < us.size(); i++ ) {
+	terminal_to_host += terminal.act( us.get_action( i ) );
+	if ( typeid( *us.get_action( i ) ) == typeid( Parser::Resize ) ) {
+	  /* tell child process of resize */
+	  const Parser::Resize *res = static_cast<const Parser::Resize *>( us.get_action( i ) );
+	  struct winsize window_size;
+	  if ( ioctl( host_fd, TIOCGWINSZ, &window_size ) < 0 ) {
+	    perror( "ioctl TIOCGWINSZ" );
+	    pipeline.post( HostEvent( HostEvent::HOST_FAILED ) );
+	    return NULL;
+	  }
+	  window_size.ws_col = res->width;
+	  window_size.ws_row = res->height;
+	  if ( ioctl( host_fd, TIOCSWINSZ, &window_size ) < 0 ) {
+	    perror( "ioctl TIOCSWINSZ" );
+	    pipeline.post( HostEvent( HostEvent::HOST_FAILED ) );
+	    return NULL;
+	  }
+	}
+      }
+
+      if ( !us.empty() ) {
+	/* register input frame number for future echo ack */
+	terminal.register_input_frame( input.frame_num, now );
+      }
+      changed = true;
+    }
+
+    if ( host_open && fds[ 1 ].revents ) {
+      /* input from the host needs to be fed to the terminal */
+      const int buf_size = 16384;
+      char buf[ buf_size ];
+
+      /* If the pty slave is closed, reading from the master can fail with
+	 EIO (see #264).  So we treat errors on read() like EOF. */
+      ssize_t bytes_read = read( host_fd, buf, buf_size );
+      if ( bytes_read <= 0 ) {
+	host_open = false;
+	pipeline.post( HostEvent( HostEvent::HOST_CLOSED ) );
+      } else {
+	terminal_to_host += terminal.act( string( buf, bytes_read ) );
+	changed = true;
+      }
+    }
+
+    /* write any writeback octets back to the host */
+    if ( swrite( host_fd, terminal_to_host.c_str(), terminal_to_host.length() ) < 0 ) {
+      pipeline.post( HostEvent( HostEvent::HOST_FAILED ) );
+      break;
+    }
+
+    if ( terminal.set_echo_ack( now ) ) {
+      changed = true;
+    }
+
+    if ( changed ) {
+      pipeline.post( HostEvent( HostEvent::SNAPSHOT, new Terminal::Complete( terminal ) ) );
+    }
+  }
+
+  return NULL;
+}
+
+/* The network half of serve(), with the terminal on the host thread */
+void serve_threaded( int host_fd, Terminal::Complete &terminal, ServerConnection &network )
+{
+  HostPipeline pipeline( host_fd, terminal );
+
+  /* prepare to poll for events */
+  Select &sel = Select::get_instance();
+  sel.add_fd( network.fd() );
+  sel.add_fd( pipeline.network_wakeup[ 0 ] );
+  sel.add_signal( SIGTERM );
+  sel.add_signal( SIGINT );
+
+  /* only now, so the host thread has the signals blocked too */
+  pthread_t host;
+  fatal_assert( 0 == pthread_create( &host, NULL, host_thread, &pipeline ) );
+
+  uint64_t last_remote_num = network.get_remote_state_num();
+  bool host_closed = false;
+
+  #ifdef HAVE_UTEMPTER
+  bool connected_utmp = false;
+
+  std::string saved_addr("");
+  #endif
+
+  while ( 1 ) {
+    try {
+      uint64_t now = Network::timestamp();
+
+      const int timeout_if_no_client = 60000;
+      int timeout = network.wait_time();
+      if ( !network.has_remote_addr() ) {
+        timeout = min( timeout, timeout_if_no_client );
+      }
+
+      int active_fds = sel.select( timeout );
+      if ( active_fds < 0 ) {
+	perror( "select" );
+	break;
+      }
+
+      now = Network::timestamp();
+      uint64_t time_since_remote_state = now - network.get_latest_remote_state().timestamp;
+
+      if ( sel.read( network.fd() ) || network.recv_pending() ) {
+	/* packet received from the network */
+	network.recv();
+
+	/* hand new user input to the terminal */
+	if ( network.get_remote_state_num() != last_remote_num ) {
+	  last_remote_num = network.get_remote_state_num();
+	  pipeline.post( ClientInput( network.get_remote_diff(), last_remote_num ) );
+
+	  #ifdef HAVE_UTEMPTER
+	  /* update utmp entry if we have become "connected" */
+          std::string remoteAddress = network.getRemoteIP();
+	  if ( (!connected_utmp) || ( saved_addr != remoteAddress ) ) {
+	    utempter_remove_record( host_fd );
+
+	    saved_addr = remoteAddress;
+
+	    char tmp[ 64 ];
+	    snprintf( tmp, 64, "%s via mosh [%d]", saved_addr.c_str(), getpid() );
+	    utempter_add_record( host_fd, tmp );
+
+	    connected_utmp = true;
+	  }
+	  #endif
+	}
+      }
+
+      if ( sel.read( pipeline.network_wakeup[ 0 ] ) ) {
+	/* only the newest terminal is worth sending */
+	HostPipeline::drain( pipeline.network_wakeup[ 0 ] );
+	Terminal::Complete *latest = NULL;
+	bool host_failed = false;
+	HostEvent event;
+	while ( pipeline.to_network.pop( event ) ) {
+	  switch ( event.type ) {
+	  case HostEvent::SNAPSHOT:
+	    delete latest;
+	    latest = event.snapshot;
+	    break;
+	  case HostEvent::HOST_CLOSED:
+	    host_closed = true;
+	    break;
+	  case HostEvent::HOST_FAILED:
+	    host_failed = true;
+	    break;
+	  }
+	}
+
+	if ( latest ) {
+	  /* update client with new state of terminal */
+	  if ( !network.shutdown_in_progress() ) {
+	    network.set_current_state( *latest );
+	  }
+	  delete latest;
+	}
+
+	if ( host_failed ) {
+	  break;
+	}
+      }
+
+      /* until there's a client, let the 60-second timer take care of this */
+      if ( host_closed && network.has_remote_addr() && !network.shutdown_in_progress() ) {
+	network.start_shutdown();
+      }
+
+      if ( sel.any_signal() ) {
+	/* shutdown signal */
+	if ( network.has_remote_addr() && (!network.shutdown_in_progress()) ) {
+	  network.start_shutdown();
+	} else {
+	  break;
+	}
+      }
+
+      if ( sel.error( network.fd() ) ) {
+	/* network problem */
+	break;
+      }
+
+      /* quit if our shutdown has been acknowledged */
+      if ( network.shutdown_in_progress() && network.shutdown_acknowledged() ) {
+	break;
+      }
+
+      /* quit after shutdown acknowledgement timeout */
+      if ( network.shutdown_in_progress() && network.shutdown_ack_timed_out() ) {
+	break;
+      }
+
+      /* quit if we received and acknowledged a shutdown request */
+      if ( network.counterparty_shutdown_ack_sent() ) {
+	break;
+      }
+
+      #ifdef HAVE_UTEMPTER
+      /* update utmp if has been more than 10 seconds since heard from client */
+      if ( connected_utmp ) {
+	if ( time_since_remote_state > 10000 ) {
+	  utempter_remove_record( host_fd );
+
+	  char tmp[ 64 ];
+	  snprintf( tmp, 64, "mosh [%d]", getpid() );
+	  utempter_add_record( host_fd, tmp );
+
+	  connected_utmp = false;
+	}
+      }
+      #endif
+
+      if ( !network.has_remote_addr()
+           && time_since_remote_state >= uint64_t( timeout_if_no_client ) ) {
+        fprintf( stderr, "No connection within %d seconds.\n",
+                 timeout_if_no_client / 1000 );
+        break;
+      }
+
+      bool was_hibernating = network.hibernating();
+      network.tick();
+      if ( network.hibernating() && !was_hibernating ) {
+	release_memory();
+      }
+    } catch ( const Network::NetworkException& e ) {
+      fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+      spin();
+    } catch ( const Crypto::CryptoException& e ) {
+      if ( e.fatal ) {
+	pipeline.stop();
+	fatal_assert( 0 == pthread_join( host, NULL ) );
+        throw;
+      } else {
+        fprintf( stderr, "Crypto exception: %s\n", e.text.c_str() );
+      }
+    }
+  }
+
+  pipeline.stop();
+  fatal_assert( 0 == pthread_join( host, NULL ) );
+}
+#endif
+
 /* OpenSSH prints the motd on startup, so we will too */
 void print_motd( void )
 {
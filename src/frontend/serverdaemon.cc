@@ -0,0 +1,1000 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <typeinfo>
+#include <new>
+#include <algorithm>
+#include <functional>
+#include <set>
+
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+#ifdef HAVE_UTEMPTER
+#include <utempter.h>
+#endif
+
+#include "serverdaemon.h"
+#include "swrite.h"
+#include "select.h"
+#include "timestamp.h"
+
+#include "networktransport.cc"
+
+using namespace std;
+
+/* "mosh-server new" sends this, with the pty master attached */
+static const char DAEMON_REQUEST[] = "MOSH NEW\n";
+/* ...or this and a session id, for another client of a running session */
+static const char ATTACH_REQUEST[] = "MOSH ATTACH ";
+/* ...or this, for the sessions the asking user may attach to */
+static const char LIST_REQUEST[] = "MOSH LIST\n";
+
+DaemonSession::DaemonSession( int s_host_fd, int s_owner, int s_utmp_pid, int width, int height,
+			      Network::SharedPort &port )
+  : host_fd( s_host_fd ), host_open( true ), owner( s_owner ), utmp_pid( s_utmp_pid ), id( 0 ),
+    diff_cache(), terminal( width, height ), blank(), viewers(),
+    deadline( 0 ), to_host(), asleep( false ), last_heard( 0 ), utmp_addr()
+{
+  terminal.set_diff_cache( &diff_cache );
+  viewers.push_back( new DaemonViewer( terminal, blank, port ) );
+  id = viewers.front()->network.get_session_id();
+}
+
+DaemonSession::~DaemonSession()
+{
+  for ( list<DaemonViewer *>::iterator i = viewers.begin(); i != viewers.end(); i++ ) {
+    delete *i;
+  }
+}
+
+DaemonViewer *DaemonSession::attach( Network::SharedPort &port )
+{
+  /* what a client starts from, at the size it is about to be told */
+  Terminal::Complete initial( terminal.get_fb().ds.get_width(), terminal.get_fb().ds.get_height() );
+  DaemonViewer *v = new DaemonViewer( initial, blank, port );
+  v->network.get_current_state().set_screen( terminal );
+  viewers.push_back( v );
+  return v;
+}
+
+/* The uid at the other end of a Unix socket, or -1 */
+static int peer_uid( int fd )
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t cred_len = sizeof( cred );
+  if ( 0 == getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len ) ) {
+    return cred.uid;
+  }
+#endif
+  return -1;
+}
+
+/* The pid at the other end of a Unix socket, or -1 */
+static int peer_pid( int fd )
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t cred_len = sizeof( cred );
+  if ( 0 == getsockopt( fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len ) ) {
+    return cred.pid;
+  }
+#endif
+  return -1;
+}
+
+/* Keeps utmp as serve() does: whose client is connected, or, given "",
+   that nobody is */
+static void update_utmp( DaemonSession &s, const string &addr )
+{
+  s.utmp_addr = addr;
+#ifdef HAVE_UTEMPTER
+  char entry[ 64 ];
+  if ( addr.empty() ) {
+    snprintf( entry, sizeof( entry ), "mosh [%d]", s.utmp_pid );
+  } else {
+    snprintf( entry, sizeof( entry ), "%s via mosh [%d]", addr.c_str(), s.utmp_pid );
+  }
+  utempter_remove_record( s.host_fd );
+  utempter_add_record( s.host_fd, entry );
+#endif
+}
+
+static void remove_utmp( DaemonSession &s )
+{
+  s.utmp_addr.clear();
+#ifdef HAVE_UTEMPTER
+  utempter_remove_record( s.host_fd );
+#endif
+}
+
+/* Sends a request, and returns everything the daemon answers */
+static string ask_daemon( int fd, const string &request )
+{
+  if ( swrite( fd, request.c_str(), request.size() ) < 0 ) {
+    return string();
+  }
+
+  string reply;
+  char buf[ 4096 ];
+  ssize_t len;
+  while ( ( reply.size() < 1048576 ) && ( ( len = read( fd, buf, sizeof( buf ) ) ) > 0 ) ) {
+    reply.append( buf, len );
+  }
+  return reply;
+}
+
+ServerDaemon::ServerDaemon( const char *desired_ip, const char *desired_port,
+			    const char *s_socket_path, bool s_verbose, uint64_t s_hibernate_after )
+  : port( desired_ip, desired_port ),
+    socket_path( s_socket_path ),
+    listen_fd( -1 ),
+    verbose( s_verbose ),
+    hibernate_after( s_hibernate_after ),
+    all_hibernating( false ),
+    requests(),
+    sessions(),
+    clients(),
+    sessions_awake( 0 ),
+    wakeups()
+{
+  listen_unix();
+}
+
+ServerDaemon::~ServerDaemon()
+{
+  while ( !sessions.empty() ) {
+    end_session( sessions.begin()->second );
+  }
+
+  Select &sel = Select::get_instance();
+  for ( list<Request>::const_iterator i = requests.begin(); i != requests.end(); i++ ) {
+    sel.remove_fd( i->fd );
+    close( i->fd );
+  }
+
+  stop_listening();
+}
+
+int ServerDaemon::connect_to_daemon( const char *path )
+{
+  struct sockaddr_un addr;
+  if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+    return -1;
+  }
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) {
+    return -1;
+  }
+  /* not for the shell */
+  if ( ( fcntl( fd, F_SETFD, FD_CLOEXEC ) < 0 )
+       || ( ::connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 ) ) {
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+bool ServerDaemon::hand_off( int fd, int master, string *connect_line )
+{
+  struct iovec iov;
+  iov.iov_base = const_cast<char *>( DAEMON_REQUEST );
+  iov.iov_len = strlen( DAEMON_REQUEST );
+
+  union {
+    struct cmsghdr align;
+    char buf[ CMSG_SPACE( sizeof( int ) ) ];
+  } control;
+  memset( &control, 0, sizeof( control ) );
+
+  struct msghdr msg;
+  memset( &msg, 0, sizeof( msg ) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof( control.buf );
+
+  struct cmsghdr *cm = CMSG_FIRSTHDR( &msg );
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN( sizeof( int ) );
+  memcpy( CMSG_DATA( cm ), &master, sizeof( master ) );
+
+  if ( sendmsg( fd, &msg, 0 ) < 0 ) {
+    perror( "sendmsg" );
+    return false;
+  }
+
+  /* one line back */
+  string reply;
+  char c;
+  while ( ( reply.size() < 256 ) && ( read( fd, &c, 1 ) == 1 ) && ( c != '\n' ) ) {
+    reply += c;
+  }
+
+  if ( reply.compare( 0, 13, "MOSH CONNECT " ) == 0 ) {
+    *connect_line = reply;
+    return true;
+  }
+
+  fprintf( stderr, "mosh-server daemon: %s\n", reply.empty() ? "no answer" : reply.c_str() );
+  return false;
+}
+
+bool ServerDaemon::attach( int fd, const char *session_id, string *connect_line )
+{
+  string reply = ask_daemon( fd, string( ATTACH_REQUEST ) + session_id + "\n" );
+  size_t end = reply.find( '\n' );
+  if ( end != string::npos ) {
+    reply.erase( end );
+  }
+
+  if ( reply.compare( 0, 13, "MOSH CONNECT " ) == 0 ) {
+    *connect_line = reply;
+    return true;
+  }
+
+  fprintf( stderr, "mosh-server daemon: %s\n", reply.empty() ? "no answer" : reply.c_str() );
+  return false;
+}
+
+bool ServerDaemon::request_list( int fd, string *listing )
+{
+  *listing = ask_daemon( fd, LIST_REQUEST );
+  if ( listing->compare( 0, 11, "MOSH ERROR " ) == 0 ) {
+    fprintf( stderr, "mosh-server daemon: %s", listing->c_str() );
+    return false;
+  }
+  return true;
+}
+
+void ServerDaemon::listen_unix( void )
+{
+  struct sockaddr_un addr;
+  if ( socket_path.size() >= sizeof( addr.sun_path ) ) {
+    throw Network::NetworkException( socket_path, ENAMETOOLONG );
+  }
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, socket_path.c_str() );
+
+  /* don't take over from one that is still answering */
+  int other = connect_to_daemon( socket_path.c_str() );
+  if ( other >= 0 ) {
+    close( other );
+    throw Network::NetworkException( socket_path, EADDRINUSE );
+  }
+  unlink( socket_path.c_str() );
+
+  listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( listen_fd < 0 ) {
+    throw Network::NetworkException( "socket", errno );
+  }
+
+  /* any user may hand over a session; it is already theirs */
+  if ( ( bind( listen_fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 )
+       || ( chmod( socket_path.c_str(), 0666 ) < 0 )
+       || ( listen( listen_fd, 64 ) < 0 )
+       || ( fcntl( listen_fd, F_SETFL, O_NONBLOCK ) < 0 ) ) {
+    int saved_errno = errno;
+    close( listen_fd );
+    listen_fd = -1;
+    throw Network::NetworkException( socket_path, saved_errno );
+  }
+}
+
+void ServerDaemon::stop_listening( void )
+{
+  if ( listen_fd < 0 ) {
+    return;
+  }
+
+  Select::get_instance().remove_fd( listen_fd );
+  close( listen_fd );
+  listen_fd = -1;
+  unlink( socket_path.c_str() );
+}
+
+void ServerDaemon::accept_request( void )
+{
+  int fd = accept( listen_fd, NULL, NULL );
+  if ( fd < 0 ) {
+    if ( ( errno != EAGAIN ) && ( errno != EWOULDBLOCK ) && ( errno != EINTR ) ) {
+      perror( "accept" );
+    }
+    return;
+  }
+
+  if ( requests.size() >= 64 ) {
+    close( fd ); /* someone is holding connections open */
+    return;
+  }
+
+  Select::get_instance().add_fd( fd );
+  requests.push_back( Request( fd, Network::timestamp() + REQUEST_TIMEOUT ) );
+}
+
+/* True once the request on fd has been answered, one way or the other */
+bool ServerDaemon::answer_request( int fd )
+{
+  char buf[ 64 ];
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sizeof( buf );
+
+  union {
+    struct cmsghdr align;
+    char buf[ CMSG_SPACE( sizeof( int ) ) ];
+  } control;
+
+  struct msghdr msg;
+  memset( &msg, 0, sizeof( msg ) );
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof( control.buf );
+
+  ssize_t len = recvmsg( fd, &msg, MSG_DONTWAIT );
+  if ( ( len < 0 ) && ( ( errno == EAGAIN ) || ( errno == EWOULDBLOCK ) || ( errno == EINTR ) ) ) {
+    return false;
+  }
+
+  /* the kernel closes any that didn't fit */
+  int master = -1;
+  for ( struct cmsghdr *cm = CMSG_FIRSTHDR( &msg ); ( len >= 0 ) && cm; cm = CMSG_NXTHDR( &msg, cm ) ) {
+    if ( ( cm->cmsg_level == SOL_SOCKET ) && ( cm->cmsg_type == SCM_RIGHTS )
+	 && ( cm->cmsg_len == CMSG_LEN( sizeof( int ) ) ) && ( master < 0 ) ) {
+      memcpy( &master, CMSG_DATA( cm ), sizeof( master ) );
+    }
+  }
+
+  string request( buf, max( len, ssize_t( 0 ) ) );
+  string reply;
+
+  if ( ( master >= 0 ) && ( request == DAEMON_REQUEST ) ) {
+    reply = new_session( fd, master );
+    master = -1; /* dealt with */
+  } else if ( ( master < 0 ) && ( request.compare( 0, strlen( ATTACH_REQUEST ), ATTACH_REQUEST ) == 0 )
+	      && ( request[ request.size() - 1 ] == '\n' ) ) {
+    reply = attach_viewer( fd, request.substr( strlen( ATTACH_REQUEST ),
+					       request.size() - strlen( ATTACH_REQUEST ) - 1 ) );
+  } else if ( ( master < 0 ) && ( request == LIST_REQUEST ) ) {
+    reply = list_sessions( fd );
+  } else {
+    reply = "MOSH ERROR bad request\n";
+  }
+
+  if ( master >= 0 ) {
+    close( master );
+  }
+
+  if ( swrite( fd, reply.c_str(), reply.size() ) < 0 ) {
+    /* "mosh-server new" gave up; the client times out without connecting */
+  }
+  return true;
+}
+
+size_t ServerDaemon::sessions_of( int uid ) const
+{
+  size_t count = 0;
+  for ( map<int, DaemonSession *>::const_iterator i = sessions.begin(); i != sessions.end(); i++ ) {
+    if ( i->second->owner == uid ) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Takes the pty master; the reply for "mosh-server new" */
+string ServerDaemon::new_session( int fd, int master )
+{
+  char reply[ 128 ];
+  struct winsize window_size;
+  int uid = peer_uid( fd );
+
+  if ( ioctl( master, TIOCGWINSZ, &window_size ) < 0 ) {
+    snprintf( reply, sizeof( reply ), "MOSH ERROR not a terminal\n" );
+  } else if ( ( window_size.ws_col > MAX_WINDOW_SIZE ) || ( window_size.ws_row > MAX_WINDOW_SIZE ) ) {
+    snprintf( reply, sizeof( reply ), "MOSH ERROR window too large\n" );
+  } else if ( ( sessions.size() >= MAX_SESSIONS ) || !Select::get_instance().can_hold( master ) ) {
+    snprintf( reply, sizeof( reply ), "MOSH ERROR too many sessions\n" );
+  } else if ( sessions_of( uid ) >= MAX_USER_SESSIONS ) {
+    snprintf( reply, sizeof( reply ), "MOSH ERROR too many sessions for this user\n" );
+  } else if ( fcntl( master, F_SETFL, O_NONBLOCK ) < 0 ) {
+    /* one stuck pty mustn't hold up the rest */
+    snprintf( reply, sizeof( reply ), "MOSH ERROR %s\n", strerror( errno ) );
+  } else {
+    if ( !window_size.ws_col || !window_size.ws_row ) {
+      window_size.ws_col = 80;
+      window_size.ws_row = 24;
+    }
+
+    /* named for "mosh-server new", which the shell's motd was told */
+    int pid = peer_pid( fd );
+    DaemonSession *s = new DaemonSession( master, uid, ( pid > 0 ) ? pid : int( getpid() ),
+					  window_size.ws_col, window_size.ws_row, port );
+    s->viewers.front()->network.set_hibernate_after( hibernate_after );
+    sessions[ master ] = s;
+    clients[ s->id ] = s;
+    sessions_awake++;
+    wake_at( *s, Network::timestamp() );
+    update_utmp( *s, "" );
+
+    Select &sel = Select::get_instance();
+    sel.add_fd( master );
+    sel.add_read_buffer( master, 16384 );
+
+    snprintf( reply, sizeof( reply ), "MOSH CONNECT %d %s %08x\n",
+	      port.port(), s->viewers.front()->network.get_key().c_str(), (unsigned int)s->id );
+
+    if ( verbose ) {
+      fprintf( stderr, "[session %08x started for uid %d, %d running]\n",
+	       (unsigned int)s->id, s->owner, (int)sessions.size() );
+    }
+    return reply;
+  }
+
+  close( master );
+  return reply;
+}
+
+/* Another client for a session the asking user started */
+string ServerDaemon::attach_viewer( int fd, const string &session_id )
+{
+  char *end;
+  unsigned long id = strtoul( session_id.c_str(), &end, 16 );
+  int uid = peer_uid( fd );
+
+  DaemonSession *s = NULL;
+  if ( ( session_id.size() == 8 ) && !*end ) {
+    for ( map<int, DaemonSession *>::const_iterator i = sessions.begin(); i != sessions.end(); i++ ) {
+      if ( i->second->id == id ) {
+	s = i->second;
+	break;
+      }
+    }
+  }
+
+  /* someone else's session looks the same as none at all */
+  if ( !s || ( uid < 0 ) || ( s->owner != uid ) ) {
+    return "MOSH ERROR no such session\n";
+  } else if ( !s->host_open ) {
+    return "MOSH ERROR session is ending\n";
+  } else if ( s->viewers.size() >= MAX_VIEWERS ) {
+    return "MOSH ERROR too many clients\n";
+  }
+
+  DaemonViewer *v = s->attach( port );
+  v->network.set_hibernate_after( hibernate_after );
+  clients[ v->network.get_session_id() ] = s;
+  wake_at( *s, Network::timestamp() );
+
+  char reply[ 128 ];
+  snprintf( reply, sizeof( reply ), "MOSH CONNECT %d %s %08x\n",
+	    port.port(), v->network.get_key().c_str(), (unsigned int)v->network.get_session_id() );
+
+  if ( verbose ) {
+    fprintf( stderr, "[client %08x attached to session %08x, %d watching]\n",
+	     (unsigned int)v->network.get_session_id(), (unsigned int)s->id, (int)s->viewers.size() );
+  }
+  return reply;
+}
+
+/* The asking user's sessions: id, size and number of clients */
+string ServerDaemon::list_sessions( int fd )
+{
+  int uid = peer_uid( fd );
+  if ( uid < 0 ) {
+    return "MOSH ERROR who is asking?\n";
+  }
+
+  string listing;
+  for ( map<int, DaemonSession *>::const_iterator i = sessions.begin(); i != sessions.end(); i++ ) {
+    const DaemonSession &s = *i->second;
+    if ( ( s.owner != uid ) || !s.host_open ) {
+      continue;
+    }
+    char line[ 128 ];
+    snprintf( line, sizeof( line ), "MOSH SESSION %08x %dx%d %d\n", (unsigned int)s.id,
+	      s.terminal.get_fb().ds.get_width(), s.terminal.get_fb().ds.get_height(),
+	      (int)s.viewers.size() );
+    listing += line;
+  }
+  return listing;
+}
+
+/* Writes what it can without blocking; false if the pty has gone */
+bool ServerDaemon::write_to_host( DaemonSession &s )
+{
+  while ( !s.to_host.empty() ) {
+    ssize_t written = write( s.host_fd, s.to_host.data(), s.to_host.size() );
+    if ( written < 0 ) {
+      if ( errno == EINTR ) {
+	continue;
+      }
+      return ( errno == EAGAIN ) || ( errno == EWOULDBLOCK );
+    }
+    s.to_host.erase( 0, written );
+  }
+  return true;
+}
+
+/* One pass of serve()'s loop, for one session. False when it is over. */
+bool ServerDaemon::service( DaemonSession &s, uint64_t now )
+{
+  Select &sel = Select::get_instance();
+  Terminal::Complete &terminal = s.terminal;
+
+  /* is new user input available for the terminal? */
+  for ( list<DaemonViewer *>::iterator i = s.viewers.begin(); i != s.viewers.end(); ) {
+    if ( (*i)->network.recv_pending() && !receive( s, **i, now ) ) {
+      end_viewer( s, *i );
+      i = s.viewers.erase( i );
+    } else {
+      i++;
+    }
+  }
+
+  if ( s.host_open && sel.read( s.host_fd ) ) {
+    /* input from the host needs to be fed to the terminal */
+    const char *buf;
+    ssize_t bytes_read = sel.read_data( s.host_fd, &buf );
+
+    if ( bytes_read > 0 ) {
+      s.to_host += terminal.act( string( buf, bytes_read ) );
+    } else if ( ( bytes_read == 0 ) || ( errno != EAGAIN ) ) {
+      /* the shell has gone (EIO, see #264) */
+      hang_up( s );
+    }
+  }
+
+  if ( s.host_open && sel.error( s.host_fd ) ) {
+    /* host problem */
+    hang_up( s );
+  }
+
+  /* write any writeback octets back to the host */
+  if ( s.host_open && !write_to_host( s ) ) {
+    hang_up( s );
+  }
+
+  /* every client gets the screen, and whatever else is due */
+  for ( list<DaemonViewer *>::iterator i = s.viewers.begin(); i != s.viewers.end(); ) {
+    if ( !tick( s, **i, now ) ) {
+      end_viewer( s, *i );
+      i = s.viewers.erase( i );
+    } else {
+      i++;
+    }
+  }
+
+  if ( s.viewers.empty() ) {
+    return false;
+  }
+
+  /* nobody is looking, so nobody will ask for the same update twice */
+  bool asleep = true;
+  for ( list<DaemonViewer *>::const_iterator i = s.viewers.begin(); i != s.viewers.end(); i++ ) {
+    asleep = asleep && (*i)->network.hibernating();
+  }
+  if ( asleep ) {
+    s.diff_cache.clear();
+  }
+  if ( asleep && !s.asleep ) {
+    sessions_awake--;
+  } else if ( !asleep && s.asleep ) {
+    sessions_awake++;
+  }
+  s.asleep = asleep;
+
+  if ( !s.utmp_addr.empty() && ( now - s.last_heard > uint64_t( UTMP_IDLE_TIME ) ) ) {
+    update_utmp( s, "" );
+  }
+
+  /* nothing to do for this session until then, unless something arrives */
+  int wait = INT_MAX;
+  for ( list<DaemonViewer *>::const_iterator i = s.viewers.begin(); i != s.viewers.end(); i++ ) {
+    const ServerConnection &network = (*i)->network;
+    wait = min( wait, min( (*i)->network.wait_time(), network.get_current_state().wait_time( now ) ) );
+    if ( !network.has_remote_addr() ) {
+      wait = min( wait, NO_CLIENT_TIMEOUT );
+    }
+  }
+  if ( !s.to_host.empty() ) {
+    wait = min( wait, HOST_RETRY_INTERVAL );
+  }
+  if ( !s.utmp_addr.empty() ) {
+    wait = min( wait, int( s.last_heard + UTMP_IDLE_TIME + 1 - now ) );
+  }
+  wake_at( s, now + wait );
+
+  return true;
+}
+
+/* What one client sent; false when it should go. A client sending what
+   no client would throws, and its session ends. */
+bool ServerDaemon::receive( DaemonSession &s, DaemonViewer &v, uint64_t now )
+{
+  ServerConnection &network = v.network;
+  Terminal::Complete &terminal = s.terminal;
+
+  try {
+    network.recv();
+
+    if ( network.get_remote_state_num() == v.last_remote_num ) {
+      return true;
+    }
+    v.last_remote_num = network.get_remote_state_num();
+
+    Network::UserStream us;
+    us.apply_string( network.get_remote_diff() );
+    /* apply userstream to terminal */
+    for ( size_t i = 0; i < us.size(); i++ ) {
+      bool resize = ( typeid( *us.get_action( i ) ) == typeid( Parser::Resize ) );
+      const Parser::Resize *res = static_cast<const Parser::Resize *>( us.get_action( i ) );
+      if ( resize && ( ( res->width > MAX_WINDOW_SIZE ) || ( res->height > MAX_WINDOW_SIZE ) ) ) {
+	throw Network::NetworkException( "window too large", 0 );
+      }
+
+      string response = terminal.act( us.get_action( i ) );
+      if ( s.host_open ) {
+	s.to_host += response;
+      }
+      if ( s.host_open && resize ) {
+	/* tell child process of resize */
+	struct winsize window_size;
+	if ( ioctl( s.host_fd, TIOCGWINSZ, &window_size ) < 0 ) {
+	  hang_up( s );
+	  continue;
+	}
+	window_size.ws_col = res->width;
+	window_size.ws_row = res->height;
+	if ( ioctl( s.host_fd, TIOCSWINSZ, &window_size ) < 0 ) {
+	  hang_up( s );
+	}
+      }
+    }
+
+    if ( !us.empty() && !network.shutdown_in_progress() ) {
+      /* register input frame number for future echo ack */
+      network.get_current_state().register_input_frame( v.last_remote_num, now );
+    }
+
+    /* update utmp entry if we have become "connected" */
+    s.last_heard = now;
+    if ( s.host_open && ( s.utmp_addr != network.getRemoteIP() ) ) {
+      update_utmp( s, network.getRemoteIP() );
+    }
+  } catch ( const Crypto::CryptoException& e ) {
+    fprintf( stderr, "Crypto exception: %s\n", e.text.c_str() );
+    if ( e.fatal ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Brings one client up to date; false when it should go */
+bool ServerDaemon::tick( DaemonSession &s, DaemonViewer &v, uint64_t now )
+{
+  ServerConnection &network = v.network;
+
+  try {
+    uint64_t time_since_remote_state = now - network.get_latest_remote_state().timestamp;
+
+    /* quit if our shutdown has been acknowledged, or given up on */
+    if ( network.shutdown_in_progress()
+	 && ( network.shutdown_acknowledged() || network.shutdown_ack_timed_out() ) ) {
+      return false;
+    }
+
+    /* quit if we received and acknowledged a shutdown request */
+    if ( network.counterparty_shutdown_ack_sent() ) {
+      return false;
+    }
+
+    /* one nobody connected to isn't kept once the shell or the daemon is going */
+    if ( !network.has_remote_addr()
+	 && ( !s.host_open || ( listen_fd < 0 )
+	      || ( time_since_remote_state >= uint64_t( NO_CLIENT_TIMEOUT ) ) ) ) {
+      return false;
+    }
+
+    if ( !network.shutdown_in_progress() ) {
+      /* update client with new state of terminal, and new echo ack,
+	 looking through the const accessor so as not to reset the
+	 sender's timers on every tick */
+      const Terminal::Complete &state = static_cast<const ServerConnection &>( network ).get_current_state();
+      if ( !state.same_screen( s.terminal ) ) {
+	network.get_current_state().set_screen( s.terminal );
+      }
+      if ( state.get_newest_echo_ack( now ) != state.get_echo_ack() ) {
+	network.get_current_state().set_echo_ack( now );
+      }
+    }
+
+    network.tick();
+  } catch ( const Network::NetworkException& e ) {
+    fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+  } catch ( const Crypto::CryptoException& e ) {
+    fprintf( stderr, "Crypto exception: %s\n", e.text.c_str() );
+    if ( e.fatal ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* As service(), but what would take a standalone server down takes only
+   this session with it: a client's garbage, or running out of memory */
+bool ServerDaemon::service_or_end( DaemonSession &s, uint64_t now )
+{
+  try {
+    return service( s, now );
+  } catch ( const Network::NetworkException& e ) {
+    fprintf( stderr, "[session %08x ended: %s]\n", (unsigned int)s.id, e.function.c_str() );
+  } catch ( const std::bad_alloc& ) {
+    fprintf( stderr, "[session %08x ended: out of memory]\n", (unsigned int)s.id );
+  }
+  return false;
+}
+
+/* The shell has gone: stop watching the pty, and tell every client */
+void ServerDaemon::hang_up( DaemonSession &s )
+{
+  if ( !s.host_open ) {
+    return;
+  }
+  s.host_open = false;
+  s.to_host.clear();
+  remove_utmp( s );
+  Select::get_instance().remove_fd( s.host_fd );
+
+  for ( list<DaemonViewer *>::iterator i = s.viewers.begin(); i != s.viewers.end(); i++ ) {
+    ServerConnection &network = (*i)->network;
+    if ( network.has_remote_addr() && !network.shutdown_in_progress() ) {
+      network.start_shutdown();
+    }
+  }
+}
+
+void ServerDaemon::end_viewer( DaemonSession &s, DaemonViewer *v )
+{
+  if ( verbose ) {
+    const Network::DropCounts &drops = v->network.get_drop_counts();
+    fprintf( stderr, "[client %08x of session %08x gone, %llu datagrams dropped]\n",
+	     (unsigned int)v->network.get_session_id(), (unsigned int)s.id,
+	     (unsigned long long)drops.total() );
+  }
+  clients.erase( v->network.get_session_id() );
+  delete v;
+}
+
+void ServerDaemon::end_session( DaemonSession *s )
+{
+  if ( verbose ) {
+    fprintf( stderr, "[session %08x ended, %llu screen updates reused]\n",
+	     (unsigned int)s->id, (unsigned long long)s->diff_cache.get_hits() );
+  }
+
+  if ( s->host_open ) {
+    remove_utmp( *s );
+    Select::get_instance().remove_fd( s->host_fd );
+  }
+  /* the shell gets SIGHUP */
+  if ( close( s->host_fd ) < 0 ) {
+    perror( "close" );
+  }
+
+  for ( list<DaemonViewer *>::const_iterator i = s->viewers.begin(); i != s->viewers.end(); i++ ) {
+    clients.erase( (*i)->network.get_session_id() );
+  }
+  if ( !s->asleep ) {
+    sessions_awake--;
+  }
+  sessions.erase( s->host_fd );
+  delete s;
+}
+
+/* Sets the session's next visit. What it replaces stays on the heap,
+   to be passed over when it comes up. */
+void ServerDaemon::wake_at( DaemonSession &s, uint64_t when )
+{
+  s.deadline = when;
+  wakeups.push_back( Wakeup( when, s.host_fd ) );
+  push_heap( wakeups.begin(), wakeups.end(), greater<Wakeup>() );
+
+  /* don't let those pile up */
+  if ( wakeups.size() > 2 * sessions.size() + 64 ) {
+    wakeups.clear();
+    for ( map<int, DaemonSession *>::const_iterator i = sessions.begin(); i != sessions.end(); i++ ) {
+      wakeups.push_back( Wakeup( i->second->deadline, i->first ) );
+    }
+    make_heap( wakeups.begin(), wakeups.end(), greater<Wakeup>() );
+  }
+}
+
+/* With every client of every session hibernating, what they share can go
+   too; it comes back when someone next needs it */
+void ServerDaemon::release_memory( void )
+{
+  bool asleep = !sessions.empty() && ( sessions_awake == 0 );
+
+  if ( asleep && !all_hibernating ) {
+    if ( verbose ) {
+      fprintf( stderr, "[all %d sessions hibernating]\n", (int)sessions.size() );
+    }
+    Network::get_compressor().release();
+#ifdef HAVE_MALLOC_TRIM
+    malloc_trim( 0 );
+#endif
+  }
+  all_hibernating = asleep;
+}
+
+void ServerDaemon::run( void )
+{
+  Select &sel = Select::get_instance();
+  sel.add_fd( port.fd() );
+  sel.add_fd( listen_fd );
+  sel.add_signal( SIGTERM );
+  sel.add_signal( SIGINT );
+
+  if ( verbose ) {
+    fprintf( stderr, "[mosh-server daemon on UDP port %d, socket %s, crypto: %s]\n",
+	     port.port(), socket_path.c_str(), ae_backend_name() );
+  }
+
+  /* after the first signal, only until the sessions have shut down */
+  while ( ( listen_fd >= 0 ) || !sessions.empty() ) {
+    uint64_t now = Network::timestamp();
+
+    /* sleep until the first session or request needs a look */
+    int timeout = -1;
+    if ( !wakeups.empty() ) {
+      uint64_t first = wakeups.front().when;
+      timeout = ( first > now ) ? int( min( first - now, uint64_t( INT_MAX ) ) ) : 0;
+    }
+    for ( list<Request>::const_iterator i = requests.begin(); i != requests.end(); i++ ) {
+      int wait = ( i->deadline > now ) ? int( i->deadline - now ) : 0;
+      if ( ( timeout < 0 ) || ( wait < timeout ) ) {
+	timeout = wait;
+      }
+    }
+
+    if ( sel.select( timeout ) < 0 ) {
+      perror( "select" );
+      break;
+    }
+    now = Network::timestamp();
+
+    /* the sessions with something to do this time round */
+    set<DaemonSession *> due;
+
+    if ( sel.read( port.fd() ) ) {
+      vector<uint32_t> delivered;
+      try {
+	port.receive( &delivered );
+      } catch ( const Network::NetworkException& e ) {
+	fprintf( stderr, "%s: %s\n", e.function.c_str(), strerror( e.the_errno ) );
+      }
+      for ( vector<uint32_t>::const_iterator i = delivered.begin(); i != delivered.end(); i++ ) {
+	map<uint32_t, DaemonSession *>::const_iterator client = clients.find( *i );
+	if ( client != clients.end() ) {
+	  due.insert( client->second );
+	}
+      }
+    }
+
+    if ( sel.any_signal() ) {
+      if ( listen_fd < 0 ) {
+	break; /* asked twice */
+      }
+      stop_listening();
+      for ( map<int, DaemonSession *>::iterator i = sessions.begin(); i != sessions.end(); i++ ) {
+	DaemonSession &s = *i->second;
+	for ( list<DaemonViewer *>::iterator j = s.viewers.begin(); j != s.viewers.end(); j++ ) {
+	  ServerConnection &network = (*j)->network;
+	  if ( network.has_remote_addr() && !network.shutdown_in_progress() ) {
+	    network.start_shutdown();
+	  }
+	}
+	wake_at( s, now ); /* the ones nobody connected to go then */
+      }
+    }
+
+    if ( ( listen_fd >= 0 ) && sel.read( listen_fd ) ) {
+      accept_request();
+    }
+
+    for ( list<Request>::iterator i = requests.begin(); i != requests.end(); ) {
+      if ( ( sel.read( i->fd ) && answer_request( i->fd ) ) || ( now >= i->deadline ) ) {
+	sel.remove_fd( i->fd );
+	close( i->fd );
+	i = requests.erase( i );
+      } else {
+	i++;
+      }
+    }
+
+    const vector<int> &ready = sel.ready_fds();
+    for ( vector<int>::const_iterator i = ready.begin(); i != ready.end(); i++ ) {
+      map<int, DaemonSession *>::const_iterator host = sessions.find( *i );
+      if ( host != sessions.end() ) {
+	due.insert( host->second );
+      }
+    }
+
+    while ( !wakeups.empty() && ( wakeups.front().when <= now ) ) {
+      Wakeup wakeup = wakeups.front();
+      pop_heap( wakeups.begin(), wakeups.end(), greater<Wakeup>() );
+      wakeups.pop_back();
+      map<int, DaemonSession *>::const_iterator host = sessions.find( wakeup.host_fd );
+      if ( ( host != sessions.end() ) && ( host->second->deadline == wakeup.when ) ) {
+	due.insert( host->second );
+      }
+    }
+
+    for ( set<DaemonSession *>::const_iterator i = due.begin(); i != due.end(); i++ ) {
+      if ( !service_or_end( **i, now ) ) {
+	end_session( *i );
+      }
+    }
+
+    release_memory();
+  }
+
+  if ( verbose ) {
+    fprintf( stderr, "[mosh-server daemon exiting, %llu stray datagrams]\n",
+	     (unsigned long long)port.get_strays() );
+  }
+}
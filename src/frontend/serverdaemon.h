@@ -0,0 +1,198 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef SERVER_DAEMON_HPP
+#define SERVER_DAEMON_HPP
+
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "completeterminal.h"
+#include "networktransport.h"
+#include "user.h"
+
+/* Where "mosh-server new" looks for a daemon to take its session */
+#define MOSH_DAEMON_SOCKET "/run/mosh-server.sock"
+/* Just below the range standalone servers pick from */
+#define MOSH_DAEMON_PORT "60000"
+
+typedef Network::Transport< Terminal::Complete, Network::UserStream > ServerConnection;
+
+/* One client of a DaemonSession. Each has its own key and sent states,
+   and numbers its own input, so its copy of the terminal carries its
+   own echo ack. */
+class DaemonViewer {
+public:
+  ServerConnection network;
+  uint64_t last_remote_num;
+
+  DaemonViewer( Terminal::Complete &initial_state, Network::UserStream &blank,
+		Network::SharedPort &port )
+    : network( initial_state, blank, port ),
+      last_remote_num( network.get_remote_state_num() )
+  {}
+
+private:
+  /* not implemented */
+  DaemonViewer( const DaemonViewer & );
+  DaemonViewer &operator=( const DaemonViewer & );
+};
+
+/* One session of a ServerDaemon: a shell and its terminal, and every
+   client watching it */
+class DaemonSession {
+public:
+  int host_fd; /* pty master, handed over by "mosh-server new" */
+  bool host_open; /* until the shell goes */
+  int owner; /* uid allowed to attach more clients, or -1 */
+  int utmp_pid; /* in its utmp entry, as a standalone server's own would be */
+  uint32_t id; /* its first client's */
+  Terminal::DiffCache diff_cache;
+  Terminal::Complete terminal;
+  Network::UserStream blank;
+  std::list<DaemonViewer *> viewers;
+
+  uint64_t deadline; /* for the next visit when nothing happens */
+  std::string to_host; /* what the pty hasn't taken yet */
+  bool asleep; /* every client hibernating */
+  uint64_t last_heard; /* from any client */
+  std::string utmp_addr; /* the client utmp says is connected, or "" */
+
+  DaemonSession( int s_host_fd, int s_owner, int s_utmp_pid, int width, int height,
+		 Network::SharedPort &port );
+  ~DaemonSession();
+
+  /* Another client, seeing the screen from scratch */
+  DaemonViewer *attach( Network::SharedPort &port );
+
+private:
+  /* not implemented */
+  DaemonSession( const DaemonSession & );
+  DaemonSession &operator=( const DaemonSession & );
+};
+
+/* Many sessions in one process, behind one UDP port. "mosh-server new"
+   still starts the shell itself, with its user's own credentials, then
+   passes the pty master over a Unix socket and exits; the daemon does
+   everything serve() would have, for all of them from one event loop.
+
+   That loop emulates every user's terminals in the daemon's one process,
+   so a crash there ends all of their sessions at once, not just one.
+   Each pass looks only at the sessions with something to do: those whose
+   pty or clients have something to read, and those whose deadline, kept
+   on a heap, has come. */
+class ServerDaemon {
+private:
+  static const size_t MAX_SESSIONS = 4096;
+  static const size_t MAX_USER_SESSIONS = 64; /* so one user can't take them all */
+  static const size_t MAX_VIEWERS = 32; /* clients of one session */
+  static const int REQUEST_TIMEOUT = 5000; /* ms for "mosh-server new" to say what it wants */
+  static const int NO_CLIENT_TIMEOUT = 60000; /* ms, as for a standalone server */
+  static const int HOST_RETRY_INTERVAL = 20; /* ms before writing to a full pty again */
+  static const int MAX_WINDOW_SIZE = 1024; /* columns, or rows; more could use up everyone's memory */
+  static const int UTMP_IDLE_TIME = 10000; /* ms without a word before utmp says nobody is connected */
+
+  Network::SharedPort port;
+  std::string socket_path;
+  int listen_fd;
+  bool verbose;
+  uint64_t hibernate_after; /* ms of silence from a client */
+  bool all_hibernating; /* and what they share has been let go */
+
+  struct Request {
+    int fd;
+    uint64_t deadline;
+
+    Request( int s_fd, uint64_t s_deadline ) : fd( s_fd ), deadline( s_deadline ) {}
+  };
+  std::list<Request> requests;
+
+  std::map<int, DaemonSession *> sessions; /* by pty master */
+  std::map<uint32_t, DaemonSession *> clients; /* by each client's session id */
+  size_t sessions_awake; /* with a client that isn't hibernating */
+
+  /* A min-heap of deadlines. One a session has since moved stays until
+     it comes up, and is passed over then. */
+  struct Wakeup {
+    uint64_t when;
+    int host_fd;
+
+    Wakeup( uint64_t s_when, int s_host_fd ) : when( s_when ), host_fd( s_host_fd ) {}
+    bool operator>( const Wakeup &other ) const { return when > other.when; }
+  };
+  std::vector<Wakeup> wakeups;
+  void wake_at( DaemonSession &s, uint64_t when );
+
+  void listen_unix( void );
+  void stop_listening( void );
+  void accept_request( void );
+  bool answer_request( int fd );
+  std::string new_session( int fd, int master );
+  std::string attach_viewer( int fd, const std::string &session_id );
+  std::string list_sessions( int fd );
+  size_t sessions_of( int uid ) const;
+  bool service( DaemonSession &s, uint64_t now );
+  bool service_or_end( DaemonSession &s, uint64_t now );
+  bool receive( DaemonSession &s, DaemonViewer &v, uint64_t now );
+  bool tick( DaemonSession &s, DaemonViewer &v, uint64_t now );
+  void hang_up( DaemonSession &s );
+  bool write_to_host( DaemonSession &s );
+  void end_viewer( DaemonSession &s, DaemonViewer *v );
+  void end_session( DaemonSession *s );
+  void release_memory( void );
+
+  /* not implemented */
+  ServerDaemon( const ServerDaemon & );
+  ServerDaemon &operator=( const ServerDaemon & );
+
+public:
+  ServerDaemon( const char *desired_ip, const char *desired_port,
+		const char *s_socket_path, bool s_verbose, uint64_t s_hibernate_after );
+  ~ServerDaemon();
+
+  /* Until SIGTERM or SIGINT, and every session has ended after it */
+  void run( void );
+
+  /* For "mosh-server new": a connection to the daemon, or -1 if none */
+  static int connect_to_daemon( const char *socket_path );
+  /* Hands the pty over, and gets back the MOSH CONNECT line for the client */
+  static bool hand_off( int fd, int master, std::string *connect_line );
+  /* A MOSH CONNECT line for another client of one of our sessions */
+  static bool attach( int fd, const char *session_id, std::string *connect_line );
+  /* Our sessions, a line each */
+  static bool request_list( int fd, std::string *listing );
+};
+
+#endif
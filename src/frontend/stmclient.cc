@@ -117,6 +117,7 @@ void STMClient::shutdown( void )
   overlays.get_notification_engine().server_heard( timestamp() );
   overlays.set_title_prefix( wstring( L"" ) );
   output_new_frame();
+  Select::get_instance().flush_writes(); /* before anything bypasses the ring */
 
   /* Restore terminal and terminal-driver state */
   swrite( STDOUT_FILENO, Terminal::Emulator::close().c_str() );
@@ -168,6 +169,10 @@ void STMClient::main_init( void )
   network = new Network::Transport< Network::UserStream, Terminal::Complete >( blank, local_terminal,
 									       key.c_str(), ip.c_str(), port );
 
+  if ( !session_id.empty() ) {
+    network->set_session_id( strtoul( session_id.c_str(), NULL, 16 ) );
+  }
+
   network->set_send_delay( 1 ); /* minimal delay on outgoing keystrokes */
 
   /* tell server the size of the terminal */
@@ -193,7 +198,8 @@ void STMClient::output_new_frame( void )
   const string diff( display.new_frame( !repaint_requested,
 					*local_framebuffer,
 					*new_state ) );
-  swrite( STDOUT_FILENO, diff.data(), diff.size() );
+  /* with io_uring, goes out as a linked write with the next select() */
+  Select::get_instance().queue_write( STDOUT_FILENO, diff.data(), diff.size() );
 
   repaint_requested = false;
 
@@ -308,6 +314,9 @@ void STMClient::main( void )
 
   /* prepare to poll for events */
   Select &sel = Select::get_instance();
+  if ( getenv( "MOSH_IO_URING" ) ) {
+    sel.use_io_uring(); /* otherwise stays with select */
+  }
   sel.add_fd( network->fd() );
   sel.add_fd( STDIN_FILENO );
 
@@ -328,7 +337,7 @@ void STMClient::main( void )
 	break;
       }
 
-      if ( sel.read( network->fd() ) ) {
+      if ( sel.read( network->fd() ) || network->recv_pending() ) {
 	/* packet received from the network */
 	if ( !process_network_input() ) { return; }
       }
@@ -47,6 +47,7 @@ private:
   std::string ip;
   int port;
   std::string key;
+  std::string session_id; /* hex, or empty if the server has the port to itself */
 
   struct termios saved_termios, raw_termios;
 
@@ -75,8 +76,9 @@ private:
   }
 
 public:
-  STMClient( const char *s_ip, int s_port, const char *s_key, const char *predict_mode )
-    : ip( s_ip ), port( s_port ), key( s_key ),
+  STMClient( const char *s_ip, int s_port, const char *s_key, const char *predict_mode,
+	     const char *s_session_id )
+    : ip( s_ip ), port( s_port ), key( s_key ), session_id( s_session_id ? s_session_id : "" ),
       saved_termios(), raw_termios(),
       window_size(),
       local_framebuffer( NULL ),
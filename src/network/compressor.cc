@@ -30,18 +30,29 @@
     also delete it here.
 */
 
+#include <string.h>
 #include <zlib.h>
 
+#include "byteorder.h"
 #include "compressor.h"
 #include "dos_assert.h"
+#include "fatal_assert.h"
 
 using namespace Network;
 using namespace std;
 
+unsigned char *Compressor::get_buffer( void )
+{
+  if ( !buffer ) {
+    buffer = new unsigned char[ BUFFER_SIZE ];
+  }
+  return buffer;
+}
+
 string Compressor::compress_str( const string &input )
 {
   long unsigned int len = BUFFER_SIZE;
-  dos_assert( Z_OK == compress( buffer, &len,
+  dos_assert( Z_OK == compress( get_buffer(), &len,
 				reinterpret_cast<const unsigned char *>( input.data() ),
 				input.size() ) );
   return string( reinterpret_cast<char *>( buffer ), len );
@@ -50,12 +61,132 @@ string Compressor::compress_str( const string &input )
 string Compressor::uncompress_str( const string &input )
 {
   long unsigned int len = BUFFER_SIZE;
-  dos_assert( Z_OK == uncompress( buffer, &len,
+  dos_assert( Z_OK == uncompress( get_buffer(), &len,
 				  reinterpret_cast<const unsigned char *>( input.data() ),
 				  input.size() ) );
   return string( reinterpret_cast<char *>( buffer ), len );
 }
 
+Compressor::~Compressor()
+{
+  release();
+}
+
+void Compressor::release( void )
+{
+  if ( deflater_ready ) {
+    deflateEnd( &deflater );
+    deflater_ready = false;
+  }
+  if ( inflater_ready ) {
+    inflateEnd( &inflater );
+    inflater_ready = false;
+  }
+  if ( buffer ) {
+    delete[] buffer;
+    buffer = NULL;
+  }
+}
+
+/* Compress against the receiver's copy of a state we both have, and skip
+   compression entirely where it can't pay for its own header. */
+string Compressor::compress_framed( const string &input, uint64_t dictionary_num,
+                                    const string &dictionary )
+{
+  string raw = string( 1, char( FRAME_RAW ) ) + input;
+  if ( input.size() < COMPRESSION_THRESHOLD ) {
+    return raw;
+  }
+
+  if ( dictionary.empty() ) {
+    /* nothing to reference, so spare the state number */
+    string plain = compress_str( input );
+    return plain.size() < raw.size() ? plain : raw;
+  }
+
+  if ( !deflater_ready ) {
+    fatal_assert( Z_OK == deflateInit( &deflater, Z_DEFAULT_COMPRESSION ) );
+    deflater_ready = true;
+  } else {
+    fatal_assert( Z_OK == deflateReset( &deflater ) );
+  }
+
+  /* zlib can only reach back one window, so keep the end */
+  size_t dictionary_len = dictionary.size() < DICTIONARY_LEN ? dictionary.size() : DICTIONARY_LEN;
+  fatal_assert( Z_OK == deflateSetDictionary( &deflater,
+                                              reinterpret_cast<const unsigned char *>( dictionary.data() + dictionary.size() - dictionary_len ),
+                                              dictionary_len ) );
+
+  deflater.next_in = reinterpret_cast<unsigned char *>( const_cast<char *>( input.data() ) );
+  deflater.avail_in = input.size();
+  deflater.next_out = get_buffer();
+  deflater.avail_out = BUFFER_SIZE;
+  fatal_assert( Z_STREAM_END == deflate( &deflater, Z_FINISH ) );
+
+  size_t len = BUFFER_SIZE - deflater.avail_out;
+  uint64_t num_net = htobe64( dictionary_num );
+
+  if ( 1 + sizeof( num_net ) + len >= raw.size() ) {
+    return raw; /* incompressible */
+  }
+
+  return string( 1, char( FRAME_DICTIONARY ) )
+    + string( reinterpret_cast<char *>( &num_net ), sizeof( num_net ) )
+    + string( reinterpret_cast<char *>( buffer ), len );
+}
+
+bool Compressor::framed_dictionary_num( const string &input, uint64_t *num )
+{
+  if ( input.empty() || (input[ 0 ] != char( FRAME_DICTIONARY )) ) {
+    return false;
+  }
+
+  uint64_t num_net;
+  dos_assert( input.size() >= 1 + sizeof( num_net ) );
+  memcpy( &num_net, input.data() + 1, sizeof( num_net ) );
+  *num = be64toh( num_net );
+  return true;
+}
+
+string Compressor::uncompress_framed( const string &input, const string &dictionary )
+{
+  dos_assert( !input.empty() );
+
+  if ( input[ 0 ] == char( FRAME_RAW ) ) {
+    return string( input.begin() + 1, input.end() );
+  } else if ( input[ 0 ] != char( FRAME_DICTIONARY ) ) {
+    return uncompress_str( input ); /* legacy */
+  }
+
+  const size_t header_len = 1 + sizeof( uint64_t );
+  dos_assert( input.size() > header_len );
+
+  if ( !inflater_ready ) {
+    fatal_assert( Z_OK == inflateInit( &inflater ) );
+    inflater_ready = true;
+  } else {
+    fatal_assert( Z_OK == inflateReset( &inflater ) );
+  }
+
+  inflater.next_in = reinterpret_cast<unsigned char *>( const_cast<char *>( input.data() + header_len ) );
+  inflater.avail_in = input.size() - header_len;
+  inflater.next_out = get_buffer();
+  inflater.avail_out = BUFFER_SIZE;
+
+  int ret = inflate( &inflater, Z_FINISH );
+  if ( ret == Z_NEED_DICT ) {
+    /* fails unless our copy of the state matches the sender's */
+    size_t len = dictionary.size() < DICTIONARY_LEN ? dictionary.size() : DICTIONARY_LEN;
+    dos_assert( Z_OK == inflateSetDictionary( &inflater,
+                                              reinterpret_cast<const unsigned char *>( dictionary.data() + dictionary.size() - len ),
+                                              len ) );
+    ret = inflate( &inflater, Z_FINISH );
+  }
+  dos_assert( Z_STREAM_END == ret );
+
+  return string( reinterpret_cast<char *>( buffer ), BUFFER_SIZE - inflater.avail_out );
+}
+
 /* construct on first use */
 Compressor & Network::get_compressor( void )
 {
@@ -34,21 +34,47 @@
 #define COMPRESSOR_H
 
 #include <string>
+#include <stdint.h>
+#include <zlib.h>
 
 namespace Network {
   class Compressor {
   private:
     static const int BUFFER_SIZE = 2048 * 2048; /* effective limit on terminal size */
+    static const size_t COMPRESSION_THRESHOLD = 64; /* smaller payloads go out as-is */
+    static const size_t DICTIONARY_LEN = 32768; /* what zlib's window can use */
 
-    unsigned char *buffer;
+    unsigned char *buffer; /* allocated on first use */
+    unsigned char *get_buffer( void );
+
+    /* kept across calls so each instruction doesn't pay for deflateInit() */
+    z_stream deflater, inflater;
+    bool deflater_ready, inflater_ready;
 
   public:
-    Compressor() : buffer( NULL ) { buffer = new unsigned char[ BUFFER_SIZE ]; }
-    ~Compressor() { if ( buffer ) { delete[] buffer; } }
+    /* Payloads for peers that advertise CAPABILITY_DICTIONARY start with
+       one of these tags, or are a bare zlib stream when there is no
+       dictionary to use. A legacy payload is a bare zlib stream too, and
+       its first octet is never either tag. */
+    enum FrameTag {
+      FRAME_RAW = 0x00, /* uncompressed */
+      FRAME_DICTIONARY = 0x01 /* 64-bit state number, then zlib with that state's dictionary */
+    };
+
+    Compressor() : buffer( NULL ), deflater(), inflater(), deflater_ready( false ), inflater_ready( false ) {}
+    ~Compressor();
+
+    /* Frees the buffer and zlib's state until they are next needed */
+    void release( void );
 
     std::string compress_str( const std::string &input );
     std::string uncompress_str( const std::string &input );
 
+    std::string compress_framed( const std::string &input, uint64_t dictionary_num,
+                                 const std::string &dictionary );
+    std::string uncompress_framed( const std::string &input, const std::string &dictionary );
+    static bool framed_dictionary_num( const std::string &input, uint64_t *num );
+
     /* unused */
     Compressor( const Compressor & );
     Compressor & operator=( const Compressor & );
@@ -36,12 +36,17 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#if defined(HAVE_UDP_SEGMENT) || defined(HAVE_UDP_GRO)
+#include <netinet/udp.h>
+#endif
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <string.h>
+#include <algorithm>
 
 #include "dos_assert.h"
 #include "byteorder.h"
@@ -55,43 +60,85 @@ using namespace Network;
 using namespace Crypto;
 
 const uint64_t DIRECTION_MASK = uint64_t(1) << 63;
-const uint64_t SEQUENCE_MASK = uint64_t(-1) ^ DIRECTION_MASK;
+const uint64_t PRECISE_MASK = uint64_t(1) << 62;
+const uint64_t CHACHA20_MASK = Session::CHACHA20_NONCE_BIT;
+const uint64_t SEQUENCE_MASK = uint64_t(-1) ^ DIRECTION_MASK ^ PRECISE_MASK ^ CHACHA20_MASK;
 
-/* Read in packet from coded string */
-Packet::Packet( string coded_packet, Session *session )
-  : seq( -1 ),
-    direction( TO_SERVER ),
-    timestamp( -1 ),
-    timestamp_reply( -1 ),
-    payload()
+const double Connection::RATE_GAIN = 1.0 / 8.0;
+const double Connection::MIN_SEND_RATE = 8; /* 64 kbit/s */
+const double Connection::INITIAL_SEND_RATE = 1250; /* 10 Mbit/s */
+const double Connection::MAX_SEND_RATE = 12500; /* 100 Mbit/s */
+
+/* IPv6 minimum, the old fixed MTU, PPPoE, Ethernet, and as much of a
+   jumbo frame as fits in Session::RECEIVE_MTU */
+const int Connection::MTU_CANDIDATES[] = { 1280, 1400, 1492, 1500, 2000 };
+const int Connection::MTU_CANDIDATE_COUNT = sizeof( MTU_CANDIDATES ) / sizeof( MTU_CANDIDATES[ 0 ] );
+
+uint64_t Packet::nonce_val( void ) const
 {
-  Message message = session->decrypt( coded_packet );
+  return (uint64_t( direction == TO_CLIENT ) << 63) | (precise ? PRECISE_MASK : 0)
+    | (chacha20 ? CHACHA20_MASK : 0) | (seq & SEQUENCE_MASK);
+}
 
-  direction = (message.nonce.val() & DIRECTION_MASK) ? TO_CLIENT : TO_SERVER;
-  seq = message.nonce.val() & SEQUENCE_MASK;
+void Packet::write_timestamps( char *dest ) const
+{
+  if ( precise ) {
+    uint32_t ts_net[ 2 ] = { htobe32( timestamp ), htobe32( timestamp_reply ) };
+    memcpy( dest, ts_net, sizeof( ts_net ) );
+  } else {
+    /* NO_TIMESTAMP truncates to the 16-bit version of itself */
+    uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
+			     static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
+    memcpy( dest, ts_net, sizeof( ts_net ) );
+  }
+}
 
-  dos_assert( message.text.size() >= 2 * sizeof( uint16_t ) );
+void Packet::read_timestamps( const char *src )
+{
+  if ( precise ) {
+    uint32_t ts_net[ 2 ];
+    memcpy( ts_net, src, sizeof( ts_net ) );
+    timestamp = be32toh( ts_net[ 0 ] );
+    timestamp_reply = be32toh( ts_net[ 1 ] );
+  } else {
+    uint16_t ts_net[ 2 ];
+    memcpy( ts_net, src, sizeof( ts_net ) );
+    timestamp = be16toh( ts_net[ 0 ] );
+    timestamp_reply = be16toh( ts_net[ 1 ] );
+    if ( timestamp == uint16_t( -1 ) ) {
+      timestamp = NO_TIMESTAMP;
+    }
+    if ( timestamp_reply == uint16_t( -1 ) ) {
+      timestamp_reply = NO_TIMESTAMP;
+    }
+  }
+}
 
-  uint16_t *data = (uint16_t *)message.text.data();
-  timestamp = be16toh( data[ 0 ] );
-  timestamp_reply = be16toh( data[ 1 ] );
+void Packet::encode_header( char *text, size_t payload_len, InPlacePacket *out ) const
+{
+  write_timestamps( text );
 
-  payload = string( message.text.begin() + 2 * sizeof( uint16_t ), message.text.end() );
+  out->text = text;
+  out->len = timestamps_len() + payload_len;
+  out->nonce_val = nonce_val();
 }
 
-/* Output coded string from packet */
-string Packet::tostring( Session *session )
+/* Returns the length of the payload, left at in.text + timestamps_len() */
+size_t Packet::decode_header( const InPlacePacket &in )
 {
-  uint64_t direction_seq = (uint64_t( direction == TO_CLIENT ) << 63) | (seq & SEQUENCE_MASK);
+  direction = (in.nonce_val & DIRECTION_MASK) ? TO_CLIENT : TO_SERVER;
+  precise = in.nonce_val & PRECISE_MASK;
+  chacha20 = in.nonce_val & CHACHA20_MASK;
+  seq = in.nonce_val & SEQUENCE_MASK;
 
-  uint16_t ts_net[ 2 ] = { static_cast<uint16_t>( htobe16( timestamp ) ),
-                           static_cast<uint16_t>( htobe16( timestamp_reply ) ) };
+  dos_assert( in.len >= timestamps_len() );
 
-  string timestamps = string( (char *)ts_net, 2 * sizeof( uint16_t ) );
+  read_timestamps( in.text );
 
-  return session->encrypt( Message( Nonce( direction_seq ), timestamps + payload ) );
+  return in.len - timestamps_len();
 }
 
+
 InternetAddress::InternetAddress() {
   remote_addr_len = sizeof(remote_addr.in6);
   memset(&remote_addr.in6, '\0', remote_addr_len);
@@ -162,6 +209,16 @@ int InternetAddress::getPort() {
   }
 }
 
+/* of a datagram to this address, without options */
+int InternetAddress::ipHeaderLen() const {
+  if(remote_addr.ss.ss_family == AF_INET6
+     && !IN6_IS_ADDR_V4MAPPED(&remote_addr.in6.sin6_addr)) {
+    return 40;
+  } else {
+    return 20;
+  }
+}
+
 void InternetAddress::setPort(int port) {
   if(remote_addr.ss.ss_family == AF_INET) {
     remote_addr.in.sin_port = htons(port);
@@ -230,28 +287,35 @@ std::string InternetAddress::toString() {
   return str;
 }
 
-Packet Connection::new_packet( string &s_payload )
+Packet Connection::new_packet( void )
 {
-  uint16_t outgoing_timestamp_reply = -1;
-
-  uint64_t now = timestamp();
-
-  if ( now - saved_timestamp_received_at < 1000 ) { /* we have a recent received timestamp */
-    /* send "corrected" timestamp advanced by how long we held it */
-    outgoing_timestamp_reply = saved_timestamp + (now - saved_timestamp_received_at);
-    saved_timestamp = -1;
+  uint32_t outgoing_timestamp_reply = Packet::NO_TIMESTAMP;
+
+  uint64_t now = timestamp_us();
+
+  if ( now - saved_timestamp_received_at < 1000000 ) { /* we have a recent received timestamp */
+    /* send "corrected" timestamp advanced by how long we held it, in
+       its own units (so only in a packet of the same kind) */
+    if ( saved_timestamp_precise == precise_timestamps ) {
+      uint64_t held = now - saved_timestamp_received_at;
+      outgoing_timestamp_reply = precise_timestamps
+	? uint32_t( saved_timestamp + held )
+	: uint16_t( saved_timestamp + held / 1000 );
+    }
+    saved_timestamp = Packet::NO_TIMESTAMP;
     saved_timestamp_received_at = 0;
   }
 
-  Packet p( next_seq++, direction, timestamp16(), outgoing_timestamp_reply, s_payload );
+  Packet p( next_seq++, direction, precise_timestamps ? timestamp32_us() : timestamp16(),
+	    outgoing_timestamp_reply, precise_timestamps, chacha20 );
 
   return p;
 }
 
-void Connection::setup( )
+/* A UDP socket with the options all of ours get */
+int Connection::new_socket( int family )
 {
-  /* create socket */
-  sock = socket( remote_addr.getFamily(), SOCK_DGRAM, 0 );
+  int sock = socket( family, SOCK_DGRAM, 0 );
   if ( sock < 0 ) {
     throw NetworkException( "socket", errno );
   }
@@ -261,13 +325,15 @@ void Connection::setup( )
   char flag = IP_PMTUDISC_DONT;
   socklen_t optlen = sizeof( flag );
   if ( setsockopt( sock, IPPROTO_IP, IP_MTU_DISCOVER, &flag, optlen ) < 0 ) {
-    throw NetworkException( "setsockopt", errno );
+    int saved_errno = errno;
+    close( sock );
+    throw NetworkException( "setsockopt", saved_errno );
   }
 #endif
 
   /* set diffserv values to AF42 + ECT */
   uint8_t dscp = IPTOS_ECN_ECT0 | IPTOS_DSCP_AF42;
-  if(remote_addr.getFamily() == AF_INET6) {
+  if(family == AF_INET6) {
     if ( setsockopt( sock, IPPROTO_IPV6, IPV6_TCLASS, &dscp, 1) < 0 ) {
       //    perror( "setsockopt( IP_TOS )" );
     }
@@ -276,27 +342,88 @@ void Connection::setup( )
       //    perror( "setsockopt( IP_TOS )" );
     }
   }
+
+  return sock;
+}
+
+void Connection::detect_offloads( void )
+{
+#ifdef HAVE_UDP_SEGMENT
+  /* the kernel knows the option if it can do GSO */
+  int segment_size = 0;
+  socklen_t segment_optlen = sizeof( segment_size );
+  use_gso = ( 0 == getsockopt( sock, IPPROTO_UDP, UDP_SEGMENT, &segment_size, &segment_optlen ) );
+#endif
+
+#ifdef HAVE_UDP_GRO
+  /* the client is the one that receives big screen updates */
+  int on = 1;
+  use_gro = !server && ( 0 == setsockopt( sock, IPPROTO_UDP, UDP_GRO, &on, sizeof( on ) ) );
+#endif
+}
+
+void Connection::setup( )
+{
+  sock = new_socket( remote_addr.getFamily() );
+  detect_offloads();
 }
 
 Connection::Connection( const char *desired_ip, const char *desired_port ) /* server */
   : sock( -1 ),
+    shared_port( NULL ),
+    session_id( 0 ),
+    session_id_len( 0 ),
     has_remote_addr( false ),
     remote_addr(),
     server( true ),
     MTU( SEND_MTU ),
     key(),
     session( key ),
+    send_buffer( BATCH_LEN * SLOT_LEN ),
+    recv_buffer( BATCH_LEN * SLOT_LEN ),
+    send_queued( 0 ),
+    recv_count( 0 ),
+    recv_next( 0 ),
+    recv_decrypted( 0 ),
+    use_mmsg( true ),
+    use_gso( false ),
+    use_gro( false ),
+    gro_buffer( Session::HEADROOM ), /* only the client coalesces */
+    gro_len( 0 ),
+    gro_offset( 0 ),
+    gro_segment_len( 0 ),
     direction( TO_CLIENT ),
     next_seq( 0 ),
     saved_timestamp( -1 ),
+    saved_timestamp_precise( false ),
     saved_timestamp_received_at( 0 ),
+    precise_timestamps( false ),
+    chacha20( false ),
     expected_receiver_seq( 0 ),
+    replay_top( 0 ),
+    replay_seen( 0 ),
+    drops(),
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
+    base_delays(),
+    base_bucket_start( 0 ),
+    queueing_delay( 0 ),
+    loss_rate( 0 ),
+    send_rate( INITIAL_SEND_RATE ),
+    last_pacing_limited( 0 ),
+    last_rate_decrease( 0 ),
+    probe_index( 0 ),
+    probe_count( 0 ),
+    probe_in_flight( 0 ),
+    next_probe_time( 0 ),
+    validated_MTU( 0 ),
     have_send_exception( false ),
     send_exception()
 {
+  reset_delay_estimate();
+  reset_mtu_search();
+
   /* The mosh wrapper always gives an IP request, in order
      to deal with multihomed servers. The port is optional. */
 
@@ -368,87 +495,529 @@ bool Connection::try_bind()
 
 Connection::Connection( const char *key_str, const char *ip, int port ) /* client */
   : sock( -1 ),
+    shared_port( NULL ),
+    session_id( 0 ),
+    session_id_len( 0 ),
     has_remote_addr( true ),
     remote_addr(ip, "", SOCK_DGRAM),
     server( false ),
     MTU( SEND_MTU ),
     key( key_str ),
     session( key ),
+    send_buffer( BATCH_LEN * SLOT_LEN ),
+    recv_buffer( BATCH_LEN * SLOT_LEN ),
+    send_queued( 0 ),
+    recv_count( 0 ),
+    recv_next( 0 ),
+    recv_decrypted( 0 ),
+    use_mmsg( true ),
+    use_gso( false ),
+    use_gro( false ),
+    gro_buffer( Session::HEADROOM + GRO_BUFFER_LEN ),
+    gro_len( 0 ),
+    gro_offset( 0 ),
+    gro_segment_len( 0 ),
     direction( TO_SERVER ),
     next_seq( 0 ),
     saved_timestamp( -1 ),
+    saved_timestamp_precise( false ),
     saved_timestamp_received_at( 0 ),
+    precise_timestamps( false ),
+    chacha20( false ),
     expected_receiver_seq( 0 ),
+    replay_top( 0 ),
+    replay_seen( 0 ),
+    drops(),
     RTT_hit( false ),
     SRTT( 1000 ),
     RTTVAR( 500 ),
+    base_delays(),
+    base_bucket_start( 0 ),
+    queueing_delay( 0 ),
+    loss_rate( 0 ),
+    send_rate( INITIAL_SEND_RATE ),
+    last_pacing_limited( 0 ),
+    last_rate_decrease( 0 ),
+    probe_index( 0 ),
+    probe_count( 0 ),
+    probe_in_flight( 0 ),
+    next_probe_time( 0 ),
+    validated_MTU( 0 ),
     have_send_exception( false ),
     send_exception()
 {
+  reset_delay_estimate();
+  reset_mtu_search();
+
   remote_addr.setPort(port);
 
   setup();
 }
 
-void Connection::send( string s )
+Connection::Connection( SharedPort &port ) /* server */
+  : sock( port.fd() ),
+    shared_port( &port ),
+    session_id( 0 ),
+    session_id_len( 0 ),
+    has_remote_addr( false ),
+    remote_addr(),
+    server( true ),
+    MTU( SEND_MTU ),
+    key(),
+    session( key ),
+    send_buffer( BATCH_LEN * SLOT_LEN ),
+    recv_buffer( BATCH_LEN * SLOT_LEN ),
+    send_queued( 0 ),
+    recv_count( 0 ),
+    recv_next( 0 ),
+    recv_decrypted( 0 ),
+    use_mmsg( true ),
+    use_gso( false ),
+    use_gro( false ),
+    gro_buffer( Session::HEADROOM ),
+    gro_len( 0 ),
+    gro_offset( 0 ),
+    gro_segment_len( 0 ),
+    direction( TO_CLIENT ),
+    next_seq( 0 ),
+    saved_timestamp( -1 ),
+    saved_timestamp_precise( false ),
+    saved_timestamp_received_at( 0 ),
+    precise_timestamps( false ),
+    chacha20( false ),
+    expected_receiver_seq( 0 ),
+    replay_top( 0 ),
+    replay_seen( 0 ),
+    drops(),
+    RTT_hit( false ),
+    SRTT( 1000 ),
+    RTTVAR( 500 ),
+    base_delays(),
+    base_bucket_start( 0 ),
+    queueing_delay( 0 ),
+    loss_rate( 0 ),
+    send_rate( INITIAL_SEND_RATE ),
+    last_pacing_limited( 0 ),
+    last_rate_decrease( 0 ),
+    probe_index( 0 ),
+    probe_count( 0 ),
+    probe_in_flight( 0 ),
+    next_probe_time( 0 ),
+    validated_MTU( 0 ),
+    have_send_exception( false ),
+    send_exception()
+{
+  reset_delay_estimate();
+  reset_mtu_search();
+
+  detect_offloads();
+  session_id = port.attach( this );
+}
+
+void Connection::queue( const char *header, size_t header_len, const string &payload )
 {
   assert( has_remote_addr );
 
-  Packet px = new_packet( s );
+  if ( send_queued == BATCH_LEN ) {
+    flush();
+  }
 
-  string p = px.tostring( &session );
+  char *text = slot_text( send_buffer, send_queued );
+  Packet px = new_packet(); /* payload goes straight into place */
+  char *body = text + px.timestamps_len();
+  size_t payload_len = header_len + payload.size();
 
-  ssize_t bytes_sent = sendto( sock, p.data(), p.size(), 0,
-			       remote_addr.toSockaddr(), remote_addr.sockaddrLen() );
+  assert( Session::buffer_len( px.timestamps_len() + payload_len ) <= size_t( SLOT_LEN ) );
 
-  if ( bytes_sent == static_cast<ssize_t>( p.size() ) ) {
-    have_send_exception = false;
+  if ( header_len ) {
+    memcpy( body, header, header_len );
+  }
+  memcpy( body + header_len, payload.data(), payload.size() );
+
+  px.encode_header( text, payload_len, &send_packets[ send_queued++ ] );
+
+  if ( session_id_len ) {
+    uint32_t id_net = htobe32( session_id );
+    memcpy( text - Session::NONCE_WIRE_LEN - session_id_len, &id_net, session_id_len );
+  }
+}
+
+/* Returns how many of the queued datagrams from first on were sent, 0 to
+   retry after turning off something the kernel rejected, or -1 */
+int Connection::send_batch( int first )
+{
+  struct msghdr hdrs[ BATCH_LEN ];
+  struct iovec iovs[ BATCH_LEN ];
+  int segments[ BATCH_LEN ]; /* datagrams in each message */
+#ifdef HAVE_UDP_SEGMENT
+  char control[ BATCH_LEN ][ CMSG_SPACE( sizeof( uint16_t ) ) ];
+#endif
+  int count = 0;
+
+  for ( int i = first; i < send_queued; count++ ) {
+    /* With GSO, a run of equal-sized datagrams (the last may be shorter)
+       goes down as one buffer, and the kernel or NIC cuts it up. */
+    int run = 1;
+    if ( use_gso ) {
+      while ( (i + run < send_queued)
+	      && (send_packets[ i + run - 1 ].len == send_packets[ i ].len)
+	      && (send_packets[ i + run ].len <= send_packets[ i ].len) ) {
+	run++;
+      }
+    }
+
+    for ( int j = i; j < i + run; j++ ) {
+      iovs[ j - first ].iov_base = slot_text( send_buffer, j ) - Session::NONCE_WIRE_LEN - session_id_len;
+      iovs[ j - first ].iov_len = send_packets[ j ].len + session_id_len;
+    }
+
+    memset( &hdrs[ count ], 0, sizeof( hdrs[ count ] ) );
+    hdrs[ count ].msg_name = remote_addr.toSockaddr();
+    hdrs[ count ].msg_namelen = remote_addr.sockaddrLen();
+    hdrs[ count ].msg_iov = &iovs[ i - first ];
+    hdrs[ count ].msg_iovlen = run;
+
+#ifdef HAVE_UDP_SEGMENT
+    if ( run > 1 ) {
+      hdrs[ count ].msg_control = control[ count ];
+      hdrs[ count ].msg_controllen = sizeof( control[ count ] );
+
+      struct cmsghdr *cm = CMSG_FIRSTHDR( &hdrs[ count ] );
+      cm->cmsg_level = IPPROTO_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+      uint16_t segment_size = send_packets[ i ].len + session_id_len;
+      memcpy( CMSG_DATA( cm ), &segment_size, sizeof( segment_size ) );
+    }
+#endif
+
+    segments[ count ] = run;
+    i += run;
+  }
+
+  int sent_msgs;
+
+#ifdef HAVE_MMSG
+  if ( use_mmsg ) {
+    struct mmsghdr msgs[ BATCH_LEN ];
+
+    for ( int i = 0; i < count; i++ ) {
+      memset( &msgs[ i ], 0, sizeof( msgs[ i ] ) );
+      msgs[ i ].msg_hdr = hdrs[ i ];
+    }
+
+    sent_msgs = sendmmsg( sock, msgs, count, 0 );
+    if ( (sent_msgs < 0) && (errno == ENOSYS) ) {
+      use_mmsg = false;
+      return 0;
+    }
   } else {
-    /* Notify the frontend on sendto() failure, but don't alter control flow.
-       sendto() success is not very meaningful because packets can be lost in
-       flight anyway. */
-    have_send_exception = true;
-    send_exception = NetworkException( "sendto", errno );
+    sent_msgs = ( sendmsg( sock, &hdrs[ 0 ], 0 ) < 0 ) ? -1 : 1;
+  }
+#else
+  sent_msgs = ( sendmsg( sock, &hdrs[ 0 ], 0 ) < 0 ) ? -1 : 1;
+#endif
+
+  if ( sent_msgs <= 0 ) {
+    if ( (segments[ 0 ] > 1) && ((errno == EIO) || (errno == EINVAL)) ) {
+      use_gso = false; /* e.g. no checksum offload on this route */
+      return 0;
+    }
+    return -1;
   }
+
+  int sent = 0;
+  for ( int i = 0; i < sent_msgs; i++ ) {
+    sent += segments[ i ];
+  }
+  return sent;
 }
 
-string Connection::recv( void )
+void Connection::hibernate( void )
 {
-  struct sockaddr_storage packet_remote_addr;
+  if ( send_queued || recv_pending() ) {
+    return; /* still in use */
+  }
+  send_buffer.discard();
+  recv_buffer.discard();
+  gro_buffer.discard();
+}
 
-  char buf[ Session::RECEIVE_MTU ];
+void Connection::flush( void )
+{
+  int sent = 0;
+
+  session.encrypt_batch( send_packets, send_queued );
+
+  while ( sent < send_queued ) {
+    int batch = send_batch( sent );
+
+    if ( batch > 0 ) {
+      have_send_exception = false;
+      sent += batch;
+    } else if ( batch < 0 ) {
+      /* Notify the frontend on sendto() failure, but don't alter control flow.
+	 sendto() success is not very meaningful because packets can be lost in
+	 flight anyway. Skip the datagram that failed and carry on. */
+      have_send_exception = true;
+      send_exception = NetworkException( "sendto", errno );
+      sent++;
+    }
+  }
+
+  send_queued = 0;
+}
+
+/* Block for one datagram, then take whatever else is already queued. */
+void Connection::receive_batch( void )
+{
+  recv_count = recv_next = recv_decrypted = 0;
+  gro_len = gro_offset = 0;
 
-  socklen_t addrlen = sizeof( packet_remote_addr );
+  if ( shared_port ) {
+    return; /* the SharedPort reads, and calls deliver() */
+  }
 
-  ssize_t received_len = recvfrom( sock, buf, Session::RECEIVE_MTU, 0, (sockaddr *)&packet_remote_addr, &addrlen );
+#ifdef HAVE_UDP_GRO
+  if ( use_gro ) {
+    receive_coalesced();
+    return;
+  }
+#endif
 
+#ifdef HAVE_MMSG
+  if ( use_mmsg ) {
+    struct mmsghdr msgs[ BATCH_LEN ];
+    struct iovec iovs[ BATCH_LEN ];
+
+    for ( int i = 0; i < BATCH_LEN; i++ ) {
+      /* receive so that the ciphertext, after the nonce, lands aligned */
+      iovs[ i ].iov_base = slot_text( recv_buffer, i ) - Session::NONCE_WIRE_LEN;
+      iovs[ i ].iov_len = Session::RECEIVE_MTU;
+      memset( &msgs[ i ], 0, sizeof( msgs[ i ] ) );
+      msgs[ i ].msg_hdr.msg_name = &recv_addrs[ i ];
+      msgs[ i ].msg_hdr.msg_namelen = sizeof( recv_addrs[ i ] );
+      msgs[ i ].msg_hdr.msg_iov = &iovs[ i ];
+      msgs[ i ].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg( sock, msgs, BATCH_LEN, MSG_WAITFORONE, NULL );
+    if ( received >= 0 ) {
+      for ( int i = 0; i < received; i++ ) {
+	recv_packets[ i ].text = slot_text( recv_buffer, i );
+	recv_packets[ i ].len = msgs[ i ].msg_len;
+	recv_addrlens[ i ] = msgs[ i ].msg_hdr.msg_namelen;
+      }
+      recv_count = received;
+      return;
+    } else if ( errno != ENOSYS ) {
+      throw NetworkException( "recvmmsg", errno );
+    }
+    use_mmsg = false;
+  }
+#endif
+
+  for ( int i = 0; i < BATCH_LEN; i++ ) {
+    recv_addrlens[ i ] = sizeof( recv_addrs[ i ] );
+
+    ssize_t received_len = recvfrom( sock, slot_text( recv_buffer, i ) - Session::NONCE_WIRE_LEN,
+				     Session::RECEIVE_MTU, i ? MSG_DONTWAIT : 0,
+				     (sockaddr *)&recv_addrs[ i ], &recv_addrlens[ i ] );
+
+    if ( received_len < 0 ) {
+      if ( i == 0 ) {
+	throw NetworkException( "recvfrom", errno );
+      }
+      break; /* drained, or an error we'll see again next time */
+    }
+
+    recv_packets[ i ].text = slot_text( recv_buffer, i );
+    recv_packets[ i ].len = received_len;
+    recv_count++;
+  }
+}
+
+#ifdef HAVE_UDP_GRO
+/* With UDP_GRO, one read can return several datagrams from the same
+   sender back to back, all gro_segment_len long except the last. */
+void Connection::receive_coalesced( void )
+{
+  char *text = gro_buffer.data() + Session::HEADROOM;
+  char control[ CMSG_SPACE( sizeof( int ) ) ];
+  struct iovec iov;
+  struct msghdr hdr;
+
+  iov.iov_base = text - Session::NONCE_WIRE_LEN;
+  iov.iov_len = GRO_BUFFER_LEN;
+  memset( &hdr, 0, sizeof( hdr ) );
+  hdr.msg_name = &recv_addrs[ 0 ];
+  hdr.msg_namelen = sizeof( recv_addrs[ 0 ] );
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof( control );
+
+  ssize_t received_len = recvmsg( sock, &hdr, 0 );
   if ( received_len < 0 ) {
-    throw NetworkException( "recvfrom", errno );
+    throw NetworkException( "recvmsg", errno );
+  }
+
+  recv_addrlens[ 0 ] = hdr.msg_namelen;
+  gro_len = gro_segment_len = received_len;
+
+  for ( struct cmsghdr *cm = CMSG_FIRSTHDR( &hdr ); cm; cm = CMSG_NXTHDR( &hdr, cm ) ) {
+    if ( (cm->cmsg_level == IPPROTO_UDP) && (cm->cmsg_type == UDP_GRO) ) {
+      int segment_size;
+      memcpy( &segment_size, CMSG_DATA( cm ), sizeof( segment_size ) );
+      if ( segment_size > 0 ) {
+	gro_segment_len = segment_size;
+      }
+    }
+  }
+}
+#endif
+
+/* The replay window covers the highest authenticated sequence number and
+   the REPLAY_WINDOW below it */
+bool Connection::replay_window_admits( uint64_t seq ) const
+{
+  if ( seq > replay_top ) {
+    return true;
+  }
+  uint64_t age = replay_top - seq;
+  return (age < REPLAY_WINDOW) && !((replay_seen >> age) & 1);
+}
+
+void Connection::replay_window_mark( uint64_t seq )
+{
+  if ( seq > replay_top ) {
+    uint64_t shift = seq - replay_top;
+    replay_seen = (shift < REPLAY_WINDOW) ? (replay_seen << shift) : 0;
+    replay_top = seq;
+  }
+  replay_seen |= uint64_t( 1 ) << (replay_top - seq);
+}
+
+/* Checks on a datagram's length and (unauthenticated) nonce, so that
+   garbage is dropped without spending AES on it. Whatever passes is still
+   authenticated, and checked against the replay window again after. */
+bool Connection::prescreen( const InPlacePacket &in )
+{
+  const size_t min_len = Session::NONCE_WIRE_LEN + Session::TAG_LEN + 2 * sizeof( uint16_t );
+  if ( (in.len < min_len) || (in.len > size_t( Session::RECEIVE_MTU )) ) {
+    drops.malformed++;
+    return false;
+  }
+
+  uint64_t nonce_net;
+  memcpy( &nonce_net, in.text - Session::NONCE_WIRE_LEN, sizeof( nonce_net ) );
+  uint64_t nonce_val = be64toh( nonce_net );
+
+  if ( (nonce_val & PRECISE_MASK) && (in.len < min_len + 2 * sizeof( uint16_t )) ) {
+    drops.malformed++;
+    return false;
+  }
+
+  /* prevent malicious playback to sender */
+  if ( bool( nonce_val & DIRECTION_MASK ) == server ) {
+    drops.misdirected++;
+    return false;
+  }
+
+  if ( !replay_window_admits( nonce_val & SEQUENCE_MASK ) ) {
+    drops.replayed++;
+    return false;
+  }
+
+  return true;
+}
+
+bool Connection::recv_in_place( const char **payload, size_t *len )
+{
+  if ( !recv_pending() ) {
+    receive_batch();
+    for ( int i = 0; i < recv_count; i++ ) {
+      if ( !prescreen( recv_packets[ i ] ) ) {
+	recv_packets[ i ].len = 0; /* too short to decrypt, so left invalid */
+      }
+    }
+  }
+  if ( recv_decrypted < recv_count ) {
+    session.decrypt_batch( recv_packets + recv_decrypted, recv_count - recv_decrypted );
+    recv_decrypted = recv_count;
+  }
+
+  int slot = 0;
+  InPlacePacket received;
+
+  if ( gro_offset < gro_len ) {
+    received.len = std::min( gro_segment_len, gro_len - gro_offset );
+    received.text = gro_buffer.data() + Session::HEADROOM;
+    if ( gro_offset && (received.len <= size_t( Session::RECEIVE_MTU )) ) {
+      /* only the first one starts aligned */
+      memcpy( slot_text( recv_buffer, 0 ) - Session::NONCE_WIRE_LEN,
+	      received.text - Session::NONCE_WIRE_LEN + gro_offset, received.len );
+      received.text = slot_text( recv_buffer, 0 );
+    }
+    gro_offset += received.len;
+
+    if ( !prescreen( received ) ) {
+      return false;
+    }
+    session.decrypt_batch( &received, 1 );
+  } else if ( recv_next < recv_count ) {
+    /* already screened and decrypted with the rest of its batch */
+    slot = recv_next++;
+    received = recv_packets[ slot ];
+    if ( !received.valid && !received.len ) {
+      return false; /* counted by prescreen() */
+    }
+  } else {
+    return false; /* nothing delivered by the SharedPort */
   }
 
-  if ( received_len > Session::RECEIVE_MTU ) {
-    char buffer[ 2048 ];
-    snprintf( buffer, 2048, "Received oversize datagram (size %d) and limit is %d\n",
-	      static_cast<int>( received_len ), Session::RECEIVE_MTU );
-    throw NetworkException( buffer, errno );
+  if ( !received.valid ) {
+    drops.forged++;
+    return false;
   }
 
-  Packet p( string( buf, received_len ), &session );
+  Packet p( -1, TO_SERVER, -1, -1 );
+  *len = p.decode_header( received );
+  *payload = received.text + p.timestamps_len();
+
+  /* a copy from the same batch, which the prescreen couldn't have known */
+  if ( !replay_window_admits( p.seq ) ) {
+    drops.replayed++;
+    return false;
+  }
+  replay_window_mark( p.seq );
 
-  dos_assert( p.direction == (server ? TO_SERVER : TO_CLIENT) ); /* prevent malicious playback to sender */
+  struct sockaddr_storage &packet_remote_addr = recv_addrs[ slot ];
+  socklen_t addrlen = recv_addrlens[ slot ];
 
   if ( p.seq >= expected_receiver_seq ) { /* don't use out-of-order packets for timestamp or targeting */
+    /* count skipped sequence numbers as lost (a late arrival is rare enough
+       to be indistinguishable from loss for our purposes) */
+    const double loss_alpha = 1.0 / 32.0;
+    uint64_t gap = p.seq - expected_receiver_seq;
+    for ( uint64_t i = 0; i < gap && i < 64; i++ ) {
+      loss_rate = (1 - loss_alpha) * loss_rate + loss_alpha;
+    }
+    loss_rate = (1 - loss_alpha) * loss_rate;
+
     expected_receiver_seq = p.seq + 1; /* this is security-sensitive because a replay attack could otherwise
 					  screw up the timestamp and targeting */
 
-    if ( p.timestamp != uint16_t(-1) ) {
+    if ( p.timestamp != Packet::NO_TIMESTAMP ) {
       saved_timestamp = p.timestamp;
-      saved_timestamp_received_at = timestamp();
+      saved_timestamp_precise = p.precise;
+      saved_timestamp_received_at = timestamp_us();
     }
 
-    if ( p.timestamp_reply != uint16_t(-1) ) {
-      uint16_t now = timestamp16();
-      double R = timestamp_diff( now, p.timestamp_reply );
+    if ( p.timestamp_reply != Packet::NO_TIMESTAMP ) {
+      double R = p.precise
+	? uint32_t( timestamp32_us() - p.timestamp_reply ) / 1000.0
+	: timestamp_diff( timestamp16(), p.timestamp_reply );
 
       if ( R < 5000 ) { /* ignore large values, e.g. server was Ctrl-Zed */
 	if ( !RTT_hit ) { /* first measurement */
@@ -462,6 +1031,8 @@ string Connection::recv( void )
 	  RTTVAR = (1 - beta) * RTTVAR + ( beta * fabs( SRTT - R ) );
 	  SRTT = (1 - alpha) * SRTT + ( alpha * R );
 	}
+
+	update_send_rate( R );
       }
     }
 
@@ -473,6 +1044,8 @@ string Connection::recv( void )
 
       if(new_remote_addr != remote_addr) {
         remote_addr = new_remote_addr;
+        reset_delay_estimate(); /* new path */
+        reset_mtu_search();
         fprintf( stderr, "Server now attached to client at %s:%d\n",
             remote_addr.getAddress().c_str(),
             remote_addr.getPort());
@@ -480,7 +1053,30 @@ string Connection::recv( void )
     }
   }
 
-  return p.payload; /* we do return out-of-order or duplicated packets to caller */
+  return true; /* we do return out-of-order packets to caller */
+}
+
+bool Connection::deliver( const char *datagram, size_t len,
+			  const struct sockaddr_storage &addr, socklen_t addrlen )
+{
+  if ( !recv_pending() ) {
+    recv_count = recv_next = recv_decrypted = 0;
+  }
+  if ( (recv_count == BATCH_LEN) || (len > size_t( Session::RECEIVE_MTU )) ) {
+    return false;
+  }
+
+  int slot = recv_count++;
+  memcpy( slot_text( recv_buffer, slot ) - Session::NONCE_WIRE_LEN, datagram, len );
+  recv_packets[ slot ].text = slot_text( recv_buffer, slot );
+  recv_packets[ slot ].len = len;
+  recv_addrs[ slot ] = addr;
+  recv_addrlens[ slot ] = addrlen;
+
+  if ( !prescreen( recv_packets[ slot ] ) ) {
+    recv_packets[ slot ].len = 0;
+  }
+  return true;
 }
 
 int Connection::port( void ) const
@@ -511,6 +1107,20 @@ uint16_t Network::timestamp16( void )
   return ts;
 }
 
+uint64_t Network::timestamp_us( void )
+{
+  return frozen_timestamp_us();
+}
+
+uint32_t Network::timestamp32_us( void )
+{
+  uint32_t ts = timestamp_us();
+  if ( ts == Packet::NO_TIMESTAMP ) {
+    ts++;
+  }
+  return ts;
+}
+
 uint16_t Network::timestamp_diff( uint16_t tsnew, uint16_t tsold )
 {
   int diff = tsnew - tsold;
@@ -535,9 +1145,371 @@ uint64_t Connection::timeout( void ) const
   return RTO;
 }
 
+void Connection::reset_delay_estimate( void )
+{
+  for ( int i = 0; i < BASE_HISTORY; i++ ) {
+    base_delays[ i ] = -1;
+  }
+  base_bucket_start = timestamp();
+  queueing_delay = 0;
+  send_rate = INITIAL_SEND_RATE;
+  last_rate_decrease = 0;
+}
+
+void Connection::reset_mtu_search( void )
+{
+  probe_index = 0;
+  probe_count = 0;
+  probe_in_flight = 0;
+#if defined(HAVE_IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+  next_probe_time = timestamp();
+#else
+  next_probe_time = uint64_t( -1 ); /* no way to set DF */
+#endif
+  validated_MTU = 0;
+  MTU = SEND_MTU;
+}
+
+/* The probe being sent went unanswered, so the path stops short of it */
+void Connection::end_mtu_search( void )
+{
+  probe_index = MTU_CANDIDATE_COUNT;
+  probe_count = 0;
+  probe_in_flight = 0;
+  next_probe_time = timestamp() + MTU_RAISE_INTERVAL;
+
+  /* below SEND_MTU only if that is known to need IP fragmentation */
+  if ( validated_MTU ) {
+    MTU = validated_MTU;
+  }
+}
+
+int Connection::mtu_probe_due( void )
+{
+#if defined(HAVE_IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+  uint64_t now = timestamp();
+
+  if ( (!has_remote_addr) || (now < next_probe_time) ) {
+    return 0;
+  }
+
+  if ( probe_count >= MAX_PROBES ) {
+    end_mtu_search();
+    return 0;
+  }
+
+  if ( probe_index >= MTU_CANDIDATE_COUNT ) {
+    /* time to see whether the path has grown */
+    probe_index = 0;
+    while ( (probe_index < MTU_CANDIDATE_COUNT)
+	    && (MTU_CANDIDATES[ probe_index ] <= validated_MTU) ) {
+      probe_index++;
+    }
+    if ( probe_index >= MTU_CANDIDATE_COUNT ) {
+      next_probe_time = now + MTU_RAISE_INTERVAL;
+      return 0;
+    }
+  }
+
+  return MTU_CANDIDATES[ probe_index ];
+#else
+  return 0;
+#endif
+}
+
+int Connection::get_overhead( void ) const
+{
+  const int udp_header_len = 8;
+  const int timestamps_len = precise_timestamps ? 2 * sizeof( uint32_t ) : 2 * sizeof( uint16_t );
+
+  return remote_addr.ipHeaderLen() + udp_header_len + session_id_len
+    + Session::NONCE_WIRE_LEN + timestamps_len + Session::TAG_LEN;
+}
+
+/* Sets DF (ignoring the kernel's own path MTU estimate) for probes only */
+bool Connection::set_probing( bool probing )
+{
+#if defined(HAVE_IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+  int flag = probing ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+  if ( remote_addr.getFamily() == AF_INET6 ) {
+    return 0 == setsockopt( sock, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &flag, sizeof( flag ) );
+  }
+  return 0 == setsockopt( sock, IPPROTO_IP, IP_MTU_DISCOVER, &flag, sizeof( flag ) );
+#else
+  return !probing;
+#endif
+}
+
+void Connection::send_mtu_probe( int size, const char *header, size_t header_len, const string &payload )
+{
+  /* with timestamps at their widest, as queue() would assert */
+  if ( Session::buffer_len( 2 * sizeof( uint32_t ) + header_len + payload.size() ) > size_t( SLOT_LEN ) ) {
+    /* bigger than a slot, so give up on it as on EMSGSIZE */
+    probe_count = MAX_PROBES;
+    next_probe_time = timestamp();
+    return;
+  }
+
+  flush(); /* nothing else goes out with DF */
+
+  queue( header, header_len, payload );
+  session.encrypt_batch( send_packets, 1 );
+  send_queued = 0;
+
+  probe_count++;
+  probe_in_flight = size;
+  next_probe_time = timestamp() + 2 * timeout();
+
+  if ( !set_probing( true ) ) {
+    return;
+  }
+
+  ssize_t bytes_sent = sendto( sock, slot_text( send_buffer, 0 ) - Session::NONCE_WIRE_LEN - session_id_len,
+			       send_packets[ 0 ].len + session_id_len, 0,
+			       remote_addr.toSockaddr(), remote_addr.sockaddrLen() );
+
+  set_probing( false );
+
+  if ( (bytes_sent < 0) && (errno == EMSGSIZE) ) {
+    /* bigger than our own interface; no need to wait for an answer */
+    probe_count = MAX_PROBES;
+    next_probe_time = timestamp();
+  }
+}
+
+void Connection::mtu_probe_acked( int size )
+{
+  /* only the candidate in flight, which we know fits a slot */
+  if ( (probe_index >= MTU_CANDIDATE_COUNT)
+       || (size != MTU_CANDIDATES[ probe_index ])
+       || (size != probe_in_flight) ) {
+    return; /* stale */
+  }
+
+  validated_MTU = size;
+  probe_count = 0;
+  probe_in_flight = 0;
+  next_probe_time = timestamp();
+
+  while ( (probe_index < MTU_CANDIDATE_COUNT)
+	  && (MTU_CANDIDATES[ probe_index ] <= validated_MTU) ) {
+    probe_index++;
+  }
+
+  if ( probe_index >= MTU_CANDIDATE_COUNT ) {
+    end_mtu_search();
+  } else if ( validated_MTU > MTU ) {
+    MTU = validated_MTU;
+  }
+}
+
+double Connection::get_base_delay( void ) const
+{
+  double ret = -1;
+  for ( int i = 0; i < BASE_HISTORY; i++ ) {
+    if ( (base_delays[ i ] >= 0) && ( (ret < 0) || (base_delays[ i ] < ret) ) ) {
+      ret = base_delays[ i ];
+    }
+  }
+  return ret;
+}
+
+/* Treat the minimum RTT of the last few minutes as the propagation delay of
+   the path, and anything above it as queueing. Back off the send rate
+   multiplicatively while the standing queue exceeds the target, at most
+   once per round trip since the samples that follow a cut still show the
+   queue from before it. Only probe for more bandwidth, from a modest
+   starting rate, while the sender is actually being held back. */
+void Connection::update_send_rate( double R )
+{
+  uint64_t now = timestamp();
+
+  /* rotate base delay history */
+  if ( now - base_bucket_start >= BASE_BUCKET_LEN ) {
+    for ( int i = BASE_HISTORY - 1; i > 0; i-- ) {
+      base_delays[ i ] = base_delays[ i - 1 ];
+    }
+    base_delays[ 0 ] = -1;
+    base_bucket_start = now;
+  }
+
+  if ( (base_delays[ 0 ] < 0) || (R < base_delays[ 0 ]) ) {
+    base_delays[ 0 ] = R;
+  }
+
+  queueing_delay = R - get_base_delay();
+
+  double off_target = (QUEUE_DELAY_TARGET - queueing_delay) / QUEUE_DELAY_TARGET;
+  if ( off_target < -1 ) {
+    off_target = -1;
+  }
+
+  if ( (off_target > 0)
+       && (now - last_pacing_limited > 2 * SRTT) ) {
+    return; /* application-limited; rate is not being tested */
+  }
+
+  if ( off_target < 0 ) {
+    if ( now - last_rate_decrease < SRTT ) {
+      return;
+    }
+    last_rate_decrease = now;
+  }
+
+  send_rate *= 1 + RATE_GAIN * off_target;
+
+  if ( send_rate < MIN_SEND_RATE ) {
+    send_rate = MIN_SEND_RATE;
+  } else if ( send_rate > MAX_SEND_RATE ) {
+    send_rate = MAX_SEND_RATE;
+  }
+}
+
 Connection::~Connection()
 {
-  if ( close( sock ) < 0 ) {
+  if ( shared_port ) {
+    shared_port->detach( session_id );
+  } else if ( close( sock ) < 0 ) {
     throw NetworkException( "close", errno );
   }
 }
+
+SharedPort::SharedPort( const char *desired_ip, const char *desired_port )
+  : sock( -1 ),
+    connections(),
+    recv_buffer( BATCH_LEN * SLOT_LEN ),
+    use_mmsg( true ),
+    strays( 0 )
+{
+  InternetAddress local_addr( desired_ip, desired_port, SOCK_DGRAM );
+
+  sock = Connection::new_socket( local_addr.getFamily() );
+
+  if ( bind( sock, local_addr.toSockaddr(), local_addr.sockaddrLen() ) < 0 ) {
+    int saved_errno = errno;
+    fprintf( stderr, "Failed binding to %s:%d : %s\n",
+	     local_addr.getAddress().c_str(), local_addr.getPort(), strerror( errno ) );
+    close( sock );
+    throw NetworkException( "bind", saved_errno );
+  }
+
+  /* never block; the caller has select() for that */
+  if ( fcntl( sock, F_SETFL, O_NONBLOCK ) < 0 ) {
+    int saved_errno = errno;
+    close( sock );
+    throw NetworkException( "fcntl", saved_errno );
+  }
+}
+
+SharedPort::~SharedPort()
+{
+  /* the Connections are the owner's to delete first */
+  assert( connections.empty() );
+
+  if ( close( sock ) < 0 ) {
+    perror( "close" );
+  }
+}
+
+uint32_t SharedPort::attach( Connection *connection )
+{
+  uint32_t id;
+  do {
+    Crypto::kernel_random( &id, sizeof( id ) );
+  } while ( connections.find( id ) != connections.end() );
+
+  connections[ id ] = connection;
+  return id;
+}
+
+bool SharedPort::dispatch( const char *datagram, size_t len,
+			   const struct sockaddr_storage &addr, socklen_t addrlen,
+			   std::vector<uint32_t> *delivered )
+{
+  if ( len < SESSION_ID_LEN ) {
+    strays++;
+    return false;
+  }
+
+  uint32_t id_net;
+  memcpy( &id_net, datagram, sizeof( id_net ) );
+  std::map<uint32_t, Connection *>::const_iterator i = connections.find( be32toh( id_net ) );
+  if ( (i == connections.end())
+       || !i->second->deliver( datagram + SESSION_ID_LEN, len - SESSION_ID_LEN, addr, addrlen ) ) {
+    strays++; /* or more than a batch for one session; it'll be resent */
+    return false;
+  }
+  if ( delivered ) {
+    delivered->push_back( i->first );
+  }
+  return true;
+}
+
+bool SharedPort::receive( std::vector<uint32_t> *delivered )
+{
+  struct sockaddr_storage addrs[ BATCH_LEN ];
+
+  /* the same layout as a Connection's slots, one session id further back */
+  const size_t id_offset = Session::NONCE_WIRE_LEN + SESSION_ID_LEN;
+  const size_t max_len = Session::RECEIVE_MTU + SESSION_ID_LEN;
+  char *first = recv_buffer.data() + Session::HEADROOM - id_offset;
+
+#ifdef HAVE_MMSG
+  if ( use_mmsg ) {
+    struct mmsghdr msgs[ BATCH_LEN ];
+    struct iovec iovs[ BATCH_LEN ];
+
+    for ( int i = 0; i < BATCH_LEN; i++ ) {
+      iovs[ i ].iov_base = first + i * SLOT_LEN;
+      iovs[ i ].iov_len = max_len;
+      memset( &msgs[ i ], 0, sizeof( msgs[ i ] ) );
+      msgs[ i ].msg_hdr.msg_name = &addrs[ i ];
+      msgs[ i ].msg_hdr.msg_namelen = sizeof( addrs[ i ] );
+      msgs[ i ].msg_hdr.msg_iov = &iovs[ i ];
+      msgs[ i ].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg( sock, msgs, BATCH_LEN, MSG_DONTWAIT, NULL );
+    if ( received >= 0 ) {
+      for ( int i = 0; i < received; i++ ) {
+	dispatch( first + i * SLOT_LEN, msgs[ i ].msg_len, addrs[ i ], msgs[ i ].msg_hdr.msg_namelen, delivered );
+      }
+      return received > 0;
+    } else if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) {
+      return false;
+    } else if ( errno != ENOSYS ) {
+      throw NetworkException( "recvmmsg", errno );
+    }
+    use_mmsg = false;
+  }
+#endif
+
+  int received = 0;
+  for ( ; received < BATCH_LEN; received++ ) {
+    socklen_t addrlen = sizeof( addrs[ received ] );
+    ssize_t len = recvfrom( sock, first + received * SLOT_LEN, max_len, MSG_DONTWAIT,
+			    (sockaddr *)&addrs[ received ], &addrlen );
+    if ( len < 0 ) {
+      if ( (received == 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) ) {
+	throw NetworkException( "recvfrom", errno );
+      }
+      break;
+    }
+    dispatch( first + received * SLOT_LEN, len, addrs[ received ], addrlen, delivered );
+  }
+  return received > 0;
+}
+
+int SharedPort::port( void ) const
+{
+  struct sockaddr_storage local_addr_sockaddr;
+  socklen_t addrlen = sizeof( local_addr_sockaddr );
+
+  if ( getsockname( sock, (sockaddr *)&local_addr_sockaddr, &addrlen ) < 0 ) {
+    throw NetworkException( "getsockname", errno );
+  }
+
+  InternetAddress local_addr( &local_addr_sockaddr, addrlen );
+
+  return local_addr.getPort();
+}
@@ -35,6 +35,8 @@
 
 #include <stdint.h>
 #include <deque>
+#include <vector>
+#include <map>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string>
@@ -47,9 +49,21 @@ using namespace Crypto;
 namespace Network {
   static const unsigned int MOSH_PROTOCOL_VERSION = 2; /* bumped for echo-ack */
 
+  /* optional features, negotiated through Instruction.capabilities */
+  static const unsigned int CAPABILITY_FEC = 1 << 0; /* parity fragments */
+  static const unsigned int CAPABILITY_DICTIONARY = 1 << 1; /* framed payloads, see Compressor */
+  static const unsigned int CAPABILITY_PMTUD = 1 << 2; /* acknowledges path MTU probes */
+  static const unsigned int CAPABILITY_PRECISE_TIMESTAMPS = 1 << 3; /* microsecond packet timestamps */
+  static const unsigned int CAPABILITY_CHACHA20 = 1 << 4; /* decrypts ChaCha20-Poly1305 packets */
+  static const unsigned int CAPABILITY_PREFER_CHACHA20 = 1 << 5; /* ...and would rather have them */
+  static const unsigned int LOCAL_CAPABILITIES = CAPABILITY_FEC | CAPABILITY_DICTIONARY | CAPABILITY_PMTUD
+    | CAPABILITY_PRECISE_TIMESTAMPS | CAPABILITY_CHACHA20;
+
   uint64_t timestamp( void );
   uint16_t timestamp16( void );
   uint16_t timestamp_diff( uint16_t tsnew, uint16_t tsold );
+  uint64_t timestamp_us( void );
+  uint32_t timestamp32_us( void );
 
   class NetworkException {
   public:
@@ -66,20 +80,48 @@ namespace Network {
 
   class Packet {
   public:
+    static const uint32_t NO_TIMESTAMP = uint32_t( -1 );
+
     uint64_t seq;
     Direction direction;
-    uint16_t timestamp, timestamp_reply;
-    string payload;
+    /* Precise packets carry microseconds mod 2^32, flagged in the nonce,
+       for peers that advertise CAPABILITY_PRECISE_TIMESTAMPS; the rest
+       carry milliseconds mod 2^16. */
+    bool precise;
+    bool chacha20; /* encrypted with ChaCha20-Poly1305, flagged in the nonce */
+    uint32_t timestamp, timestamp_reply;
     
     Packet( uint64_t s_seq, Direction s_direction,
-	    uint16_t s_timestamp, uint16_t s_timestamp_reply, string s_payload )
-      : seq( s_seq ), direction( s_direction ),
-	timestamp( s_timestamp ), timestamp_reply( s_timestamp_reply ), payload( s_payload )
+	    uint32_t s_timestamp, uint32_t s_timestamp_reply,
+	    bool s_precise = false, bool s_chacha20 = false )
+      : seq( s_seq ), direction( s_direction ), precise( s_precise ), chacha20( s_chacha20 ),
+	timestamp( s_timestamp ), timestamp_reply( s_timestamp_reply )
     {}
     
-    Packet( string coded_packet, Session *session );
-    
-    string tostring( Session *session );
+    /* Packets are encoded and decoded in place, in a packet buffer laid out
+       for Session::encrypt_in_place(). The payload sits timestamps_len()
+       bytes into the text, and the datagram starts NONCE_WIRE_LEN bytes
+       before it. The header calls leave the crypto to a Session batch. */
+    size_t timestamps_len( void ) const { return precise ? 2 * sizeof( uint32_t ) : 2 * sizeof( uint16_t ); }
+    void encode_header( char *text, size_t payload_len, InPlacePacket *out ) const;
+    size_t decode_header( const InPlacePacket &in );
+
+  private:
+    uint64_t nonce_val( void ) const;
+    void write_timestamps( char *dest ) const;
+    void read_timestamps( const char *src );
+  };
+
+  /* Datagrams thrown away before they reached the transport layer */
+  class DropCounts {
+  public:
+    uint64_t malformed; /* too short or too long */
+    uint64_t misdirected; /* flagged as going the other way */
+    uint64_t replayed; /* sequence number already seen, or too old to tell */
+    uint64_t forged; /* failed authentication */
+
+    DropCounts() : malformed( 0 ), misdirected( 0 ), replayed( 0 ), forged( 0 ) {}
+    uint64_t total( void ) const { return malformed + misdirected + replayed + forged; }
   };
 
   class InternetAddress {
@@ -103,6 +145,7 @@ namespace Network {
       void setViaLookup(const char *hostname, const char *port, int socktype );
       void setAddressBindAny();
       int getFamily() { return remote_addr.ss.ss_family; };
+      int ipHeaderLen() const;
       bool operator!=( const InternetAddress &b );
       bool operator==( const InternetAddress &b );
       InternetAddress & operator=( const InternetAddress &rhs );
@@ -111,18 +154,37 @@ namespace Network {
       std::string toString();
   };
 
+  class SharedPort;
+
+  /* octets of session id ahead of the nonce, for a SharedPort */
+  static const size_t SESSION_ID_LEN = 4;
+
   class Connection {
   private:
+    friend class SharedPort;
+
     static const int SEND_MTU = 1400;
     static const uint64_t MIN_RTO = 50; /* ms */
     static const uint64_t MAX_RTO = 1000; /* ms */
 
+    /* delay-based send rate estimation (in the spirit of LEDBAT, RFC 6817) */
+    static const int QUEUE_DELAY_TARGET = 25; /* ms of standing queue we tolerate */
+    static const int BASE_HISTORY = 5; /* number of one-minute base delay buckets */
+    static const uint64_t BASE_BUCKET_LEN = 60000; /* ms */
+    static const double RATE_GAIN;
+    static const double MIN_SEND_RATE; /* bytes/ms */
+    static const double INITIAL_SEND_RATE; /* bytes/ms, until the path says otherwise */
+    static const double MAX_SEND_RATE; /* bytes/ms */
+
     static const int PORT_RANGE_LOW  = 60001;
     static const int PORT_RANGE_HIGH = 60999;
 
     bool try_bind( );
 
     int sock;
+    SharedPort *shared_port; /* whose socket this is, or NULL if our own */
+    uint32_t session_id; /* tells the SharedPort's sessions apart */
+    size_t session_id_len; /* ahead of the nonce in datagrams we send */
     bool has_remote_addr;
     InternetAddress remote_addr;
 
@@ -133,41 +195,166 @@ namespace Network {
     Base64Key key;
     Session session;
 
+    /* Packets are assembled, encrypted and decrypted in place in these,
+       one slot per datagram, and go through the socket and the cipher
+       in batches. */
+    static const int SLOT_LEN = Session::HEADROOM + Session::RECEIVE_MTU;
+    static const int BATCH_LEN = 16;
+    AlignedBuffer send_buffer;
+    AlignedBuffer recv_buffer;
+    char *slot_text( const AlignedBuffer &buf, int i ) const { return buf.data() + i * SLOT_LEN + Session::HEADROOM; }
+
+    InPlacePacket send_packets[ BATCH_LEN ]; /* encrypted by flush() */
+    int send_queued;
+
+    InPlacePacket recv_packets[ BATCH_LEN ];
+    struct sockaddr_storage recv_addrs[ BATCH_LEN ];
+    socklen_t recv_addrlens[ BATCH_LEN ];
+    int recv_count, recv_next, recv_decrypted;
+
+    bool use_mmsg; /* cleared if the kernel turns out not to have them */
+
+    /* Linux UDP segmentation offloads, where the kernel supports them */
+    static const int GRO_BUFFER_LEN = 65536;
+    bool use_gso, use_gro;
+    AlignedBuffer gro_buffer;
+    size_t gro_len, gro_offset, gro_segment_len;
+
+    int send_batch( int first );
+    void receive_batch( void );
+    void receive_coalesced( void );
+    /* For SharedPort: queues a datagram (from the nonce on) read off its socket */
+    bool deliver( const char *datagram, size_t len,
+		  const struct sockaddr_storage &addr, socklen_t addrlen );
+
+    static int new_socket( int family );
+    void detect_offloads( void );
     void setup( );
 
     Direction direction;
     uint64_t next_seq;
-    uint16_t saved_timestamp;
-    uint64_t saved_timestamp_received_at;
+    uint32_t saved_timestamp;
+    bool saved_timestamp_precise;
+    uint64_t saved_timestamp_received_at; /* us */
+    bool precise_timestamps; /* the other side takes them */
+    bool chacha20; /* send with ChaCha20-Poly1305 rather than AES-OCB */
     uint64_t expected_receiver_seq;
 
+    /* Garbage is dropped, and counted, without exceptions, and as far as
+       possible without decrypting it. */
+    static const uint64_t REPLAY_WINDOW = 64;
+    uint64_t replay_top;
+    uint64_t replay_seen; /* bit i: replay_top - i authenticated */
+    DropCounts drops;
+
+    bool replay_window_admits( uint64_t seq ) const;
+    void replay_window_mark( uint64_t seq );
+    bool prescreen( const InPlacePacket &in );
+
     bool RTT_hit;
     double SRTT;
     double RTTVAR;
 
+    /* minimum RTT seen in each of the last few minutes */
+    double base_delays[ BASE_HISTORY ];
+    uint64_t base_bucket_start;
+    double queueing_delay;
+
+    /* inbound packet loss, from gaps in the sequence numbers */
+    double loss_rate;
+
+    /* rate at which the sender may pace fragments onto the path */
+    double send_rate;
+    uint64_t last_pacing_limited;
+    uint64_t last_rate_decrease;
+
+    void reset_delay_estimate( void );
+    void update_send_rate( double R );
+
+    /* Packetization-layer path MTU discovery, after RFC 8899. Only probes
+       are sent with DF set; everything else may still be fragmented by
+       IP, so a size that turns out not to fit never costs real data. */
+    static const int MTU_CANDIDATES[];
+    static const int MTU_CANDIDATE_COUNT;
+    static const int MAX_PROBES = 3;
+    static const uint64_t MTU_RAISE_INTERVAL = 600000; /* ms before probing upwards again */
+
+    int probe_index; /* candidate being probed, MTU_CANDIDATE_COUNT when idle */
+    int probe_count; /* unanswered probes of it */
+    int probe_in_flight; /* size of the last probe sent, 0 once answered */
+    uint64_t next_probe_time;
+    int validated_MTU; /* largest acknowledged probe, or 0 */
+
+    void reset_mtu_search( void );
+    void end_mtu_search( void );
+    bool set_probing( bool probing );
+
     /* Exception from send(), to be delivered if the frontend asks for it,
        without altering control flow. */
     bool have_send_exception;
     NetworkException send_exception;
 
-    Packet new_packet( string &s_payload );
+    Packet new_packet( void ); /* next outgoing packet's header fields */
 
   public:
     Connection( const char *desired_ip, const char *desired_port ); /* server */
     Connection( const char *key_str, const char *ip, int port ); /* client */
+    Connection( SharedPort &port ); /* server, one of many on a SharedPort */
     ~Connection();
 
-    void send( string s );
-    string recv( void );
+    void send( string s ) { send( NULL, 0, s ); }
+    /* header (e.g. a fragment's) and payload go out as one datagram */
+    void send( const char *header, size_t header_len, const string &payload )
+    {
+      queue( header, header_len, payload );
+      flush();
+    }
+    /* Same, but held back until flush() so that several go in one syscall */
+    void queue( const char *header, size_t header_len, const string &payload );
+    void flush( void );
+
+    /* One datagram at most, which is false if it was dropped. The
+       payload stays in the receive buffer, and is only valid until the
+       next call. */
+    bool recv_in_place( const char **payload, size_t *len );
+    /* Datagrams already read from the socket, which select() won't report */
+    bool recv_pending( void ) const { return (recv_next < recv_count) || (gro_offset < gro_len); }
     int fd( void ) const { return sock; }
     int get_MTU( void ) const { return MTU; }
+    /* Octets a datagram adds to what it carries: IP and UDP headers,
+       session id, nonce, timestamps and tag */
+    int get_overhead( void ) const;
+    void set_precise_timestamps( bool s_precise ) { precise_timestamps = s_precise; }
+    void set_chacha20( bool s_chacha20 ) { chacha20 = s_chacha20; }
+
+    /* Size of the path MTU probe due now, or 0 */
+    int mtu_probe_due( void );
+    uint64_t get_next_probe_time( void ) const { return next_probe_time; }
+    /* Sends a probe, already padded to the size mtu_probe_due() asked for */
+    void send_mtu_probe( int size, const char *header, size_t header_len, const string &payload );
+    void mtu_probe_acked( int size );
+
+    /* Gives the batch buffers' memory back while nobody is talking to us */
+    void hibernate( void );
 
     int port( void ) const;
     string get_key( void ) const { return key.printable_key(); }
     bool get_has_remote_addr( void ) const { return has_remote_addr; }
+    /* The client of a SharedPort session puts the id ahead of every datagram */
+    uint32_t get_session_id( void ) const { return session_id; }
+    void set_session_id( uint32_t s_session_id ) { session_id = s_session_id; session_id_len = SESSION_ID_LEN; }
 
     uint64_t timeout( void ) const;
     double get_SRTT( void ) const { return SRTT; }
+
+    double get_base_delay( void ) const;
+    double get_queueing_delay( void ) const { return queueing_delay; }
+    double get_send_rate( void ) const { return send_rate; }
+    /* bytes the path holds at the send rate, LEDBAT's congestion window */
+    double get_loss_rate( void ) const { return loss_rate; }
+    const DropCounts &get_drop_counts( void ) const { return drops; }
+    /* Sender had to queue fragments behind the current send rate */
+    void pacing_limited( void ) { last_pacing_limited = timestamp(); }
     std::string getRemoteIP() { return remote_addr.getAddress(); }
 
     const NetworkException *get_send_exception( void ) const
@@ -175,6 +362,48 @@ namespace Network {
       return have_send_exception ? &send_exception : NULL;
     }
   };
+
+  /* One UDP socket for the server side of many sessions. Clients put the
+     session id ahead of each datagram, so it is handed to the right
+     Connection without any decryption; the replies carry no id. */
+  class SharedPort {
+  private:
+    int sock;
+    std::map<uint32_t, Connection *> connections;
+
+    static const int SLOT_LEN = Session::HEADROOM + Session::RECEIVE_MTU;
+    static const int BATCH_LEN = 16;
+    AlignedBuffer recv_buffer;
+    bool use_mmsg;
+
+    uint64_t strays; /* for no session we have */
+
+    bool dispatch( const char *datagram, size_t len,
+		   const struct sockaddr_storage &addr, socklen_t addrlen,
+		   std::vector<uint32_t> *delivered );
+
+  public:
+    SharedPort( const char *desired_ip, const char *desired_port );
+    ~SharedPort();
+
+    /* Gives the Connection a session id nobody else has */
+    uint32_t attach( Connection *connection );
+    void detach( uint32_t id ) { connections.erase( id ); }
+
+    /* Hands whatever the socket has queued to its connections, whose
+       recv_pending() then says so, and adds their ids to delivered if
+       given. False if there was nothing. */
+    bool receive( std::vector<uint32_t> *delivered = NULL );
+
+    int fd( void ) const { return sock; }
+    int port( void ) const;
+    size_t size( void ) const { return connections.size(); }
+    uint64_t get_strays( void ) const { return strays; }
+
+    /* not implemented */
+    SharedPort( const SharedPort & );
+    SharedPort & operator=( const SharedPort & );
+  };
 }
 
 #endif
@@ -33,6 +33,7 @@
 #include <iostream>
 
 #include "networktransport.h"
+#include "compressor.h"
 
 #include "transportsender.cc"
 
@@ -47,7 +48,13 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
     received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
     last_receiver_state( initial_remote ),
     fragments(),
-    verbose( false )
+    verbose( false ),
+    last_nack_id( -1 ),
+    last_nack_time( 0 ),
+    received_dictionary_num( -1 ),
+    received_dictionary(),
+    hibernate_after( 0 ),
+    last_heard( timestamp() )
 {
   /* server */
 }
@@ -60,25 +67,149 @@ Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState
     received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
     last_receiver_state( initial_remote ),
     fragments(),
-    verbose( false )
+    verbose( false ),
+    last_nack_id( -1 ),
+    last_nack_time( 0 ),
+    received_dictionary_num( -1 ),
+    received_dictionary(),
+    hibernate_after( 0 ),
+    last_heard( timestamp() )
 {
   /* client */
 }
 
+template <class MyState, class RemoteState>
+Transport<MyState, RemoteState>::Transport( MyState &initial_state, RemoteState &initial_remote,
+					    SharedPort &port )
+  : connection( port ),
+    sender( &connection, initial_state ),
+    received_states( 1, TimestampedState<RemoteState>( timestamp(), 0, initial_remote ) ),
+    last_receiver_state( initial_remote ),
+    fragments(),
+    verbose( false ),
+    last_nack_id( -1 ),
+    last_nack_time( 0 ),
+    received_dictionary_num( -1 ),
+    received_dictionary(),
+    hibernate_after( 0 ),
+    last_heard( timestamp() )
+{
+  /* server, on a port shared with other sessions */
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::tick( void )
+{
+  /* the client has gone quiet (suspended, or off the network) */
+  if ( hibernate_after && !sender.get_hibernating()
+       && connection.get_has_remote_addr() && !sender.get_shutdown_in_progress()
+       && (timestamp() - last_heard >= hibernate_after) ) {
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Nothing heard for %u s, hibernating\n",
+	       (unsigned int)(timestamp() % 100000), (unsigned int)(hibernate_after / 1000) );
+    }
+    sender.hibernate();
+    connection.hibernate();
+    received_dictionary_num = -1;
+    string().swap( received_dictionary );
+  }
+
+  sender.tick();
+}
+
+/* Handle everything the socket has queued before timers get a look in */
 template <class MyState, class RemoteState>
 void Transport<MyState, RemoteState>::recv( void )
 {
-  string s( connection.recv() );
-  Fragment frag( s );
+  const char *datagram;
+  size_t len;
 
-  if ( fragments.add_fragment( frag ) ) { /* complete packet */
-    Instruction inst = fragments.get_assembly();
+  do {
+    if ( connection.recv_in_place( &datagram, &len ) ) {
+      recv_one( datagram, len );
+    }
+  } while ( connection.recv_pending() );
+}
+
+template <class MyState, class RemoteState>
+void Transport<MyState, RemoteState>::recv_one( const char *datagram, size_t len )
+{
+  /* authenticated, so the client is back */
+  last_heard = timestamp();
+  if ( sender.get_hibernating() ) {
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Waking up\n", (unsigned int)(timestamp() % 100000) );
+    }
+    sender.wake();
+  }
+
+  Fragment frag( datagram, len );
+
+  if ( !fragments.add_fragment( frag ) ) {
+    /* ask for whatever went missing, once per retransmission timeout */
+    if ( fragments.wants_retransmission()
+         && ( (fragments.get_current_id() != last_nack_id)
+              || (timestamp() - last_nack_time > connection.timeout()) ) ) {
+      last_nack_id = fragments.get_current_id();
+      last_nack_time = timestamp();
+      sender.set_nack( last_nack_id, fragments.get_received_bitmap() );
+    }
+  } else { /* complete packet */
+    string payload = fragments.get_payload();
+    string dictionary;
+    uint64_t dictionary_num;
+
+    if ( Compressor::framed_dictionary_num( payload, &dictionary_num ) ) {
+      /* compressed against a state we should already have */
+      typename list< TimestampedState<RemoteState> >::const_iterator i = received_states.begin();
+      while ( (i != received_states.end()) && (i->num != dictionary_num) ) {
+	i++;
+      }
+      if ( i == received_states.end() ) {
+	return; /* same as a missing reference state below */
+      }
+      if ( dictionary_num != received_dictionary_num ) {
+	received_dictionary = i->state.dictionary();
+	received_dictionary_num = dictionary_num;
+      }
+      dictionary = received_dictionary;
+    }
+
+    Instruction inst;
+    try {
+      if ( !inst.ParseFromString( get_compressor().uncompress_framed( payload, dictionary ) ) ) {
+	throw NetworkException( "Instruction::ParseFromString", 0 );
+      }
+    } catch ( const Crypto::CryptoException & ) {
+      /* Our copy of the state doesn't produce the sender's dictionary.
+	 Stop advertising it so the sender falls back to plain zlib. */
+      if ( !dictionary.empty() ) {
+	sender.disable_capability( CAPABILITY_DICTIONARY );
+      }
+      throw;
+    }
 
     if ( inst.protocol_version() != MOSH_PROTOCOL_VERSION ) {
       throw NetworkException( "mosh protocol version mismatch", 0 );
     }
 
     sender.process_acknowledgment_through( inst.ack_num() );
+    sender.set_remote_capabilities( inst.capabilities() );
+    connection.set_precise_timestamps( inst.capabilities() & CAPABILITY_PRECISE_TIMESTAMPS );
+    /* either side lacking AES instructions is reason enough */
+    connection.set_chacha20( (inst.capabilities() & CAPABILITY_CHACHA20)
+			     && ( (inst.capabilities() & CAPABILITY_PREFER_CHACHA20)
+				  || Session::prefers_chacha20() ) );
+    sender.set_remote_loss_rate( inst.loss_rate() / 65536.0 );
+    if ( inst.has_nack_id() ) {
+      sender.process_nack( inst.nack_id(), inst.nack_bitmap() );
+    }
+    if ( inst.has_mtu_probe() ) {
+      sender.set_mtu_probe_ack( inst.mtu_probe() );
+    }
+    if ( inst.has_mtu_probe_ack() ) {
+      connection.mtu_probe_acked( inst.mtu_probe_ack() );
+    }
 
     /* first, make sure we don't already have the new state */
     for ( typename list< TimestampedState<RemoteState> >::iterator i = received_states.begin();
@@ -125,8 +256,8 @@ void Transport<MyState, RemoteState>::recv( void )
     new_state.timestamp = timestamp();
     new_state.num = inst.new_num();
 
-    if ( !inst.diff().empty() ) {
-      new_state.state.apply_string( inst.diff() );
+    if ( !inst.diff().empty() && !new_state.state.apply_string( inst.diff() ) ) {
+      throw NetworkException( "apply_string", 0 );
     }
 
     /* Insert new state in sorted place */
@@ -56,6 +56,7 @@ namespace Network {
     TransportSender<MyState> sender;
 
     /* helper methods for recv() */
+    void recv_one( const char *datagram, size_t len );
     void process_throwaway_until( uint64_t throwaway_num );
 
     /* simple receiver */
@@ -64,20 +65,37 @@ namespace Network {
     FragmentAssembly fragments;
     bool verbose;
 
+    /* last retransmission request, to avoid repeating it every packet */
+    uint64_t last_nack_id;
+    uint64_t last_nack_time;
+
+    /* dictionary of the last received state that one was compressed against */
+    uint64_t received_dictionary_num;
+    string received_dictionary;
+
+    /* after this long (ms) without an authenticated datagram, the sender
+       hibernates until the next one; 0 for never */
+    uint64_t hibernate_after;
+    uint64_t last_heard;
+
   public:
     Transport( MyState &initial_state, RemoteState &initial_remote,
 	       const char *desired_ip, const char *desired_port );
     Transport( MyState &initial_state, RemoteState &initial_remote,
 	       const char *key_str, const char *ip, int port );
+    Transport( MyState &initial_state, RemoteState &initial_remote,
+	       SharedPort &port );
 
     /* Send data or an ack if necessary. */
-    void tick( void ) { sender.tick(); }
+    void tick( void );
 
     /* Returns the number of ms to wait until next possible event. */
-    int wait_time( void ) { return sender.wait_time(); }
+    int wait_time( void ) { return recv_pending() ? 0 : sender.wait_time(); }
 
-    /* Blocks waiting for a packet. */
+    /* Blocks waiting for a packet, then takes any others already queued. */
     void recv( void );
+    /* recv() was interrupted by an exception with datagrams left over */
+    bool recv_pending( void ) const { return connection.recv_pending(); }
 
     /* Find diff between last receiver state and current remote state, then rationalize states. */
     string get_remote_diff( void );
@@ -95,8 +113,11 @@ namespace Network {
 
     int port( void ) const { return connection.port(); }
     string get_key( void ) const { return connection.get_key(); }
+    uint32_t get_session_id( void ) const { return connection.get_session_id(); }
+    void set_session_id( uint32_t id ) { connection.set_session_id( id ); }
 
     MyState &get_current_state( void ) { return sender.get_current_state(); }
+    const MyState &get_current_state( void ) const { return sender.get_current_state(); }
     void set_current_state( const MyState &x ) { sender.set_current_state( x ); }
 
     uint64_t get_remote_state_num( void ) const { return received_states.back().num; }
@@ -109,6 +130,9 @@ namespace Network {
 
     void set_send_delay( int new_delay ) { sender.set_send_delay( new_delay ); }
 
+    void set_hibernate_after( uint64_t ms ) { hibernate_after = ms; }
+    bool hibernating( void ) const { return sender.get_hibernating(); }
+
     uint64_t get_sent_state_acked_timestamp( void ) const { return sender.get_sent_state_acked_timestamp(); }
     uint64_t get_sent_state_acked( void ) const { return sender.get_sent_state_acked(); }
     uint64_t get_sent_state_last( void ) const { return sender.get_sent_state_last(); }
@@ -118,6 +142,7 @@ namespace Network {
     std::string getRemoteIP( ) { return connection.getRemoteIP(); }
 
     const NetworkException *get_send_exception( void ) const { return connection.get_send_exception(); }
+    const DropCounts &get_drop_counts( void ) const { return connection.get_drop_counts(); }
   };
 }
 
@@ -31,12 +31,15 @@
 */
 
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 
 #include "byteorder.h"
 #include "transportfragment.h"
 #include "transportinstruction.pb.h"
 #include "compressor.h"
 #include "fatal_assert.h"
+#include "dos_assert.h"
 
 using namespace Network;
 using namespace TransportBuffers;
@@ -47,74 +50,89 @@ static string network_order_string( uint16_t host_order )
   return string( (char *)&net_int, sizeof( net_int ) );
 }
 
-static string network_order_string( uint64_t host_order )
-{
-  uint64_t net_int = htobe64( host_order );
-  return string( (char *)&net_int, sizeof( net_int ) );
-}
-
-string Fragment::tostring( void )
+size_t Fragment::write_header( char *buf ) const
 {
   assert( initialized );
 
-  string ret;
-  
-  ret += network_order_string( id );
+  uint64_t id_net = htobe64( id );
+  memcpy( buf, &id_net, sizeof( id_net ) );
 
   fatal_assert( !( fragment_num & 0x8000 ) ); /* effective limit on size of a terminal screen change or buffered user input */
-  uint16_t combined_fragment_num = ( final << 15 ) | fragment_num;
-  ret += network_order_string( combined_fragment_num );
+  uint16_t combined_fragment_num = htobe16( ( final << 15 ) | fragment_num );
+  memcpy( buf + sizeof( id_net ), &combined_fragment_num, sizeof( combined_fragment_num ) );
 
-  assert( ret.size() == frag_header_len );
+  return frag_header_len;
+}
 
-  ret += contents;
+string Fragment::tostring( void )
+{
+  char header[ frag_header_len ];
 
-  return ret;
+  return string( header, write_header( header ) ) + contents;
 }
 
 Fragment::Fragment( string &x )
   : id( -1 ), fragment_num( -1 ), final( false ), initialized( true ),
-    contents( x.begin() + frag_header_len, x.end() )
+    contents()
+{
+  parse( x.data(), x.size() );
+}
+
+Fragment::Fragment( const char *data, size_t len )
+  : id( -1 ), fragment_num( -1 ), final( false ), initialized( true ),
+    contents()
+{
+  parse( data, len );
+}
+
+void Fragment::parse( const char *data, size_t len )
 {
-  assert( x.size() >= frag_header_len );
+  assert( len >= frag_header_len );
 
-  uint64_t *data64 = (uint64_t *)x.data();
-  uint16_t *data16 = (uint16_t *)x.data();
-  id = be64toh( data64[ 0 ] );
-  fragment_num = be16toh( data16[ 4 ] );
+  uint64_t id_net;
+  uint16_t fragment_num_net;
+  memcpy( &id_net, data, sizeof( id_net ) );
+  memcpy( &fragment_num_net, data + sizeof( id_net ), sizeof( fragment_num_net ) );
+
+  id = be64toh( id_net );
+  fragment_num = be16toh( fragment_num_net );
   final = ( fragment_num & 0x8000 ) >> 15;
   fragment_num &= 0x7FFF;
+
+  contents.assign( data + frag_header_len, len - frag_header_len );
 }
 
 bool FragmentAssembly::add_fragment( Fragment &frag )
 {
+  current_id = frag.id;
+
+  if ( completed_ids.end() != std::find( completed_ids.begin(), completed_ids.end(), frag.id ) ) {
+    return false; /* already delivered */
+  }
+
+  partials_type::iterator it = partials.find( frag.id );
+
   /* see if this is a totally new packet */
-  if ( current_id != frag.id ) {
-    fragments.clear();
-    fragments.resize( frag.fragment_num + 1 );
-    fragments.at( frag.fragment_num ) = frag;
-    fragments_arrived = 1;
-    fragments_total = -1; /* unknown */
-    current_id = frag.id;
- } else { /* not a new packet */
-    /* see if we already have this fragment */
-    if ( (fragments.size() > frag.fragment_num)
-	 && (fragments.at( frag.fragment_num ).initialized) ) {
-      /* make sure new version is same as what we already have */
-      assert( fragments.at( frag.fragment_num ) == frag );
-    } else {
-      if ( (int)fragments.size() < frag.fragment_num + 1 ) {
-	fragments.resize( frag.fragment_num + 1 );
+  if ( it == partials.end() ) {
+    if ( partials.size() >= ASSEMBLY_WINDOW ) {
+      if ( frag.id < partials.begin()->first ) {
+        return false; /* older than anything we are still assembling */
       }
-      fragments.at( frag.fragment_num ) = frag;
-      fragments_arrived++;
+      partials.erase( partials.begin() );
     }
+
+    it = partials.insert( std::make_pair( frag.id, PartialAssembly() ) ).first;
   }
 
-  if ( frag.final ) {
-    fragments_total = frag.fragment_num + 1;
-    assert( (int)fragments.size() <= fragments_total );
-    fragments.resize( fragments_total );
+  return it->second.add_fragment( frag );
+}
+
+bool PartialAssembly::add_fragment( Fragment &frag )
+{
+  if ( frag.is_parity() ) {
+    add_parity( frag );
+  } else {
+    add_data( frag );
   }
 
   if ( fragments_total != -1 ) {
@@ -125,7 +143,111 @@ bool FragmentAssembly::add_fragment( Fragment &frag )
   return ( fragments_arrived == fragments_total );
 }
 
-Instruction FragmentAssembly::get_assembly( void )
+void PartialAssembly::add_data( Fragment &frag )
+{
+  /* see if we already have this fragment */
+  if ( (fragments.size() > frag.fragment_num)
+       && (fragments.at( frag.fragment_num ).initialized) ) {
+    /* make sure new version is same as what we already have */
+    assert( fragments.at( frag.fragment_num ) == frag );
+    return;
+  }
+
+  if ( (int)fragments.size() < frag.fragment_num + 1 ) {
+    fragments.resize( frag.fragment_num + 1 );
+  }
+  fragments.at( frag.fragment_num ) = frag;
+  fragments_arrived++;
+
+  if ( frag.final ) {
+    fragments_total = frag.fragment_num + 1;
+    assert( (int)fragments.size() <= fragments_total );
+    fragments.resize( fragments_total );
+  }
+
+  /* the new fragment may leave a single hole in a parity group */
+  for ( size_t group = 0; group < parity.size(); group++ ) {
+    recover_group( group );
+  }
+}
+
+void PartialAssembly::add_parity( Fragment &frag )
+{
+  dos_assert( frag.contents.size() >= Fragment::parity_header_len );
+
+  size_t group = frag.fragment_num & ~Fragment::PARITY_FLAG;
+  if ( parity.size() < group + 1 ) {
+    parity.resize( group + 1 );
+  }
+  parity.at( group ) = frag;
+
+  /* parity also tells us how long the instruction is */
+  const uint16_t *data16 = (const uint16_t *)frag.contents.data();
+  int total = be16toh( data16[ 2 ] );
+  if ( fragments_total == -1 ) {
+    dos_assert( (int)fragments.size() <= total );
+    fragments_total = total;
+    fragments.resize( fragments_total );
+  } else {
+    dos_assert( total == fragments_total );
+  }
+
+  recover_group( group );
+}
+
+/* Rebuild the one missing data fragment of a group, if possible */
+void PartialAssembly::recover_group( size_t group )
+{
+  const Fragment &par = parity.at( group );
+  if ( !par.initialized ) {
+    return;
+  }
+
+  const uint16_t *data16 = (const uint16_t *)par.contents.data();
+  size_t first = be16toh( data16[ 0 ] );
+  size_t count = be16toh( data16[ 1 ] );
+  dos_assert( first + count <= fragments.size() );
+
+  size_t missing = fragments.size();
+  for ( size_t i = first; i < first + count; i++ ) {
+    if ( !fragments.at( i ).initialized ) {
+      if ( missing != fragments.size() ) {
+        return; /* more than one hole */
+      }
+      missing = i;
+    }
+  }
+
+  if ( missing == fragments.size() ) {
+    return; /* nothing to do */
+  }
+
+  string record( par.contents.begin() + 3 * sizeof( uint16_t ), par.contents.end() );
+  for ( size_t i = first; i < first + count; i++ ) {
+    if ( i == missing ) {
+      continue;
+    }
+    const string &contents = fragments.at( i ).contents;
+    dos_assert( contents.size() + sizeof( uint16_t ) <= record.size() );
+    uint16_t len = htobe16( contents.size() );
+    record[ 0 ] ^= ((char *)&len)[ 0 ];
+    record[ 1 ] ^= ((char *)&len)[ 1 ];
+    for ( size_t j = 0; j < contents.size(); j++ ) {
+      record[ j + sizeof( uint16_t ) ] ^= contents[ j ];
+    }
+  }
+
+  uint16_t len;
+  memcpy( &len, record.data(), sizeof( len ) );
+  len = be16toh( len );
+  dos_assert( len + sizeof( uint16_t ) <= record.size() );
+
+  Fragment rebuilt( par.id, missing, int( missing ) == fragments_total - 1,
+                    string( record.begin() + sizeof( uint16_t ), record.begin() + sizeof( uint16_t ) + len ) );
+  add_data( rebuilt );
+}
+
+string PartialAssembly::get_payload( void ) const
 {
   assert( fragments_arrived == fragments_total );
 
@@ -136,12 +258,90 @@ Instruction FragmentAssembly::get_assembly( void )
     encoded += fragments.at( i ).contents;
   }
 
-  Instruction ret;
-  fatal_assert( ret.ParseFromString( get_compressor().uncompress_str( encoded ) ) );
+  return encoded;
+}
+
+string FragmentAssembly::get_payload( void )
+{
+  partials_type::iterator it = partials.find( current_id );
+  assert( it != partials.end() );
+
+  string encoded = it->second.get_payload();
 
-  fragments.clear();
-  fragments_arrived = 0;
-  fragments_total = -1;
+  partials.erase( it );
+  completed_ids.push_back( current_id );
+  if ( completed_ids.size() > ASSEMBLY_WINDOW ) {
+    completed_ids.pop_front();
+  }
+
+  return encoded;
+}
+
+/* Only the newest instruction is worth repairing; the sender has moved on
+   from anything older. */
+bool FragmentAssembly::wants_retransmission( void ) const
+{
+  partials_type::const_iterator it = partials.find( current_id );
+  if ( (it == partials.end()) || (current_id != partials.rbegin()->first) ) {
+    return false;
+  }
+
+  return it->second.wants_retransmission();
+}
+
+string FragmentAssembly::get_received_bitmap( void ) const
+{
+  partials_type::const_iterator it = partials.find( current_id );
+  assert( it != partials.end() );
+
+  return it->second.get_received_bitmap();
+}
+
+bool PartialAssembly::wants_retransmission( void ) const
+{
+  int later_arrivals = 0;
+  bool hole = false;
+
+  for ( size_t i = 0; i < fragments.size(); i++ ) {
+    if ( !fragments.at( i ).initialized ) {
+      hole = true;
+    } else if ( hole ) {
+      later_arrivals++;
+    }
+  }
+
+  if ( !hole ) {
+    return false;
+  }
+
+  /* Once the end of the instruction has been seen, any hole is a loss.
+     With parity in use, the end is the last group's parity fragment,
+     which may still repair the hole. */
+  bool end_seen = ( fragments_total != -1 );
+  if ( end_seen && !parity.empty() ) {
+    end_seen = false;
+    for ( size_t group = 0; group < parity.size(); group++ ) {
+      if ( parity.at( group ).initialized ) {
+        const uint16_t *data16 = (const uint16_t *)parity.at( group ).contents.data();
+        if ( be16toh( data16[ 0 ] ) + be16toh( data16[ 1 ] ) == fragments_total ) {
+          end_seen = true;
+        }
+      }
+    }
+  }
+
+  return end_seen || ( parity.empty() && (later_arrivals >= NACK_REORDER_THRESHOLD) );
+}
+
+string PartialAssembly::get_received_bitmap( void ) const
+{
+  string ret( (fragments.size() + 7) / 8, 0 );
+
+  for ( size_t i = 0; i < fragments.size(); i++ ) {
+    if ( fragments.at( i ).initialized ) {
+      ret[ i / 8 ] |= 1 << (i % 8);
+    }
+  }
 
   return ret;
 }
@@ -152,15 +352,30 @@ bool Fragment::operator==( const Fragment &x )
     && ( initialized == x.initialized ) && ( contents == x.contents );
 }
 
-vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, int MTU )
+vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, int MTU, int header_len, int parity_group,
+                                            const string *dictionary )
 {
+  /* leave room for the parity header so parity fragments fit the MTU too */
+  int fragment_len = MTU - header_len;
+  if ( parity_group > 0 ) {
+    fragment_len -= Fragment::parity_header_len;
+  }
+
   if ( (inst.old_num() != last_instruction.old_num())
        || (inst.new_num() != last_instruction.new_num())
        || (inst.ack_num() != last_instruction.ack_num())
        || (inst.throwaway_num() != last_instruction.throwaway_num())
        || (inst.chaff() != last_instruction.chaff())
        || (inst.protocol_version() != last_instruction.protocol_version())
-       || (last_MTU != MTU) ) {
+       || (inst.capabilities() != last_instruction.capabilities())
+       || (inst.loss_rate() != last_instruction.loss_rate())
+       || (inst.nack_id() != last_instruction.nack_id())
+       || (inst.nack_bitmap() != last_instruction.nack_bitmap())
+       || (inst.mtu_probe() != last_instruction.mtu_probe())
+       || (inst.mtu_probe_ack() != last_instruction.mtu_probe_ack())
+       || (last_fragment_len != fragment_len)
+       || (last_parity_group != parity_group)
+       || (last_framed != (dictionary != NULL)) ) {
     next_instruction_id++;
   }
 
@@ -170,9 +385,13 @@ vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, int MTU )
   }
 
   last_instruction = inst;
-  last_MTU = MTU;
+  last_fragment_len = fragment_len;
+  last_parity_group = parity_group;
+  last_framed = (dictionary != NULL);
 
-  string payload = get_compressor().compress_str( inst.SerializeAsString() );
+  string payload = dictionary
+    ? get_compressor().compress_framed( inst.SerializeAsString(), inst.old_num(), *dictionary )
+    : get_compressor().compress_str( inst.SerializeAsString() );
   uint16_t fragment_num = 0;
   vector<Fragment> ret;
 
@@ -180,9 +399,9 @@ vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, int MTU )
     string this_fragment;
     bool final = false;
 
-    if ( int( payload.size() + HEADER_LEN ) > MTU ) {
-      this_fragment = string( payload.begin(), payload.begin() + MTU - HEADER_LEN );
-      payload = string( payload.begin() + MTU - HEADER_LEN, payload.end() );
+    if ( int( payload.size() ) > fragment_len ) {
+      this_fragment = string( payload.begin(), payload.begin() + fragment_len );
+      payload = string( payload.begin() + fragment_len, payload.end() );
     } else {
       this_fragment = payload;
       payload.clear();
@@ -192,5 +411,48 @@ vector<Fragment> Fragmenter::make_fragments( const Instruction &inst, int MTU )
     ret.push_back( Fragment( next_instruction_id, fragment_num++, final, this_fragment ) );
   }
 
-  return ret;
+  if ( (parity_group <= 0) || (ret.size() < 2) ) {
+    return ret;
+  }
+
+  fatal_assert( ret.size() < Fragment::PARITY_FLAG );
+
+  /* interleave a parity fragment after each group of data fragments */
+  vector<Fragment> with_parity;
+  uint16_t group = 0;
+
+  for ( size_t first = 0; first < ret.size(); first += parity_group ) {
+    size_t count = std::min( ret.size() - first, size_t( parity_group ) );
+
+    string record( sizeof( uint16_t ) + ret.at( first ).contents.size(), 0 );
+    for ( size_t i = first; i < first + count; i++ ) {
+      const string &contents = ret.at( i ).contents;
+      uint16_t len = htobe16( contents.size() );
+      record[ 0 ] ^= ((char *)&len)[ 0 ];
+      record[ 1 ] ^= ((char *)&len)[ 1 ];
+      for ( size_t j = 0; j < contents.size(); j++ ) {
+        record[ j + sizeof( uint16_t ) ] ^= contents[ j ];
+      }
+      with_parity.push_back( ret.at( i ) );
+    }
+
+    string parity_contents = network_order_string( uint16_t( first ) )
+      + network_order_string( uint16_t( count ) )
+      + network_order_string( uint16_t( ret.size() ) )
+      + record;
+
+    with_parity.push_back( Fragment( next_instruction_id, Fragment::PARITY_FLAG | group++, false,
+                                     parity_contents ) );
+  }
+
+  return with_parity;
+}
+
+void Fragmenter::forget_last_instruction( void )
+{
+  uint64_t ack_num = last_instruction.ack_num();
+  Instruction().Swap( &last_instruction );
+  last_instruction.set_old_num( -1 );
+  last_instruction.set_new_num( -1 );
+  last_instruction.set_ack_num( ack_num );
 }
@@ -36,22 +36,32 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include <map>
+#include <deque>
 
 #include "transportinstruction.pb.h"
 
 using std::vector;
 using std::string;
+using std::deque;
 using namespace TransportBuffers;
 
 namespace Network {
-  static const int HEADER_LEN = 66;
+  static const int NACK_REORDER_THRESHOLD = 3; /* later fragments seen before a hole counts as loss */
 
   class Fragment
   {
   private:
-    static const size_t frag_header_len = sizeof( uint64_t ) + sizeof( uint16_t );
+    void parse( const char *data, size_t len );
 
   public:
+    static const size_t frag_header_len = sizeof( uint64_t ) + sizeof( uint16_t );
+
+    /* A parity fragment carries the XOR of a group of data fragments of
+       the same instruction, so that any one of them can be rebuilt. */
+    static const uint16_t PARITY_FLAG = 0x4000;
+    static const size_t parity_header_len = 3 * sizeof( uint16_t ) + sizeof( uint16_t );
+
     uint64_t id;
     uint16_t fragment_num;
     bool final;
@@ -70,23 +80,64 @@ namespace Network {
     {}
 
     Fragment( string &x );
+    Fragment( const char *data, size_t len );
 
     string tostring( void );
+    /* writes the frag_header_len octets that precede contents on the wire */
+    size_t write_header( char *buf ) const;
 
     bool operator==( const Fragment &x );
+
+    bool is_parity( void ) const { return fragment_num & PARITY_FLAG; }
   };
 
-  class FragmentAssembly
+  /* The fragments of one instruction, as they arrive */
+  class PartialAssembly
   {
   private:
     vector<Fragment> fragments;
-    uint64_t current_id;
+    vector<Fragment> parity;
     int fragments_arrived, fragments_total;
 
+    void add_data( Fragment &frag );
+    void add_parity( Fragment &frag );
+    void recover_group( size_t group );
+
   public:
-    FragmentAssembly() : fragments(), current_id( -1 ), fragments_arrived( 0 ), fragments_total( -1 ) {}
+    PartialAssembly() : fragments(), parity(), fragments_arrived( 0 ), fragments_total( -1 ) {}
+    bool add_fragment( Fragment &frag );
+    string get_payload( void ) const;
+
+    bool wants_retransmission( void ) const;
+    string get_received_bitmap( void ) const;
+  };
+
+  class FragmentAssembly
+  {
+  private:
+    /* Instructions assembled side by side, so that reordering between
+       consecutive instructions doesn't throw away work. Kept small: each
+       one can hold as many fragments as the sender cares to number. */
+    static const unsigned int ASSEMBLY_WINDOW = 4;
+
+    typedef std::map< uint64_t, PartialAssembly > partials_type;
+    partials_type partials;
+
+    /* recently completed instructions, whose stragglers we ignore */
+    deque<uint64_t> completed_ids;
+
+    uint64_t current_id; /* instruction of the last fragment added */
+
+  public:
+    FragmentAssembly() : partials(), completed_ids(), current_id( -1 ) {}
     bool add_fragment( Fragment &inst );
-    Instruction get_assembly( void );
+    string get_payload( void ); /* still compressed, see Compressor::uncompress_framed() */
+
+    /* Whether the current instruction has holes that look like loss
+       rather than reordering, and which of its fragments we hold */
+    bool wants_retransmission( void ) const;
+    uint64_t get_current_id( void ) const { return current_id; }
+    string get_received_bitmap( void ) const;
   };
 
   class Fragmenter
@@ -94,16 +145,27 @@ namespace Network {
   private:
     uint64_t next_instruction_id;
     Instruction last_instruction;
-    int last_MTU;
+    int last_fragment_len;
+    int last_parity_group;
+    bool last_framed;
 
   public:
-    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_MTU( -1 )
+    Fragmenter() : next_instruction_id( 0 ), last_instruction(), last_fragment_len( -1 ), last_parity_group( 0 ),
+                   last_framed( false )
     {
       last_instruction.set_old_num( -1 );
       last_instruction.set_new_num( -1 );
     }
-    vector<Fragment> make_fragments( const Instruction &inst, int MTU );
+    /* Fragments fill datagrams of MTU octets, of which header_len go on
+       the fragment header and the Connection's own overhead.
+       parity_group > 0 adds one parity fragment per that many data fragments.
+       With a dictionary (the receiver's copy of inst.old_num()), the payload
+       is framed and compressed against it instead of standalone. */
+    vector<Fragment> make_fragments( const Instruction &inst, int MTU, int header_len, int parity_group = 0,
+                                     const string *dictionary = NULL );
     uint64_t last_ack_sent( void ) const { return last_instruction.ack_num(); }
+    /* Drops the copy of the last instruction, all but its ack */
+    void forget_last_instruction( void );
   };
   
 }
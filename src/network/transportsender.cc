@@ -49,18 +49,41 @@ TransportSender<MyState>::TransportSender( Connection *s_connection, MyState &in
     sent_states( 1, TimestampedState<MyState>( timestamp(), 0, initial_state ) ),
     assumed_receiver_state( sent_states.begin() ),
     fragmenter(),
+    paced_fragments(),
+    next_fragment_time( 0 ),
+    last_fragments(),
+    last_fragments_num( -1 ),
+    pending_nack( false ),
+    nack_id( -1 ),
+    nack_bitmap(),
+    mtu_probe_ack( 0 ),
     next_ack_time( timestamp() ),
     next_send_time( timestamp() ),
+    timers_dirty( true ),
+    timers_valid_until( 0 ),
+    timers_timeout( 0 ),
+    timers_send_interval( 0 ),
     verbose( false ),
     shutdown_in_progress( false ),
     shutdown_tries( 0 ),
     ack_num( 0 ),
     pending_data_ack( false ),
+    local_capabilities( LOCAL_CAPABILITIES ),
+    remote_capabilities( 0 ),
+    remote_loss_rate( 0 ),
+    sent_dictionary_num( -1 ),
+    sent_dictionary(),
     SEND_MINDELAY( 8 ),
     last_heard( 0 ),
     prng(),
-    mindelay_clock( -1 )
+    mindelay_clock( -1 ),
+    hibernating( false )
 {
+  if ( !ChaCha20Poly1305::available() ) {
+    local_capabilities &= ~CAPABILITY_CHACHA20;
+  } else if ( Session::prefers_chacha20() ) {
+    local_capabilities |= CAPABILITY_PREFER_CHACHA20;
+  }
 }
 
 /* Try to send roughly two frames per RTT, bounded by limits on frame rate */
@@ -83,14 +106,26 @@ void TransportSender<MyState>::calculate_timers( void )
 {
   uint64_t now = timestamp();
 
+  uint64_t timeout = connection->timeout();
+  unsigned int interval = send_interval();
+
+  if ( !timers_dirty && (now < timers_valid_until)
+       && (timeout == timers_timeout) && (interval == timers_send_interval) ) {
+    return;
+  }
+  timers_dirty = false;
+  timers_valid_until = uint64_t(-1);
+  timers_timeout = timeout;
+  timers_send_interval = interval;
+
   /* Update assumed receiver state */
   update_assumed_receiver_state();
 
   /* Cut out common prefix of all states */
   rationalize_states();
 
-  if ( pending_data_ack && (next_ack_time > now + ACK_DELAY) ) {
-    next_ack_time = now + ACK_DELAY;
+  if ( last_heard + ACTIVE_RETRY_TIMEOUT > now ) {
+    timers_valid_until = min( timers_valid_until, last_heard + ACTIVE_RETRY_TIMEOUT );
   }
 
   if ( !(current_state == sent_states.back().state) ) {
@@ -123,6 +158,10 @@ void TransportSender<MyState>::calculate_timers( void )
 template <class MyState>
 int TransportSender<MyState>::wait_time( void )
 {
+  if ( hibernating ) {
+    return INT_MAX; /* nor the state comparisons */
+  }
+
   calculate_timers();
 
   uint64_t next_wakeup = next_ack_time;
@@ -130,6 +169,16 @@ int TransportSender<MyState>::wait_time( void )
     next_wakeup = next_send_time;
   }
 
+  if ( (remote_capabilities & CAPABILITY_PMTUD)
+       && (connection->get_next_probe_time() < next_wakeup) ) {
+    next_wakeup = connection->get_next_probe_time();
+  }
+
+  /* nothing new goes out until the previous instruction has drained */
+  if ( !paced_fragments.empty() ) {
+    next_wakeup = lrint( ceil( next_fragment_time ) );
+  }
+
   uint64_t now = timestamp();
 
   if ( !connection->get_has_remote_addr() ) {
@@ -147,12 +196,30 @@ int TransportSender<MyState>::wait_time( void )
 template <class MyState>
 void TransportSender<MyState>::tick( void )
 {
+  if ( hibernating ) {
+    return;
+  }
+
   calculate_timers(); /* updates assumed receiver state and rationalizes */
 
   if ( !connection->get_has_remote_addr() ) {
     return;
   }
 
+  send_paced_fragments();
+  if ( !paced_fragments.empty() ) {
+    return;
+  }
+
+  /* probes are framed payloads, so the receiver must take those too */
+  if ( (remote_capabilities & CAPABILITY_PMTUD)
+       && (remote_capabilities & CAPABILITY_DICTIONARY) ) {
+    int probe_size = connection->mtu_probe_due();
+    if ( probe_size ) {
+      send_mtu_probe( probe_size );
+    }
+  }
+
   uint64_t now = timestamp();
 
   if ( (now < next_ack_time)
@@ -160,6 +227,8 @@ void TransportSender<MyState>::tick( void )
     return;
   }
 
+  timers_dirty = true; /* whatever goes out below moves them */
+
   /* Determine if a new diff or empty ack needs to be sent */
     
   string diff = current_state.diff_from( assumed_receiver_state->state );
@@ -267,6 +336,7 @@ void TransportSender<MyState>::update_assumed_receiver_state( void )
 
     if ( uint64_t(now - i->timestamp) < connection->timeout() + ACK_DELAY ) {
       assumed_receiver_state = i;
+      timers_valid_until = min( timers_valid_until, i->timestamp + connection->timeout() + ACK_DELAY );
     } else {
       return;
     }
@@ -300,6 +370,14 @@ const string TransportSender<MyState>::make_chaff( void )
   return string( chaff, chaff_len );
 }
 
+template <class MyState>
+const string TransportSender<MyState>::make_chaff( size_t len )
+{
+  string chaff( len, 0 );
+  prng.fill( &chaff[ 0 ], len );
+  return chaff;
+}
+
 template <class MyState>
 void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num )
 {
@@ -312,18 +390,37 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
   inst.set_throwaway_num( sent_states.front().num );
   inst.set_diff( diff );
   inst.set_chaff( make_chaff() );
+  inst.set_capabilities( local_capabilities );
+  inst.set_loss_rate( lrint( connection->get_loss_rate() * 65536 ) );
+  if ( pending_nack ) {
+    inst.set_nack_id( nack_id );
+    inst.set_nack_bitmap( nack_bitmap );
+  }
+  if ( mtu_probe_ack ) {
+    inst.set_mtu_probe_ack( mtu_probe_ack );
+  }
 
   if ( new_num == uint64_t(-1) ) {
     shutdown_tries++;
   }
 
-  vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU() );
+  vector<Fragment> fragments = fragmenter.make_fragments( inst, connection->get_MTU(), fragment_overhead(), parity_group(),
+                                                          dictionary_for( *assumed_receiver_state ) );
+
+  /* anything still queued belongs to an instruction we have now superseded */
+  paced_fragments.clear();
+
+  last_fragments = fragments;
+  last_fragments_num = new_num;
+
+  /* The first few go out at once, in as few sendmmsg() and GSO batches
+     as the Connection can make of them; the rest is paced. */
+  unsigned int burst_len = 0;
+  size_t burst_bytes = 0;
 
   for ( vector<Fragment>::iterator i = fragments.begin();
         i != fragments.end();
         i++ ) {
-    connection->send( i->tostring() );
-
     if ( verbose ) {
       fprintf( stderr, "[%u] Sent [%d=>%d] id %d, frag %d ack=%d, throwaway=%d, len=%d, frame rate=%.2f, timeout=%d, srtt=%.1f\n",
 	       (unsigned int)(timestamp() % 100000), (int)inst.old_num(), (int)inst.new_num(), (int)i->id, (int)i->fragment_num,
@@ -332,14 +429,213 @@ void TransportSender<MyState>::send_in_fragments( string diff, uint64_t new_num
 	       (int)connection->timeout(), connection->get_SRTT() );
     }
 
+    if ( paced_fragments.empty() && (burst_len < PACING_BURST) ) {
+      queue_fragment( *i ); // Can throw NetworkException
+      burst_len++;
+      burst_bytes += i->contents.size() + fragment_overhead();
+    } else {
+      paced_fragments.push_back( *i );
+    }
+  }
+
+  connection->flush(); /* the whole burst in one go */
+
+  if ( !paced_fragments.empty() ) {
+    connection->pacing_limited();
+    next_fragment_time = timestamp() + burst_bytes / connection->get_send_rate();
   }
 
   pending_data_ack = false;
+  pending_nack = false;
+  mtu_probe_ack = 0;
+}
+
+template <class MyState>
+void TransportSender<MyState>::set_nack( uint64_t id, const string &bitmap )
+{
+  pending_nack = true;
+  nack_id = id;
+  nack_bitmap = bitmap;
+
+  /* a hole costs the other side an RTO if we sit on this */
+  next_ack_time = timestamp();
+}
+
+/* Resend just the fragments the receiver is missing, provided the
+   instruction it is asking about is still the newest one we sent. */
+template <class MyState>
+void TransportSender<MyState>::process_nack( uint64_t id, const string &bitmap )
+{
+  if ( last_fragments.empty()
+       || (last_fragments.front().id != id)
+       || (last_fragments_num != sent_states.back().num) ) {
+    return; /* superseded */
+  }
+
+  bool queued = false;
+
+  for ( vector<Fragment>::iterator i = last_fragments.begin();
+        i != last_fragments.end();
+        i++ ) {
+    if ( i->is_parity() ) {
+      continue;
+    }
+
+    size_t byte = i->fragment_num / 8;
+    if ( (byte < bitmap.size()) && (bitmap[ byte ] & (1 << (i->fragment_num % 8))) ) {
+      continue; /* receiver has it */
+    }
+
+    bool already_queued = false;
+    for ( deque<Fragment>::const_iterator j = paced_fragments.begin();
+          j != paced_fragments.end();
+          j++ ) {
+      if ( j->fragment_num == i->fragment_num ) {
+        already_queued = true;
+      }
+    }
+
+    if ( !already_queued ) {
+      if ( verbose ) {
+        fprintf( stderr, "[%u] Resending id %d, frag %d on request\n",
+                 (unsigned int)(timestamp() % 100000), (int)i->id, (int)i->fragment_num );
+      }
+
+      paced_fragments.push_back( *i );
+      queued = true;
+    }
+  }
+
+  if ( queued ) {
+    if ( next_fragment_time < timestamp() ) {
+      next_fragment_time = timestamp();
+    }
+
+    /* the repaired instruction is as good as freshly sent */
+    sent_states.back().timestamp = timestamp();
+    timers_dirty = true; /* and its retransmission is due later */
+  }
+}
+
+/* How many data fragments to protect with each parity fragment, given the
+   loss the receiver reports. A single parity fragment repairs one loss per
+   group, so groups shrink as loss gets worse. */
+template <class MyState>
+int TransportSender<MyState>::parity_group( void ) const
+{
+  if ( !(remote_capabilities & CAPABILITY_FEC) ) {
+    return 0;
+  }
+
+  if ( remote_loss_rate >= 0.15 ) {
+    return 2;
+  } else if ( remote_loss_rate >= 0.05 ) {
+    return 4;
+  } else if ( remote_loss_rate >= 0.01 ) {
+    return 8;
+  }
+
+  return 0;
+}
+
+/* A probe carries no new state, just enough chaff that the datagram is
+   exactly size octets. Random chaff doesn't compress, so the payload is
+   framed raw: one tag octet, then the instruction. */
+template <class MyState>
+void TransportSender<MyState>::send_mtu_probe( int size )
+{
+  Instruction inst;
+
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( assumed_receiver_state->num );
+  inst.set_new_num( assumed_receiver_state->num );
+  inst.set_ack_num( ack_num );
+  inst.set_throwaway_num( sent_states.front().num );
+  inst.set_capabilities( local_capabilities );
+  inst.set_mtu_probe( size );
+
+  const int instruction_len = size - fragment_overhead() - 1;
+  const int chaff_len = instruction_len - inst.SerializeAsString().size()
+    - 3; /* field tag, and two octets of length */
+  if ( (chaff_len < 128) || (chaff_len >= 16384) ) {
+    return;
+  }
+  inst.set_chaff( make_chaff( chaff_len ) );
+
+  vector<Fragment> fragments = fragmenter.make_fragments( inst, size, fragment_overhead(), 0,
+                                                          dictionary_for( *assumed_receiver_state ) );
+  if ( (fragments.size() != 1)
+       || (fragments.front().contents.size() != size_t( size - fragment_overhead() )) ) {
+    return;
+  }
+
+  if ( verbose ) {
+    fprintf( stderr, "[%u] Sent path MTU probe of %d\n",
+	     (unsigned int)(timestamp() % 100000), size );
+  }
+
+  char header[ Fragment::frag_header_len ];
+  connection->send_mtu_probe( size, header, fragments.front().write_header( header ), fragments.front().contents );
+}
+
+/* The receiver already holds the state a diff applies to, so its text
+   makes a good preset dictionary. NULL means the receiver can't use one. */
+template <class MyState>
+const string *TransportSender<MyState>::dictionary_for( const TimestampedState<MyState> &state )
+{
+  if ( !(remote_capabilities & CAPABILITY_DICTIONARY) ) {
+    return NULL;
+  }
+
+  if ( state.num != sent_dictionary_num ) {
+    sent_dictionary = state.state.dictionary();
+    sent_dictionary_num = state.num;
+  }
+
+  return &sent_dictionary;
+}
+
+template <class MyState>
+void TransportSender<MyState>::queue_fragment( Fragment &frag )
+{
+  char header[ Fragment::frag_header_len ];
+  connection->queue( header, frag.write_header( header ), frag.contents );
+}
+
+/* Spread the tail of a large instruction over time at the estimated path
+   rate, rather than dumping it into the bottleneck queue all at once. */
+template <class MyState>
+void TransportSender<MyState>::send_paced_fragments( void )
+{
+  uint64_t now = timestamp();
+
+  while ( !paced_fragments.empty() && (next_fragment_time <= now) ) {
+    Fragment &frag = paced_fragments.front();
+    next_fragment_time += (frag.contents.size() + fragment_overhead()) / connection->get_send_rate();
+
+    if ( verbose ) {
+      fprintf( stderr, "[%u] Paced id %d, frag %d, len=%d, rate=%.1f kB/s, queueing delay=%.1f\n",
+	       (unsigned int)(now % 100000), (int)frag.id, (int)frag.fragment_num,
+	       (int)frag.contents.size(), connection->get_send_rate(),
+	       connection->get_queueing_delay() );
+    }
+
+    queue_fragment( frag ); // Can throw NetworkException
+    paced_fragments.pop_front();
+  }
+
+  connection->flush();
+
+  if ( !paced_fragments.empty() ) {
+    connection->pacing_limited();
+  }
 }
 
 template <class MyState>
 void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num )
 {
+  uint64_t acked_before = sent_states.front().num;
+
   /* Ignore ack if we have culled the state it's acknowledging */
 
   if ( sent_states.end() !=
@@ -349,6 +645,9 @@ void TransportSender<MyState>::process_acknowledgment_through( uint64_t ack_num
   }
 
   assert( !sent_states.empty() );
+  if ( sent_states.front().num != acked_before ) {
+    timers_dirty = true; /* assumed_receiver_state may be gone */
+  }
 }
 
 /* give up on getting acknowledgement for shutdown */
@@ -362,9 +661,62 @@ bool TransportSender<MyState>::shutdown_ack_timed_out( void ) const
 template <class MyState>
 void TransportSender<MyState>::set_ack_num( uint64_t s_ack_num )
 {
+  /* of the ack numbers, only the shutdown one moves the timers */
+  if ( (s_ack_num == uint64_t(-1)) != (ack_num == uint64_t(-1)) ) {
+    timers_dirty = true;
+  }
   ack_num = s_ack_num;
 }
 
+template <class MyState>
+void TransportSender<MyState>::set_data_ack( void )
+{
+  pending_data_ack = true;
+
+  uint64_t now = timestamp();
+  if ( next_ack_time > now + ACK_DELAY ) {
+    next_ack_time = now + ACK_DELAY;
+  }
+}
+
+template <class MyState>
+void TransportSender<MyState>::remote_heard( uint64_t ts )
+{
+  /* hearing again after ACTIVE_RETRY_TIMEOUT resumes retries */
+  if ( last_heard + ACTIVE_RETRY_TIMEOUT <= ts ) {
+    timers_dirty = true;
+  }
+  last_heard = ts;
+}
+
+template <class MyState>
+void TransportSender<MyState>::hibernate( void )
+{
+  /* the receiver may hold states in between, so new ones still have to be
+     numbered after the last one sent */
+  if ( sent_states.size() > 2 ) {
+    typename sent_states_type::iterator second = sent_states.begin();
+    second++;
+    typename sent_states_type::iterator last = sent_states.end();
+    last--;
+    sent_states.erase( second, last );
+  }
+  assumed_receiver_state = sent_states.begin();
+
+  deque<Fragment>().swap( paced_fragments );
+  vector<Fragment>().swap( last_fragments );
+  last_fragments_num = -1;
+  pending_nack = false;
+  string().swap( nack_bitmap );
+  sent_dictionary_num = -1;
+  string().swap( sent_dictionary );
+  fragmenter.forget_last_instruction();
+  mindelay_clock = -1;
+
+  hibernating = true;
+  timers_dirty = true;
+}
+
 /* Investigate diff against known receiver state instead */
 /* Mutates proposed_diff */
 template <class MyState>
@@ -36,6 +36,7 @@
 
 #include <string>
 #include <list>
+#include <deque>
 
 #include "network.h"
 #include "transportinstruction.pb.h"
@@ -44,6 +45,7 @@
 #include "prng.h"
 
 using std::list;
+using std::deque;
 using std::pair;
 using namespace TransportBuffers;
 
@@ -55,6 +57,7 @@ namespace Network {
   const int ACK_DELAY = 100; /* ms before delayed ack */
   const int SHUTDOWN_RETRIES = 16; /* number of shutdown packets to send before giving up */
   const int ACTIVE_RETRY_TIMEOUT = 10000; /* attempt to resend at frame rate */
+  const unsigned int PACING_BURST = 4; /* fragments sent back to back before pacing the rest */
 
   template <class MyState>
   class TransportSender
@@ -67,6 +70,10 @@ namespace Network {
     void send_to_receiver( string diff );
     void send_empty_ack( void );
     void send_in_fragments( string diff, uint64_t new_num );
+    void queue_fragment( Fragment &frag ); /* sent at the next connection->flush() */
+    void send_paced_fragments( void );
+    /* octets a fragment costs on the wire beyond its contents */
+    int fragment_overhead( void ) const { return connection->get_overhead() + Fragment::frag_header_len; }
     void add_sent_state( uint64_t the_timestamp, uint64_t num, MyState &state );
 
     /* state of sender */
@@ -85,10 +92,35 @@ namespace Network {
     /* for fragment creation */
     Fragmenter fragmenter;
 
+    /* fragments of the last instruction still waiting for the send rate */
+    deque<Fragment> paced_fragments;
+    double next_fragment_time;
+
+    /* the last instruction sent, kept for selective retransmission */
+    vector<Fragment> last_fragments;
+    uint64_t last_fragments_num;
+
+    /* retransmission request to piggyback on the next instruction */
+    bool pending_nack;
+    uint64_t nack_id;
+    string nack_bitmap;
+
+    /* size of the last path MTU probe received, to echo back (0 if none) */
+    unsigned int mtu_probe_ack;
+    void send_mtu_probe( int size );
+
     /* timing state */
     uint64_t next_ack_time;
     uint64_t next_send_time;
 
+    /* Timers only move when something they depend on does, so
+       calculate_timers() skips the work (and the full state comparisons)
+       until the states, acks or RTT estimate change, or a timeout they
+       depend on runs out. */
+    bool timers_dirty;
+    uint64_t timers_valid_until;
+    uint64_t timers_timeout; /* connection->timeout() they were based on */
+    unsigned int timers_send_interval;
     void calculate_timers( void );
 
     bool verbose;
@@ -99,6 +131,19 @@ namespace Network {
     uint64_t ack_num;
     bool pending_data_ack;
 
+    /* what we advertise, less anything that has let us down */
+    unsigned int local_capabilities;
+
+    /* what the receiver has told us about itself and its path */
+    unsigned int remote_capabilities;
+    double remote_loss_rate;
+    int parity_group( void ) const;
+
+    /* dictionary of the last state we compressed against */
+    uint64_t sent_dictionary_num;
+    string sent_dictionary;
+    const string *dictionary_for( const TimestampedState<MyState> &state );
+
     unsigned int SEND_MINDELAY; /* ms to collect all input */
 
     uint64_t last_heard; /* last time received new state */
@@ -106,9 +151,13 @@ namespace Network {
     /* chaff to disguise instruction length */
     PRNG prng;
     const string make_chaff( void );
+    const string make_chaff( size_t len );
 
     uint64_t mindelay_clock; /* time of first pending change to current state */
 
+    /* receiver gone quiet: no timers, and only the states we can't do without */
+    bool hibernating;
+
   public:
     /* constructor */
     TransportSender( Connection *s_connection, MyState &initial_state );
@@ -126,18 +175,43 @@ namespace Network {
     void set_ack_num( uint64_t s_ack_num );
 
     /* Accelerate reply ack */
-    void set_data_ack( void ) { pending_data_ack = true; }
+    void set_data_ack( void );
 
     /* Received something */
-    void remote_heard( uint64_t ts ) { last_heard = ts; }
+    void remote_heard( uint64_t ts );
+
+    /* Ask the other side to fill in missing fragments of instruction id */
+    void set_nack( uint64_t id, const string &bitmap );
+
+    /* Received a path MTU probe of this size */
+    void set_mtu_probe_ack( unsigned int size ) { mtu_probe_ack = size; next_ack_time = timestamp(); }
+
+    /* Executed upon receipt of a retransmission request */
+    void process_nack( uint64_t id, const string &bitmap );
+
+    /* Receiver's advertised features and reported loss */
+    void set_remote_capabilities( unsigned int s_capabilities ) { remote_capabilities = s_capabilities; }
+    void set_remote_loss_rate( double s_loss_rate ) { remote_loss_rate = s_loss_rate; }
+
+    /* Stop advertising a feature that failed on our end */
+    void disable_capability( unsigned int capability ) { local_capabilities &= ~capability; }
 
     /* Starts shutdown sequence */
-    void start_shutdown( void ) { shutdown_in_progress = true; }
+    void start_shutdown( void ) { shutdown_in_progress = true; hibernating = false; timers_dirty = true; }
+
+    /* Keeps the acknowledged state (and the last sent one, for its number)
+       and sends nothing until wake() */
+    void hibernate( void );
+    void wake( void ) { hibernating = false; next_ack_time = timestamp(); timers_dirty = true; }
+    bool get_hibernating( void ) const { return hibernating; }
 
     /* Misc. getters and setters */
-    /* Cannot modify current_state while shutdown in progress */
-    MyState &get_current_state( void ) { assert( !shutdown_in_progress ); return current_state; }
-    void set_current_state( const MyState &x ) { assert( !shutdown_in_progress ); current_state = x; }
+    /* Cannot modify current_state while shutdown in progress. The
+       non-const accessor is for changing it; reads should go through the
+       const one, which leaves the timers alone. */
+    MyState &get_current_state( void ) { assert( !shutdown_in_progress ); timers_dirty = true; return current_state; }
+    const MyState &get_current_state( void ) const { return current_state; }
+    void set_current_state( const MyState &x ) { assert( !shutdown_in_progress ); current_state = x; timers_dirty = true; }
     void set_verbose( void ) { verbose = true; }
 
     bool get_shutdown_in_progress( void ) const { return shutdown_in_progress; }
@@ -149,7 +223,7 @@ namespace Network {
 
     bool shutdown_ack_timed_out( void ) const;
 
-    void set_send_delay( int new_delay ) { SEND_MINDELAY = new_delay; }
+    void set_send_delay( int new_delay ) { SEND_MINDELAY = new_delay; timers_dirty = true; }
 
     unsigned int send_interval( void ) const;
 
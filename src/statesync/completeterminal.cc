@@ -31,7 +31,6 @@
 */
 
 #include "completeterminal.h"
-#include "fatal_assert.h"
 
 #include "hostinput.pb.h"
 
@@ -42,7 +41,20 @@ using namespace HostBuffers;
 
 string Complete::act( const string &str )
 {
-  for ( unsigned int i = 0; i < str.size(); i++ ) {
+  screen_num++;
+
+  /* A plain-text tail (e.g. from cat) that scrolls through more than
+     a screenful needn't be emulated in full */
+  size_t plain_start = str.size();
+  while ( (plain_start > 0) && Emulator::is_plain( str[ plain_start - 1 ] ) ) {
+    plain_start--;
+  }
+
+  for ( size_t i = 0; i < str.size(); i++ ) {
+    if ( (i == plain_start) && parser.is_idle() ) {
+      i = terminal.skip_offscreen_text( str, i );
+    }
+
     /* parse octet into up to three actions */
     list<Action *> actions( parser.input( str[ i ] ) );
     
@@ -62,6 +74,7 @@ string Complete::act( const string &str )
 string Complete::act( const Action *act )
 {
   /* apply action to terminal */
+  screen_num++;
   act->act_on_terminal( &terminal );
   return terminal.read_octets_to_host();
 }
@@ -77,7 +90,7 @@ string Complete::diff_from( const Complete &existing ) const
     new_echo->MutableExtension( echoack )->set_echo_ack_num( get_echo_ack() );
   }
 
-  if ( !(existing.get_fb() == get_fb()) ) {
+  if ( !same_screen( existing ) && !(existing.get_fb() == get_fb()) ) {
     if ( (existing.get_fb().ds.get_width() != terminal.get_fb().ds.get_width())
 	 || (existing.get_fb().ds.get_height() != terminal.get_fb().ds.get_height()) ) {
       Instruction *new_res = output.add_instruction();
@@ -85,16 +98,95 @@ string Complete::diff_from( const Complete &existing ) const
       new_res->MutableExtension( resize )->set_height( terminal.get_fb().ds.get_height() );
     }
     Instruction *new_inst = output.add_instruction();
-    new_inst->MutableExtension( hostbytes )->set_hoststring( display.new_frame( true, existing.get_fb(), terminal.get_fb() ) );
+
+    /* another client may already have needed the same update */
+    const string *frame = NULL;
+    bool shared = diff_cache && (diff_cache == existing.diff_cache);
+    if ( shared ) {
+      frame = diff_cache->find( existing.screen_num, screen_num );
+    }
+    if ( frame ) {
+      new_inst->MutableExtension( hostbytes )->set_hoststring( *frame );
+    } else {
+      string new_frame( display.new_frame( true, existing.get_fb(), terminal.get_fb() ) );
+      if ( shared ) {
+	diff_cache->add( existing.screen_num, screen_num, new_frame );
+      }
+      new_inst->MutableExtension( hostbytes )->set_hoststring( new_frame );
+    }
   }
   
   return output.SerializeAsString();
 }
 
-void Complete::apply_string( string diff )
+static void append_utf8( string &out, wchar_t ch )
+{
+  uint32_t c = ch;
+  if ( c < 0x80 ) {
+    out.push_back( c );
+  } else if ( c < 0x800 ) {
+    out.push_back( 0xC0 | (c >> 6) );
+    out.push_back( 0x80 | (c & 0x3F) );
+  } else if ( c < 0x10000 ) {
+    out.push_back( 0xE0 | (c >> 12) );
+    out.push_back( 0x80 | ((c >> 6) & 0x3F) );
+    out.push_back( 0x80 | (c & 0x3F) );
+  } else {
+    out.push_back( 0xF0 | ((c >> 18) & 0x07) );
+    out.push_back( 0x80 | ((c >> 12) & 0x3F) );
+    out.push_back( 0x80 | ((c >> 6) & 0x3F) );
+    out.push_back( 0x80 | (c & 0x3F) );
+  }
+}
+
+/* Text of the screen, for compressing diffs against. Both ends must
+   compute the same string from equal framebuffers, so it leaves out
+   blank rows and trailing blanks, which depend on the window size. */
+string Complete::dictionary( void ) const
+{
+  string ret;
+  const Framebuffer &fb = get_fb();
+
+  for ( int r = 0; r < fb.ds.get_height(); r++ ) {
+    const Row *row = fb.get_row( r );
+    string line;
+    size_t text_len = 0;
+
+    for ( vector<Cell>::const_iterator i = row->cells.begin();
+	  i != row->cells.end();
+	  i++ ) {
+      if ( i->contents.empty() ) {
+	line.push_back( ' ' );
+	continue;
+      }
+      for ( vector<wchar_t>::const_iterator j = i->contents.begin();
+	    j != i->contents.end();
+	    j++ ) {
+	append_utf8( line, *j );
+      }
+      if ( i->contents != vector<wchar_t>( 1, L' ' ) ) {
+	text_len = line.size();
+      }
+    }
+
+    if ( text_len ) {
+      ret.append( line, 0, text_len );
+      ret.append( "\r\n" );
+    }
+  }
+
+  return ret;
+}
+
+bool Complete::apply_string( string diff )
 {
   HostBuffers::HostMessage input;
-  fatal_assert( input.ParseFromString( diff ) );
+  if ( !input.ParseFromString( diff ) ) {
+    return false;
+  }
+
+  /* no longer numbered along with the terminal this came from */
+  diff_cache = NULL;
 
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( hostbytes ) ) {
@@ -109,12 +201,42 @@ void Complete::apply_string( string diff )
       echo_ack = inst_echo_ack_num;
     }
   }
+
+  return true;
 }
 
 bool Complete::operator==( Complete const &x ) const
 {
   //  assert( parser == x.parser ); /* parser state is irrelevant for us */
-  return (terminal == x.terminal) && (echo_ack == x.echo_ack);
+  return (same_screen( x ) || (terminal == x.terminal)) && (echo_ack == x.echo_ack);
+}
+
+void Complete::set_screen( const Complete &x )
+{
+  parser = x.parser;
+  terminal = x.terminal;
+  diff_cache = x.diff_cache;
+  screen_num = x.screen_num;
+}
+
+const string *DiffCache::find( uint64_t old_num, uint64_t new_num )
+{
+  for ( list<Entry>::iterator i = entries.begin(); i != entries.end(); i++ ) {
+    if ( (i->old_num == old_num) && (i->new_num == new_num) ) {
+      entries.splice( entries.begin(), entries, i );
+      hits++;
+      return &entries.front().frame;
+    }
+  }
+  return NULL;
+}
+
+void DiffCache::add( uint64_t old_num, uint64_t new_num, const string &frame )
+{
+  entries.push_front( Entry( old_num, new_num, frame ) );
+  if ( entries.size() > MAX_ENTRIES ) {
+    entries.pop_back();
+  }
 }
 
 static bool old_ack(uint64_t newest_echo_ack, const pair<uint64_t, uint64_t> p)
@@ -122,9 +244,8 @@ static bool old_ack(uint64_t newest_echo_ack, const pair<uint64_t, uint64_t> p)
   return p.first < newest_echo_ack;
 }
 
-bool Complete::set_echo_ack( uint64_t now )
+uint64_t Complete::get_newest_echo_ack( uint64_t now ) const
 {
-  bool ret = false;
   uint64_t newest_echo_ack = 0;
 
   for ( input_history_type::const_iterator i = input_history.begin();
@@ -135,6 +256,14 @@ bool Complete::set_echo_ack( uint64_t now )
     }
   }
 
+  return newest_echo_ack;
+}
+
+bool Complete::set_echo_ack( uint64_t now )
+{
+  bool ret = false;
+  uint64_t newest_echo_ack = get_newest_echo_ack( now );
+
   input_history.remove_if( bind1st( ptr_fun( old_ack ), newest_echo_ack ) );
 
   if ( echo_ack != newest_echo_ack ) {
@@ -34,6 +34,7 @@
 #define COMPLETE_TERMINAL_HPP
 
 #include <list>
+#include <string>
 #include <stdint.h>
 
 #include "parser.h"
@@ -42,6 +43,31 @@
 /* This class represents the complete terminal -- a UTF8Parser feeding Actions to an Emulator. */
 
 namespace Terminal {
+  /* Screen updates already worked out for one terminal, for the other
+     clients watching it that have acknowledged the same screen */
+  class DiffCache {
+  private:
+    struct Entry {
+      uint64_t old_num, new_num;
+      std::string frame;
+
+      Entry( uint64_t s_old, uint64_t s_new, const std::string &s_frame )
+	: old_num( s_old ), new_num( s_new ), frame( s_frame ) {}
+    };
+
+    static const size_t MAX_ENTRIES = 16;
+    std::list<Entry> entries; /* most recently used first */
+    uint64_t hits;
+
+  public:
+    DiffCache() : entries(), hits( 0 ) {}
+
+    const std::string *find( uint64_t old_num, uint64_t new_num );
+    void add( uint64_t old_num, uint64_t new_num, const std::string &frame );
+    void clear( void ) { entries.clear(); }
+    uint64_t get_hits( void ) const { return hits; }
+  };
+
   class Complete {
   private:
     Parser::UTF8Parser parser;
@@ -54,9 +80,15 @@ namespace Terminal {
 
     static const int ECHO_TIMEOUT = 50; /* for late ack */
 
+    /* Completes sharing a cache number their screens together, so equal
+       numbers mean equal screens; copies keep both */
+    DiffCache *diff_cache;
+    uint64_t screen_num;
+
   public:
     Complete( size_t width, size_t height ) : parser(), terminal( width, height ), display( false ),
-					      input_history(), echo_ack( 0 ) {}
+					      input_history(), echo_ack( 0 ),
+					      diff_cache( NULL ), screen_num( 0 ) {}
     
     std::string act( const std::string &str );
     std::string act( const Parser::Action *act );
@@ -65,15 +97,27 @@ namespace Terminal {
     bool parser_grounded( void ) const { return parser.is_grounded(); }
 
     uint64_t get_echo_ack( void ) const { return echo_ack; }
+    /* what set_echo_ack() would set */
+    uint64_t get_newest_echo_ack( uint64_t now ) const;
     bool set_echo_ack( uint64_t now );
     void register_input_frame( uint64_t n, uint64_t now );
     int wait_time( uint64_t now ) const;
 
+    /* For several clients of one terminal: each keeps a copy with its own
+       echo ack, and takes the screen from the shared one */
+    void set_diff_cache( DiffCache *cache ) { diff_cache = cache; }
+    void set_screen( const Complete &x );
+    bool same_screen( const Complete &x ) const
+    {
+      return diff_cache && (diff_cache == x.diff_cache) && (screen_num == x.screen_num);
+    }
+
     /* interface for Network::Transport */
     void subtract( const Complete * ) {}
     std::string diff_from( const Complete &existing ) const;
-    void apply_string( std::string diff );
+    bool apply_string( std::string diff ); /* false if it doesn't parse */
     bool operator==( const Complete &x ) const;
+    std::string dictionary( void ) const;
 
     bool compare( const Complete &other ) const;
   };
@@ -34,7 +34,6 @@
 #include <typeinfo>
 
 #include "user.h"
-#include "fatal_assert.h"
 #include "userinput.pb.h"
 
 using namespace Parser;
@@ -99,10 +98,21 @@ string UserStream::diff_from( const UserStream &existing ) const
   return output.SerializeAsString();
 }
 
-void UserStream::apply_string( string diff )
+bool UserStream::apply_string( string diff )
 {
   ClientBuffers::UserMessage input;
-  fatal_assert( input.ParseFromString( diff ) );
+  if ( !input.ParseFromString( diff ) ) {
+    return false;
+  }
+
+  /* a window has to have something in it */
+  for ( int i = 0; i < input.instruction_size(); i++ ) {
+    if ( input.instruction( i ).HasExtension( resize )
+	 && ( (input.instruction( i ).GetExtension( resize ).width() <= 0)
+	      || (input.instruction( i ).GetExtension( resize ).height() <= 0) ) ) {
+      return false;
+    }
+  }
 
   for ( int i = 0; i < input.instruction_size(); i++ ) {
     if ( input.instruction( i ).HasExtension( keystroke ) ) {
@@ -115,6 +125,8 @@ void UserStream::apply_string( string diff )
 					    input.instruction( i ).GetExtension( resize ).height() ) ) );
     }
   }
+
+  return true;
 }
 
 const Parser::Action *UserStream::get_action( unsigned int i )
@@ -89,8 +89,9 @@ namespace Network {
     /* interface for Network::Transport */
     void subtract( const UserStream *prefix );
     string diff_from( const UserStream &existing ) const;
-    void apply_string( string diff );
+    bool apply_string( string diff ); /* false if no client could have sent it */
     bool operator==( const UserStream &x ) const { return actions == x.actions; }
+    string dictionary( void ) const { return string(); } /* keystrokes don't repeat usefully */
 
     bool compare( const UserStream & ) const { return false; }
   };
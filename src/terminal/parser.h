@@ -89,6 +89,8 @@ namespace Parser {
     }
 
     bool is_grounded( void ) const { return parser.is_grounded(); }
+    /* grounded, with no partial UTF-8 sequence buffered */
+    bool is_idle( void ) const { return (buf_len == 0) && parser.is_grounded(); }
   };
 }
 
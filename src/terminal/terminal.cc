@@ -139,6 +139,117 @@ void Emulator::print( const Parser::Print *act )
   }
 }
 
+/* Cursor movement of one plain character, as print() and the CR and LF
+   controls would do it with autowrap on and a full-screen scrolling
+   region. Returns true if the screen scrolled. */
+static bool plain_step( char c, int width, int height,
+			int &row, int &col, bool &wrap )
+{
+  bool new_line;
+
+  if ( c == '\r' ) {
+    col = 0;
+    wrap = false;
+    return false;
+  } else if ( c == '\n' ) {
+    new_line = true;
+  } else {
+    new_line = wrap;
+    if ( wrap ) {
+      col = 0;
+    }
+  }
+
+  bool scrolled = false;
+  if ( new_line ) {
+    if ( row == height - 1 ) {
+      scrolled = true;
+    } else {
+      row++;
+    }
+    wrap = false;
+  }
+
+  if ( c != '\n' ) {
+    col++;
+    wrap = (col >= width);
+    if ( col >= width ) {
+      col = width - 1;
+    }
+  }
+
+  return scrolled;
+}
+
+size_t Emulator::skip_offscreen_text( const std::string &str, size_t start )
+{
+  int width = fb.ds.get_width();
+  int height = fb.ds.get_height();
+
+  if ( (!fb.ds.auto_wrap_mode) || fb.ds.insert_mode
+       || (fb.ds.get_scrolling_region_top_row() != 0)
+       || (fb.ds.get_scrolling_region_bottom_row() != height - 1) ) {
+    return start;
+  }
+
+  /* Every row on the screen is gone after height more scrolls,
+     so nothing printed before the last height of them can show. */
+  int row = fb.ds.get_cursor_row(), col = fb.ds.get_cursor_col();
+  bool wrap = fb.ds.next_print_will_wrap;
+  int scrolls = 0;
+  for ( size_t i = start; i < str.size(); i++ ) {
+    if ( plain_step( str[ i ], width, height, row, col, wrap ) ) {
+      scrolls++;
+    }
+  }
+
+  if ( scrolls < height ) {
+    return start;
+  }
+
+  /* replay up to the character causing the first of those scrolls */
+  int skip_scrolls = scrolls - height;
+  row = fb.ds.get_cursor_row();
+  col = fb.ds.get_cursor_col();
+  wrap = fb.ds.next_print_will_wrap;
+  int printed_col = -1; /* of the last character skipped, on this row */
+  size_t i = start;
+  for ( ; i < str.size(); i++ ) {
+    int saved_row = row, saved_col = col;
+    bool saved_wrap = wrap;
+    if ( plain_step( str[ i ], width, height, row, col, wrap ) ) {
+      if ( skip_scrolls == 0 ) {
+	row = saved_row;
+	col = saved_col;
+	wrap = saved_wrap;
+	break;
+      }
+      skip_scrolls--;
+    }
+
+    if ( (str[ i ] == '\r') || (str[ i ] == '\n') ) {
+      printed_col = -1;
+    } else {
+      printed_col = wrap ? col : col - 1;
+    }
+  }
+
+  /* The rows themselves are left as they were, since the rest of
+     the text scrolls all of them away. A combining character that
+     follows still belongs to the last character printed, as print()
+     would have left it. */
+  fb.ds.move_row( row );
+  if ( printed_col >= 0 ) {
+    fb.ds.move_col( printed_col );
+    fb.ds.move_col( col - printed_col, true, true );
+  } else {
+    fb.ds.move_col( col );
+  }
+  fb.ds.next_print_will_wrap = wrap;
+
+  return i;
+}
+
 void Emulator::CSI_dispatch( const Parser::CSI_Dispatch *act )
 {
   dispatch.dispatch( CSI, act, &fb );
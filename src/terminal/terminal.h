@@ -78,6 +78,13 @@ namespace Terminal {
 
     std::string read_octets_to_host( void );
 
+    /* Plain text is printable ASCII, CR and LF. Given that str[start..]
+       is all plain, skips the part of it that would scroll off the screen
+       before the end anyway, leaving the cursor where emulating it would
+       have. Returns where emulation has to pick up again. */
+    static bool is_plain( char c ) { return ((c >= 0x20) && (c <= 0x7e)) || (c == '\r') || (c == '\n'); }
+    size_t skip_offscreen_text( const std::string &str, size_t start );
+
     static std::string open( void ); /* put user cursor keys in application mode */
     static std::string close( void ); /* restore user cursor keys */
 
@@ -0,0 +1,255 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Runs a mosh-server daemon in a child process, and sends it what no
+   real "mosh-server new" or client would: a pty with no size or an
+   enormous one, a resize to nothing or to an enormous window, an
+   instruction that doesn't parse, and keystrokes that don't. Each may
+   end the session it was sent to, but the daemon, and every other
+   session in it, must carry on. */
+
+#include "config.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if HAVE_PTY_H
+#include <pty.h>
+#elif HAVE_UTIL_H
+#include <util.h>
+#endif
+
+#if FORKPTY_IN_LIBUTIL
+#include <libutil.h>
+#endif
+
+/* the daemon itself, which is otherwise only built into mosh-server */
+#include "serverdaemon.cc"
+
+using namespace Network;
+
+static char socket_path[ 64 ];
+static vector<int> slaves; /* held open, or the shells would seem to have gone */
+
+struct Client {
+  int port;
+  string key;
+  uint32_t id;
+};
+
+/* Hands over a new pty of this size, as "mosh-server new" would */
+static bool start_session( int cols, int rows, Client *client )
+{
+  struct winsize window_size;
+  memset( &window_size, 0, sizeof( window_size ) );
+  window_size.ws_col = cols;
+  window_size.ws_row = rows;
+
+  int master, slave;
+  fatal_assert( openpty( &master, &slave, NULL, NULL, &window_size ) == 0 );
+  slaves.push_back( slave );
+
+  int fd = ServerDaemon::connect_to_daemon( socket_path );
+  fatal_assert( fd >= 0 );
+  string line;
+  bool ok = ServerDaemon::hand_off( fd, master, &line );
+  close( fd );
+  close( master );
+  if ( !ok ) {
+    return false;
+  }
+
+  char key[ 32 ];
+  unsigned int id;
+  fatal_assert( sscanf( line.c_str(), "MOSH CONNECT %d %22s %x", &client->port, key, &id ) == 3 );
+  client->key = key;
+  client->id = id;
+  return true;
+}
+
+/* The line "mosh-server list" would show for the session, or "" */
+static string listing( const Client &client )
+{
+  int fd = ServerDaemon::connect_to_daemon( socket_path );
+  fatal_assert( fd >= 0 );
+  string all;
+  fatal_assert( ServerDaemon::request_list( fd, &all ) );
+  close( fd );
+
+  char prefix[ 32 ];
+  snprintf( prefix, sizeof( prefix ), "MOSH SESSION %08x ", (unsigned int)client.id );
+  size_t start = all.find( prefix );
+  if ( start == string::npos ) {
+    return string();
+  }
+  return all.substr( start, all.find( '\n', start ) - start );
+}
+
+typedef Transport< UserStream, Terminal::Complete > ClientConnection;
+
+/* Gives the daemon a few seconds to end the session */
+static bool ends( const Client &client, ClientConnection *network )
+{
+  for ( int i = 0; i < 300; i++ ) {
+    if ( network ) {
+      freeze_timestamp(); /* as Select would */
+      network->tick();
+    }
+    if ( listing( client ).empty() ) {
+      return true;
+    }
+    usleep( 10000 );
+  }
+  return false;
+}
+
+/* A client that does everything right but the size it asks for */
+static bool resize_ends( int cols, int rows )
+{
+  Client client;
+  fatal_assert( start_session( 80, 24, &client ) );
+
+  UserStream blank;
+  Terminal::Complete remote( 80, 24 );
+  ClientConnection network( blank, remote, client.key.c_str(), "127.0.0.1", client.port );
+  network.set_session_id( client.id );
+  network.get_current_state().push_back( Parser::Resize( cols, rows ) );
+
+  return ends( client, &network );
+}
+
+/* One datagram, with a good key but this payload */
+static bool payload_ends( const string &payload )
+{
+  Client client;
+  fatal_assert( start_session( 80, 24, &client ) );
+
+  Connection connection( client.key.c_str(), "127.0.0.1", client.port );
+  connection.set_session_id( client.id );
+  Fragment fragment( 1, 0, true, payload );
+  char header[ Fragment::frag_header_len ];
+  connection.send( header, fragment.write_header( header ), payload );
+
+  return ends( client, NULL );
+}
+
+/* A well-formed instruction, whose keystrokes aren't */
+static string bad_diff( void )
+{
+  Instruction inst;
+  inst.set_protocol_version( MOSH_PROTOCOL_VERSION );
+  inst.set_old_num( 0 );
+  inst.set_new_num( 1 );
+  inst.set_ack_num( 0 );
+  inst.set_throwaway_num( 0 );
+  inst.set_diff( string( "\xff\xff\xff\xff", 4 ) );
+  return get_compressor().compress_str( inst.SerializeAsString() );
+}
+
+int main( void )
+{
+  snprintf( socket_path, sizeof( socket_path ), "/tmp/mosh-daemon-input.%d", (int)getpid() );
+
+  pid_t daemon = fork();
+  fatal_assert( daemon >= 0 );
+  if ( daemon == 0 ) {
+    signal( SIGPIPE, SIG_IGN ); /* as mosh-server does */
+    ServerDaemon server( "127.0.0.1", "0", socket_path, false, 0 );
+    server.run();
+    _exit( 0 );
+  }
+
+  bool listening = false;
+  for ( int i = 0; (i < 500) && !listening; i++ ) {
+    usleep( 10000 );
+    int fd = ServerDaemon::connect_to_daemon( socket_path );
+    if ( fd >= 0 ) {
+      string all;
+      listening = ServerDaemon::request_list( fd, &all );
+      close( fd );
+    }
+  }
+  fatal_assert( listening );
+
+  bool ok = true;
+
+  /* the one that has to outlive the others: a pty of no size gets 80x24 */
+  Client bystander;
+  if ( !start_session( 0, 0, &bystander ) || (listing( bystander ).find( " 80x24 " ) == string::npos) ) {
+    fprintf( stderr, "A pty of no size didn't make an 80x24 session\n" );
+    ok = false;
+  }
+
+  Client huge;
+  if ( start_session( 30000, 30000, &huge ) ) {
+    fprintf( stderr, "A pty too large to emulate was taken\n" );
+    ok = false;
+  }
+
+  if ( !resize_ends( 0, 0 ) ) {
+    fprintf( stderr, "A resize to nothing didn't end its session\n" );
+    ok = false;
+  }
+
+  if ( !resize_ends( 100000, 100000 ) ) {
+    fprintf( stderr, "A resize too large to emulate didn't end its session\n" );
+    ok = false;
+  }
+
+  if ( !payload_ends( get_compressor().compress_str( "not an instruction" ) ) ) {
+    fprintf( stderr, "An instruction that doesn't parse didn't end its session\n" );
+    ok = false;
+  }
+
+  if ( !payload_ends( bad_diff() ) ) {
+    fprintf( stderr, "Keystrokes that don't parse didn't end their session\n" );
+    ok = false;
+  }
+
+  if ( waitpid( daemon, NULL, WNOHANG ) != 0 ) {
+    fprintf( stderr, "The daemon died\n" );
+    return 1;
+  }
+  if ( listing( bystander ).empty() ) {
+    fprintf( stderr, "A session nobody sent anything bad to ended\n" );
+    ok = false;
+  }
+
+  kill( daemon, SIGKILL );
+  waitpid( daemon, NULL, 0 );
+  unlink( socket_path );
+
+  return ok ? 0 : 1;
+}
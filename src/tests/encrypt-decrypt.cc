@@ -32,7 +32,8 @@
 
 /* Tests the Mosh crypto layer by encrypting and decrypting a bunch of random
    messages, interspersed with some random bad ciphertexts which we need to
-   reject. */
+   reject. Each session runs once with AES-OCB and once with
+   ChaCha20-Poly1305, where OpenSSL has it. */
 
 #include <stdio.h>
 
@@ -86,13 +87,33 @@ void test_bad_decrypt( Session &decryption_session ) {
   fatal_assert( got_exn );
 }
 
+/* A packet must not decrypt as the other cipher's, with the nonce bit
+   that selects the cipher flipped in transit. */
+void test_cipher_swap( Session &decryption_session, const std::string &ciphertext ) {
+  std::string swapped( ciphertext );
+  swapped[ 0 ] ^= char( Session::CHACHA20_NONCE_BIT >> 56 );
+
+  bool got_exn = false;
+  try {
+    decryption_session.decrypt( swapped );
+  } catch ( const CryptoException& e ) {
+    got_exn = true;
+    fatal_assert( ! e.fatal );
+  }
+
+  fatal_assert( got_exn );
+}
+
 /* Generate a single key and initial nonce, then perform some encryptions. */
-void test_one_session( void ) {
+void test_one_session( bool chacha20 ) {
   Base64Key key;
   Session encryption_session( key );
   Session decryption_session( key );
 
-  uint64_t nonce_int = prng.uint64();
+  uint64_t nonce_int = prng.uint64() & ~Session::CHACHA20_NONCE_BIT;
+  if ( chacha20 ) {
+    nonce_int |= Session::CHACHA20_NONCE_BIT;
+  }
 
   if ( verbose ) {
     hexdump( key.data(), 16, "key" );
@@ -128,6 +149,10 @@ void test_one_session( void ) {
       test_bad_decrypt( decryption_session );
     }
 
+    if ( ! ( prng.uint8() % 16 ) ) {
+      test_cipher_swap( decryption_session, ciphertext );
+    }
+
     if ( verbose ) {
       printf( "\n" );
     }
@@ -139,9 +164,14 @@ int main( int argc, char *argv[] ) {
     verbose = false;
   }
 
-  for ( size_t i=0; i<NUM_SESSIONS; i++ ) {
+  for ( size_t i=0; i<2*NUM_SESSIONS; i++ ) {
+    bool chacha20 = i & 1;
+    if ( chacha20 && !ChaCha20Poly1305::available() ) {
+      continue;
+    }
+
     try {
-      test_one_session();
+      test_one_session( chacha20 );
     } catch ( const CryptoException& e ) {
       fprintf( stderr, "Crypto exception: %s\r\n",
                e.text.c_str() );
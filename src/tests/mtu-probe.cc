@@ -0,0 +1,183 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Sends path MTU probes of every candidate size, over IPv4 and IPv6,
+   with and without precise timestamps and a session id, to a plain UDP
+   socket. Each probe must come to exactly its size as an IP datagram,
+   and the fragments of a large instruction sent afterwards must fill,
+   but not overflow, the MTU the probes found. */
+
+#include "config.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "user.h"
+#include "timestamp.h"
+#include "networktransport.cc"
+
+using namespace Network;
+
+const int CANDIDATES[] = { 1280, 1400, 1492, 1500, 2000 };
+const int CANDIDATE_COUNT = sizeof( CANDIDATES ) / sizeof( CANDIDATES[ 0 ] );
+
+PRNG prng;
+
+/* Sizes of the datagrams waiting on sock, as IP datagrams */
+static vector<int> drain( int sock, int ip_header_len )
+{
+  vector<int> sizes;
+  char buf[ 65536 ];
+  ssize_t len;
+
+  while ( (len = recv( sock, buf, sizeof( buf ), MSG_DONTWAIT )) >= 0 ) {
+    sizes.push_back( len + 8 + ip_header_len );
+  }
+  return sizes;
+}
+
+static int largest( const vector<int> &sizes )
+{
+  int ret = 0;
+  for ( size_t i = 0; i < sizes.size(); i++ ) {
+    ret = std::max( ret, sizes[ i ] );
+  }
+  return ret;
+}
+
+static bool test_path( int family, bool precise, bool session_id )
+{
+  const char *ip = (family == AF_INET6) ? "::1" : "127.0.0.1";
+  const int ip_header_len = (family == AF_INET6) ? 40 : 20;
+  char path[ 64 ];
+  snprintf( path, sizeof( path ), "IPv%d%s%s", (family == AF_INET6) ? 6 : 4,
+	    precise ? ", precise" : "", session_id ? ", session id" : "" );
+
+  int sock = socket( family, SOCK_DGRAM, 0 );
+  if ( sock < 0 ) {
+    return true; /* no such address family here */
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof( addr );
+  memset( &addr, 0, sizeof( addr ) );
+  addr.ss_family = family;
+  if ( family == AF_INET6 ) {
+    ((struct sockaddr_in6 *)&addr)->sin6_addr = in6addr_loopback;
+  } else {
+    ((struct sockaddr_in *)&addr)->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+  }
+  if ( (bind( sock, (struct sockaddr *)&addr, addrlen ) < 0)
+       || (getsockname( sock, (struct sockaddr *)&addr, &addrlen ) < 0) ) {
+    close( sock );
+    return true;
+  }
+  int port = ntohs( (family == AF_INET6) ? ((struct sockaddr_in6 *)&addr)->sin6_port
+		    : ((struct sockaddr_in *)&addr)->sin_port );
+
+  Base64Key key;
+  Connection connection( key.printable_key().c_str(), ip, port );
+  connection.set_precise_timestamps( precise );
+  if ( session_id ) {
+    connection.set_session_id( 0x01020304 );
+  }
+
+  UserStream state;
+  TransportSender<UserStream> sender( &connection, state );
+  sender.set_remote_capabilities( CAPABILITY_PMTUD | CAPABILITY_DICTIONARY );
+
+  bool ok = true;
+
+  for ( int i = 0; i < CANDIDATE_COUNT; i++ ) {
+    sender.tick();
+    int probe = largest( drain( sock, ip_header_len ) );
+    if ( probe != CANDIDATES[ i ] ) {
+      fprintf( stderr, "%s: probe of %d went out as %d\n", path, CANDIDATES[ i ], probe );
+      ok = false;
+    }
+    connection.mtu_probe_acked( CANDIDATES[ i ] );
+  }
+
+  if ( connection.get_MTU() != CANDIDATES[ CANDIDATE_COUNT - 1 ] ) {
+    fprintf( stderr, "%s: MTU is %d after every probe was acknowledged\n", path, connection.get_MTU() );
+    close( sock );
+    return false;
+  }
+
+  /* random keystrokes don't compress, so this takes several fragments */
+  for ( int i = 0; i < 8192; i++ ) {
+    state.push_back( Parser::UserByte( prng.uint8() ) );
+  }
+  sender.set_current_state( state );
+
+  vector<int> sizes; /* the burst, and the paced rest, within a send interval */
+  for ( int i = 0; i < 50; i++ ) {
+    usleep( 10000 );
+    freeze_timestamp(); /* as Select would */
+    sender.tick();
+    vector<int> more = drain( sock, ip_header_len );
+    sizes.insert( sizes.end(), more.begin(), more.end() );
+  }
+
+  if ( largest( sizes ) != connection.get_MTU() ) {
+    fprintf( stderr, "%s: largest fragment was %d, for an MTU of %d\n", path,
+	     largest( sizes ), connection.get_MTU() );
+    ok = false;
+  }
+
+  close( sock );
+  return ok;
+}
+
+int main( void )
+{
+#if !defined(HAVE_IP_MTU_DISCOVER) || !defined(IP_PMTUDISC_PROBE)
+  return 0; /* no probes without a way to set DF */
+#else
+  bool ok = true;
+  int families[] = { AF_INET, AF_INET6 };
+
+  for ( int f = 0; f < 2; f++ ) {
+    for ( int precise = 0; precise < 2; precise++ ) {
+      for ( int session_id = 0; session_id < 2; session_id++ ) {
+	ok = test_path( families[ f ], precise, session_id ) && ok;
+      }
+    }
+  }
+
+  return ok ? 0 : 1;
+#endif
+}
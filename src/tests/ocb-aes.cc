@@ -35,7 +35,8 @@
    This tests cryptographic primitives implemented by others.  It uses the
    same interfaces and indeed the same compiled object code as the Mosh
    client and server.  It does not particularly test any code written for
-   the Mosh project. */
+   the Mosh project.  Every backend this CPU can run is tested, not just
+   the one ae_init() would pick. */
 
 #include <stdint.h>
 #include <string.h>
@@ -55,20 +56,22 @@ using Crypto::AlignedBuffer;
 
 bool verbose = true;
 
+const ae_backend *backend; /* under test */
+
 bool equal( const AlignedBuffer &a, const AlignedBuffer &b ) {
   return ( a.len() == b.len() )
     && !memcmp( a.data(), b.data(), a.len() );
 }
 
 AlignedBuffer *get_ctx( const AlignedBuffer &key ) {
-  AlignedBuffer *ctx_buf = new AlignedBuffer( ae_ctx_sizeof() );
+  AlignedBuffer *ctx_buf = new AlignedBuffer( backend->ctx_sizeof() );
   fatal_assert( ctx_buf );
-  fatal_assert( AE_SUCCESS == ae_init( (ae_ctx *)ctx_buf->data(), key.data(), key.len(), NONCE_LEN, TAG_LEN ) );
+  fatal_assert( AE_SUCCESS == backend->init( (ae_ctx *)ctx_buf->data(), key.data(), key.len(), NONCE_LEN, TAG_LEN ) );
   return ctx_buf;
 }
 
 void scrap_ctx( AlignedBuffer *ctx_buf ) {
-  fatal_assert( AE_SUCCESS == ae_clear( (ae_ctx *)ctx_buf->data() ) );
+  fatal_assert( AE_SUCCESS == backend->clear( (ae_ctx *)ctx_buf->data() ) );
   delete ctx_buf;
 }
 
@@ -80,11 +83,11 @@ void test_encrypt( const AlignedBuffer &key, const AlignedBuffer &nonce,
 
   AlignedBuffer observed_ciphertext( plaintext.len() + TAG_LEN );
 
-  const int ret = ae_encrypt( ctx, nonce.data(),
-                              plaintext.data(), plaintext.len(),
-                              assoc.data(), assoc.len(),
-                              observed_ciphertext.data(), NULL,
-                              AE_FINALIZE );
+  const int ret = backend->encrypt( ctx, nonce.data(),
+                                    plaintext.data(), plaintext.len(),
+                                    assoc.data(), assoc.len(),
+                                    observed_ciphertext.data(), NULL,
+                                    AE_FINALIZE );
 
   if ( verbose ) {
     printf( "ret %d\n", ret );
@@ -106,11 +109,11 @@ void test_decrypt( const AlignedBuffer &key, const AlignedBuffer &nonce,
 
   AlignedBuffer observed_plaintext( ciphertext.len() - TAG_LEN );
 
-  const int ret = ae_decrypt( ctx, nonce.data(),
-                              ciphertext.data(), ciphertext.len(),
-                              assoc.data(), assoc.len(),
-                              observed_plaintext.data(), NULL,
-                              AE_FINALIZE );
+  const int ret = backend->decrypt( ctx, nonce.data(),
+                                    ciphertext.data(), ciphertext.len(),
+                                    assoc.data(), assoc.len(),
+                                    observed_plaintext.data(), NULL,
+                                    AE_FINALIZE );
 
   if ( verbose ) {
     printf( "ret %d\n", ret );
@@ -491,29 +494,29 @@ void test_iterative( void ) {
     AlignedBuffer out( s.len() + TAG_LEN );
 
     /* OCB-ENCRYPT(K,N,S,S) */
-    fatal_assert( 0 <= ae_encrypt( ctx, nonce.data(),
-                                   s.data(), s.len(),
-                                   s.data(), s.len(),
-                                   out.data(), NULL,
-                                   AE_FINALIZE ) );
+    fatal_assert( 0 <= backend->encrypt( ctx, nonce.data(),
+                                         s.data(), s.len(),
+                                         s.data(), s.len(),
+                                         out.data(), NULL,
+                                         AE_FINALIZE ) );
     memcpy( acc, out.data(), s.len() + TAG_LEN );
     acc += s.len() + TAG_LEN;
 
     /* OCB-ENCRYPT(K,N,<empty string>,S) */
-    fatal_assert( 0 <= ae_encrypt( ctx, nonce.data(),
-                                   s.data(), s.len(),
-                                   NULL, 0,
-                                   out.data(), NULL,
-                                   AE_FINALIZE ) );
+    fatal_assert( 0 <= backend->encrypt( ctx, nonce.data(),
+                                         s.data(), s.len(),
+                                         NULL, 0,
+                                         out.data(), NULL,
+                                         AE_FINALIZE ) );
     memcpy( acc, out.data(), s.len() + TAG_LEN );
     acc += s.len() + TAG_LEN;
 
     /* OCB-ENCRYPT(K,N,S,<empty string>) */
-    fatal_assert( 0 <= ae_encrypt( ctx, nonce.data(),
-                                   NULL, 0,
-                                   s.data(), s.len(),
-                                   out.data(), NULL,
-                                   AE_FINALIZE ) );
+    fatal_assert( 0 <= backend->encrypt( ctx, nonce.data(),
+                                         NULL, 0,
+                                         s.data(), s.len(),
+                                         out.data(), NULL,
+                                         AE_FINALIZE ) );
     memcpy( acc, out.data(), TAG_LEN );
     acc += TAG_LEN;
   }
@@ -521,11 +524,11 @@ void test_iterative( void ) {
   /* OCB-ENCRYPT(K,N,C,<empty string>) */
   AlignedBuffer out( TAG_LEN );
   memset( nonce.data(), 0, NONCE_LEN );
-  fatal_assert( 0 <= ae_encrypt( ctx, nonce.data(),
-                                 NULL, 0,
-                                 accumulator.data(), accumulator.len(),
-                                 out.data(), NULL,
-                                 AE_FINALIZE ) );
+  fatal_assert( 0 <= backend->encrypt( ctx, nonce.data(),
+                                       NULL, 0,
+                                       accumulator.data(), accumulator.len(),
+                                       out.data(), NULL,
+                                       AE_FINALIZE ) );
 
   /* Check this final tag against the known value */
   AlignedBuffer correct( TAG_LEN, "\xB2\xB4\x1C\xBF\x9B\x05\x03\x7D\xA7\xF1\x6C\x24\xA3\x5C\x1C\x94" );
@@ -544,8 +547,14 @@ int main( int argc, char *argv[] )
     verbose = false;
   }
 
-  test_all_vectors();
-  test_iterative();
+  for ( int i = 0; ( backend = ae_backend_at( i ) ); i++ ) {
+    if ( verbose ) {
+      printf( "using %s\n\n", backend->name );
+    }
+
+    test_all_vectors();
+    test_iterative();
+  }
 
   return 0;
 }
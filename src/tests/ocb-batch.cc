@@ -0,0 +1,143 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests ae_encrypt_batch() and ae_decrypt_batch() against ae_encrypt()
+   and ae_decrypt() on every backend this CPU can run. Batches of random
+   size (including empty ones) hold messages of random length, some
+   longer than the batched path takes and many ending in a partial
+   block. Output must match the single-message calls octet for octet,
+   and a forged tag must fail only its own message. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ae.h"
+#include "crypto.h"
+#include "prng.h"
+#include "fatal_assert.h"
+
+#define KEY_LEN   16
+#define NONCE_LEN 12
+#define TAG_LEN   16
+
+using Crypto::AlignedBuffer;
+
+PRNG prng;
+
+const int MESSAGE_LEN_MAX = 600;
+const int SLOT_LEN        = 640; /* a message and its tag, 16-aligned */
+const int BATCH_LEN_MAX   = 64;
+const int NUM_BATCHES     = 2000;
+
+const ae_backend *backend; /* under test */
+
+char *slot( const AlignedBuffer &buf, int i ) { return buf.data() + i * SLOT_LEN; }
+
+void test_batch( ae_ctx *ctx, int count ) {
+  AlignedBuffer nonces( count * SLOT_LEN ), plaintexts( count * SLOT_LEN );
+  AlignedBuffer single( count * SLOT_LEN ), batched( count * SLOT_LEN );
+  AlignedBuffer decrypted( count * SLOT_LEN );
+  ae_batch msgs[ BATCH_LEN_MAX ];
+  int lens[ BATCH_LEN_MAX ], single_lens[ BATCH_LEN_MAX ];
+
+  for ( int i = 0; i < count; i++ ) {
+    /* short ones, often not a whole number of blocks, are the usual case */
+    lens[ i ] = ( prng.uint8() % 4 ) ? prng.uint8() % 64 : prng.uint32() % MESSAGE_LEN_MAX;
+    prng.fill( slot( nonces, i ), NONCE_LEN );
+    prng.fill( slot( plaintexts, i ), lens[ i ] );
+
+    single_lens[ i ] = backend->encrypt( ctx, slot( nonces, i ), slot( plaintexts, i ), lens[ i ],
+                                         NULL, 0, slot( single, i ), NULL, AE_FINALIZE );
+    fatal_assert( single_lens[ i ] == lens[ i ] + TAG_LEN );
+
+    msgs[ i ].nonce = slot( nonces, i );
+    msgs[ i ].in = slot( plaintexts, i );
+    msgs[ i ].in_len = lens[ i ];
+    msgs[ i ].out = slot( batched, i );
+    msgs[ i ].out_len = 0;
+  }
+
+  fatal_assert( AE_SUCCESS == backend->encrypt_batch( ctx, msgs, count ) );
+  for ( int i = 0; i < count; i++ ) {
+    fatal_assert( msgs[ i ].out_len == single_lens[ i ] );
+    fatal_assert( !memcmp( slot( single, i ), slot( batched, i ), single_lens[ i ] ) );
+  }
+
+  /* forge one tag, if there is a message to forge */
+  int forged = count ? int( prng.uint32() % count ) : -1;
+  if ( forged >= 0 ) {
+    slot( batched, forged )[ lens[ forged ] + prng.uint8() % TAG_LEN ] ^= 1 << ( prng.uint8() % 8 );
+  }
+
+  for ( int i = 0; i < count; i++ ) {
+    msgs[ i ].in = slot( batched, i );
+    msgs[ i ].in_len = single_lens[ i ];
+    msgs[ i ].out = slot( decrypted, i );
+    msgs[ i ].out_len = 0;
+  }
+
+  fatal_assert( AE_SUCCESS == backend->decrypt_batch( ctx, msgs, count ) );
+  for ( int i = 0; i < count; i++ ) {
+    AlignedBuffer out( SLOT_LEN );
+    int ret = backend->decrypt( ctx, slot( nonces, i ), slot( batched, i ), single_lens[ i ],
+                                NULL, 0, out.data(), NULL, AE_FINALIZE );
+    fatal_assert( msgs[ i ].out_len == ret );
+
+    if ( i == forged ) {
+      fatal_assert( ret == AE_INVALID );
+    } else {
+      fatal_assert( ret == lens[ i ] );
+      fatal_assert( !memcmp( slot( decrypted, i ), slot( plaintexts, i ), lens[ i ] ) );
+    }
+  }
+}
+
+int main( void ) {
+  for ( int b = 0; ( backend = ae_backend_at( b ) ); b++ ) {
+    AlignedBuffer key( KEY_LEN );
+    prng.fill( key.data(), KEY_LEN );
+
+    AlignedBuffer ctx_buf( backend->ctx_sizeof() );
+    ae_ctx *ctx = (ae_ctx *)ctx_buf.data();
+    fatal_assert( AE_SUCCESS == backend->init( ctx, key.data(), KEY_LEN, NONCE_LEN, TAG_LEN ) );
+
+    test_batch( ctx, 0 );
+    for ( int i = 0; i < NUM_BATCHES; i++ ) {
+      test_batch( ctx, 1 + prng.uint32() % BATCH_LEN_MAX );
+    }
+
+    fatal_assert( AE_SUCCESS == backend->clear( ctx ) );
+    printf( "%s: batches match single calls\n", backend->name );
+  }
+
+  return 0;
+}
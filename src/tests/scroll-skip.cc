@@ -0,0 +1,128 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+/* Tests that Complete::act() leaves the same framebuffer when it skips
+   plain text that scrolls off the screen as when it emulates all of it.
+   Random output is fed once in batches, where the skip applies, and once
+   an octet at a time, where it never does. */
+
+#include <stdio.h>
+#include <locale.h>
+#include <string>
+
+#include "completeterminal.h"
+#include "locale_utils.h"
+#include "prng.h"
+
+PRNG prng;
+
+const int NUM_SCREENS        = 500;
+const int BATCHES_PER_SCREEN = 8;
+
+bool utf8 = false;
+
+std::string random_text( int len ) {
+  std::string text;
+  for ( int i = 0; i < len; i++ ) {
+    text.push_back( char( 0x20 + prng.uint8() % 0x5f ) );
+  }
+  return text;
+}
+
+/* mostly plain text, with some of what else a terminal sees mixed in */
+std::string random_output( int width ) {
+  std::string out;
+  int pieces = prng.uint8();
+
+  for ( int i = 0; i < pieces; i++ ) {
+    switch ( prng.uint8() % 32 ) {
+    case 0: out += "\r\n"; break;
+    case 1: out += "\n"; break;
+    case 2: out += "\r"; break;
+    case 3: out += utf8 ? "\xcc\x81" : "'"; break; /* combining acute accent */
+    case 4: out += utf8 ? "\xe4\xb8\xad" : "w"; break; /* wide character */
+    case 5: out += "\033[1;31m"; break;
+    case 6: out += "\033[0m"; break;
+    case 7: out += "\033[K"; break;
+    case 8: out += "\033[H"; break;
+    default: out += random_text( prng.uint8() % (3 * width) ); break;
+    }
+  }
+
+  /* a batch can also end, or begin, in the middle of an escape sequence */
+  switch ( prng.uint8() % 8 ) {
+  case 0: out += "\033["; break;
+  case 1: out += utf8 ? "\xcc\x81" : "'"; break;
+  default: break;
+  }
+
+  return out;
+}
+
+bool same_terminal( const Terminal::Complete &a, const Terminal::Complete &b ) {
+  const Terminal::Framebuffer &x = a.get_fb(), &y = b.get_fb();
+  return ( x == y )
+    && ( x.ds.next_print_will_wrap == y.ds.next_print_will_wrap )
+    && ( x.ds.get_combining_char_row() == y.ds.get_combining_char_row() )
+    && ( x.ds.get_combining_char_col() == y.ds.get_combining_char_col() );
+}
+
+int main( void ) {
+  set_native_locale();
+  if ( !is_utf8_locale() ) {
+    setlocale( LC_ALL, "C.UTF-8" );
+  }
+  utf8 = is_utf8_locale();
+
+  for ( int i = 0; i < NUM_SCREENS; i++ ) {
+    int width = 2 + prng.uint8() % 30, height = 1 + prng.uint8() % 12;
+    Terminal::Complete skipping( width, height ), emulating( width, height );
+
+    for ( int j = 0; j < BATCHES_PER_SCREEN; j++ ) {
+      std::string batch = random_output( width );
+
+      skipping.act( batch );
+      for ( size_t k = 0; k < batch.size(); k++ ) {
+	emulating.act( std::string( 1, batch[ k ] ) );
+      }
+
+      if ( !same_terminal( skipping, emulating ) ) {
+	fprintf( stderr, "Screen %d (%dx%d), batch %d differs after skipping\n",
+		 i, width, height, j );
+	return 1;
+      }
+    }
+  }
+
+  fprintf( stderr, "OK\n" );
+  return 0;
+}
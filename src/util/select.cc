@@ -30,12 +30,647 @@
     also delete it here.
 */
 
+#include "config.h"
+
+#include <unistd.h>
+#include <algorithm>
+
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#endif
+
 #include "select.h"
+#include "swrite.h"
+#include "uring.h"
+
+#if HAVE_IO_URING
+#include <poll.h>
+#endif
 
 fd_set Select::dummy_fd_set;
 
 sigset_t Select::dummy_sigset;
 
+Select::Select()
+  : fds()
+  , fd_events()
+  , ready()
+  , always_ready()
+  , max_fd( -1 )
+  , got_any_signal( 0 )
+
+  /* These initializations are not used; they are just
+     here to appease -Weffc++. */
+  , all_fds( dummy_fd_set )
+  , read_fds( dummy_fd_set )
+  , error_fds( dummy_fd_set )
+  , empty_sigset( dummy_sigset )
+  , epoll_fd( -1 )
+  , timer_fd( -1 )
+  , timer_armed( false )
+  , signal_fd( -1 )
+  , signal_set( dummy_sigset )
+  , ring( NULL )
+  , signal_armed( false )
+  , read_buffers()
+  , buffers_registered( false )
+  , write_queues()
+{
+  FD_ZERO( &all_fds );
+  FD_ZERO( &read_fds );
+  FD_ZERO( &error_fds );
+
+  clear_got_signal();
+  fatal_assert( 0 == sigemptyset( &empty_sigset ) );
+  fatal_assert( 0 == sigemptyset( &signal_set ) );
+
+#if HAVE_EPOLL
+  epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK );
+  signal_fd = signalfd( -1, &signal_set, SFD_CLOEXEC | SFD_NONBLOCK );
+
+  bool ok = ( epoll_fd >= 0 ) && ( timer_fd >= 0 ) && ( signal_fd >= 0 );
+  if ( ok ) {
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    ok = ( 0 == epoll_ctl( epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev ) );
+    ev.data.fd = signal_fd;
+    ok = ok && ( 0 == epoll_ctl( epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev ) );
+  }
+
+  if ( !ok ) {
+    /* old kernel; fall back to pselect() */
+    if ( epoll_fd >= 0 ) { close( epoll_fd ); }
+    if ( timer_fd >= 0 ) { close( timer_fd ); }
+    if ( signal_fd >= 0 ) { close( signal_fd ); }
+    epoll_fd = timer_fd = signal_fd = -1;
+  }
+#endif
+}
+
+Select::~Select()
+{
+#if HAVE_IO_URING
+  delete ring;
+#endif
+  if ( epoll_fd >= 0 ) {
+    close( epoll_fd );
+    close( timer_fd );
+    close( signal_fd );
+  }
+}
+
+void Select::add_fd( int fd )
+{
+  fatal_assert( fd >= 0 );
+
+  for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    if ( *i == fd ) {
+      return;
+    }
+  }
+  fds.push_back( fd );
+
+  if ( fd > max_fd ) {
+    max_fd = fd;
+    fd_events.resize( max_fd + 1, 0 );
+  }
+
+#if HAVE_EPOLL
+  if ( epoll_fd >= 0 ) {
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = fd;
+    if ( 0 != epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &ev ) ) {
+      /* a regular file, which select() would call always readable */
+      fatal_assert( errno == EPERM );
+      fd_events[ fd ] |= ALWAYS_READY;
+      always_ready.push_back( fd );
+    }
+    return;
+  }
+#endif
+
+  fatal_assert( fd < FD_SETSIZE );
+  FD_SET( fd, &all_fds );
+}
+
+void Select::remove_fd( int fd )
+{
+  fatal_assert( !ring );
+
+  for ( std::vector<int>::iterator i = fds.begin(); i != fds.end(); i++ ) {
+    if ( *i == fd ) {
+      fds.erase( i );
+      break;
+    }
+  }
+
+  if ( ( fd >= 0 ) && ( fd < int( fd_events.size() ) ) ) {
+    fd_events[ fd ] = 0;
+  }
+  ready.erase( std::remove( ready.begin(), ready.end(), fd ), ready.end() );
+  always_ready.erase( std::remove( always_ready.begin(), always_ready.end(), fd ), always_ready.end() );
+
+#if HAVE_EPOLL
+  if ( epoll_fd >= 0 ) {
+    /* fails, harmlessly, for one epoll wouldn't take */
+    struct epoll_event ev;
+    memset( &ev, 0, sizeof( ev ) );
+    epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, &ev );
+  }
+#endif
+
+  if ( ( fd >= 0 ) && ( fd < FD_SETSIZE ) ) {
+    FD_CLR( fd, &all_fds );
+  }
+
+  for ( std::list<ReadBuffer>::iterator i = read_buffers.begin(); i != read_buffers.end(); i++ ) {
+    if ( i->fd == fd ) {
+      read_buffers.erase( i );
+      break;
+    }
+  }
+  write_queues.erase( fd );
+}
+
+void Select::add_signal( int signum )
+{
+  fatal_assert( signum >= 0 );
+  fatal_assert( signum <= MAX_SIGNAL_NUMBER );
+
+  /* Block the signal so we don't get it outside of select(). */
+  sigset_t to_block;
+  fatal_assert( 0 == sigemptyset( &to_block ) );
+  fatal_assert( 0 == sigaddset( &to_block, signum ) );
+  fatal_assert( 0 == sigprocmask( SIG_BLOCK, &to_block, NULL ) );
+
+  /* Register a handler, which will only be called when pselect()
+     is interrupted by a (possibly queued) signal. With epoll the
+     signal stays blocked and is read from the signalfd instead, but
+     the handler still keeps it from being ignored. */
+  struct sigaction sa;
+  sa.sa_flags = 0;
+  sa.sa_handler = &handle_signal;
+  fatal_assert( 0 == sigfillset( &sa.sa_mask ) );
+  fatal_assert( 0 == sigaction( signum, &sa, NULL ) );
+
+#if HAVE_EPOLL
+  if ( signal_fd >= 0 ) {
+    fatal_assert( 0 == sigaddset( &signal_set, signum ) );
+    fatal_assert( signal_fd == signalfd( signal_fd, &signal_set, 0 ) );
+  }
+#endif
+}
+
+bool Select::can_hold( int fd ) const
+{
+  if ( ring || ( epoll_fd >= 0 ) ) {
+    return true;
+  }
+  return fd < FD_SETSIZE;
+}
+
+int Select::select( int timeout )
+{
+  /* only those the last one found; the rest have nothing to clear */
+  for ( std::vector<int>::const_iterator i = ready.begin(); i != ready.end(); i++ ) {
+    fd_events[ *i ] &= POLL_ARMED | ALWAYS_READY;
+  }
+  ready.clear();
+  clear_got_signal();
+  got_any_signal = 0;
+
+  int ret;
+  if ( ring ) {
+    ret = uring_wait( timeout );
+  } else if ( epoll_fd >= 0 ) {
+    ret = epoll_wait_for( timeout );
+  } else {
+    ret = pselect_wait( timeout );
+  }
+
+  freeze_timestamp();
+
+  return ret;
+}
+
+int Select::pselect_wait( int timeout )
+{
+  memcpy( &read_fds,  &all_fds, sizeof( read_fds  ) );
+  memcpy( &error_fds, &all_fds, sizeof( error_fds ) );
+
+  struct timespec ts;
+  struct timespec *tsp = NULL;
+
+  if ( timeout >= 0 ) {
+    // timeout in milliseconds
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = 1000000 * (long( timeout ) % 1000);
+    tsp = &ts;
+  }
+  // negative timeout means wait forever
+
+  int ret = ::pselect( max_fd + 1, &read_fds, NULL, &error_fds, tsp, &empty_sigset );
+
+  if ( ( ret == -1 ) && ( errno == EINTR ) ) {
+    /* The user should process events as usual. */
+    return 0;
+  }
+
+  if ( ret > 0 ) {
+    for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+      if ( FD_ISSET( *i, &read_fds ) ) {
+	mark( *i, READ_READY );
+      }
+      if ( FD_ISSET( *i, &error_fds ) ) {
+	mark( *i, ERROR_READY );
+      }
+    }
+  }
+
+  return ret;
+}
+
+int Select::epoll_wait_for( int timeout )
+{
+#if HAVE_EPOLL
+  int ret = 0;
+  for ( std::vector<int>::const_iterator i = always_ready.begin(); i != always_ready.end(); i++ ) {
+    mark( *i, READ_READY );
+    ret++;
+    timeout = 0;
+  }
+
+  /* The timerfd wakes us on the exact deadline, where epoll_wait()'s own
+     timeout would be rounded up to the next millisecond. */
+  int epoll_timeout = -1;
+  if ( timeout > 0 ) {
+    struct itimerspec its;
+    memset( &its, 0, sizeof( its ) );
+    its.it_value.tv_sec = timeout / 1000;
+    its.it_value.tv_nsec = 1000000 * (long( timeout ) % 1000);
+    fatal_assert( 0 == timerfd_settime( timer_fd, 0, &its, NULL ) );
+    timer_armed = true;
+  } else if ( timeout == 0 ) {
+    epoll_timeout = 0;
+  } else if ( timer_armed ) {
+    /* don't let a stale deadline wake us */
+    struct itimerspec its;
+    memset( &its, 0, sizeof( its ) );
+    fatal_assert( 0 == timerfd_settime( timer_fd, 0, &its, NULL ) );
+    timer_armed = false;
+  }
+
+  static const int MAX_EVENTS = 16;
+  struct epoll_event events[ MAX_EVENTS ];
+
+  int n = epoll_wait( epoll_fd, events, MAX_EVENTS, epoll_timeout );
+
+  if ( n < 0 ) {
+    if ( errno == EINTR ) {
+      return ret;
+    }
+    return -1;
+  }
+
+  /* count as pselect() would, one per fd per set */
+  for ( int i = 0; i < n; i++ ) {
+    int fd = events[ i ].data.fd;
+    if ( fd == timer_fd ) {
+      uint64_t expirations;
+      if ( ::read( timer_fd, &expirations, sizeof( expirations ) ) == sizeof( expirations ) ) {
+	timer_armed = false;
+      }
+    } else if ( fd == signal_fd ) {
+      read_signals();
+    } else {
+      if ( events[ i ].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ) {
+	mark( fd, READ_READY );
+	ret++;
+      }
+      if ( events[ i ].events & EPOLLPRI ) {
+	mark( fd, ERROR_READY );
+	ret++;
+      }
+    }
+  }
+
+  return ret;
+#else
+  return pselect_wait( timeout );
+#endif
+}
+
+void Select::read_signals( void )
+{
+#if HAVE_EPOLL
+  struct signalfd_siginfo info;
+  while ( ::read( signal_fd, &info, sizeof( info ) ) == sizeof( info ) ) {
+    int signum = info.ssi_signo;
+    if ( ( signum >= 0 ) && ( signum <= MAX_SIGNAL_NUMBER ) ) {
+      got_signal[ signum ] = 1;
+      got_any_signal = 1;
+    }
+  }
+#endif
+}
+Select::ReadBuffer *Select::find_read_buffer( int fd )
+{
+  for ( std::list<ReadBuffer>::iterator i = read_buffers.begin(); i != read_buffers.end(); i++ ) {
+    if ( i->fd == fd ) {
+      return &*i;
+    }
+  }
+  return NULL;
+}
+
+void Select::add_read_buffer( int fd, size_t len )
+{
+  fatal_assert( !find_read_buffer( fd ) );
+  read_buffers.push_back( ReadBuffer( fd, len ) );
+  buffers_registered = false;
+}
+
+ssize_t Select::read_data( int fd, const char **data )
+{
+  ReadBuffer *buffer = find_read_buffer( fd );
+  fatal_assert( buffer );
+  *data = &buffer->data[ 0 ];
+
+  if ( !ring ) {
+    return ::read( fd, &buffer->data[ 0 ], buffer->data.size() );
+  }
+
+  if ( !buffer->ready ) {
+    errno = EAGAIN;
+    return -1;
+  }
+  buffer->ready = false; /* read again on the next select() */
+  if ( buffer->result < 0 ) {
+    errno = -buffer->result;
+    return -1;
+  }
+  return buffer->result;
+}
+
+int Select::queue_write( int fd, const char *buf, size_t len )
+{
+  if ( !ring ) {
+    return swrite( fd, buf, len );
+  }
+
+  WriteQueue &queue = write_queues[ fd ];
+  if ( queue.failed ) {
+    return -1;
+  }
+  if ( len > 0 ) {
+    queue.pending.push_back( std::string( buf, len ) );
+  }
+  return 0;
+}
+
+void Select::flush_writes( void )
+{
+  while ( ring ) {
+    bool busy = false;
+    for ( std::map<int, WriteQueue>::const_iterator i = write_queues.begin();
+	  i != write_queues.end();
+	  i++ ) {
+      if ( !i->second.failed && ( !i->second.pending.empty() || !i->second.in_flight.empty() ) ) {
+	busy = true;
+      }
+    }
+    if ( !busy || ( uring_wait( -1 ) < 0 ) ) {
+      return;
+    }
+  }
+}
+
+bool Select::use_io_uring( void )
+{
+#if HAVE_IO_URING
+  /* signals still come through the signalfd */
+  if ( !ring && ( signal_fd >= 0 ) ) {
+    ring = IOUring::create( RING_ENTRIES );
+  }
+#endif
+  return ring != NULL;
+}
+
+#if HAVE_IO_URING
+/* what a completion is for, in the top byte of its user_data */
+enum { URING_POLL = 1, URING_SIGNAL, URING_READ, URING_WRITE };
+
+static uint64_t uring_data( unsigned int kind, int fd, unsigned int index = 0 )
+{
+  return ( uint64_t( kind ) << 56 ) | ( uint64_t( fd ) << 32 ) | index;
+}
+#endif
+
+/* Puts in everything that should be waiting on the kernel */
+void Select::uring_arm( void )
+{
+#if HAVE_IO_URING
+  if ( !buffers_registered && !read_buffers.empty() ) {
+    std::vector<struct iovec> iovs;
+    for ( std::list<ReadBuffer>::iterator i = read_buffers.begin(); i != read_buffers.end(); i++ ) {
+      fatal_assert( !i->in_flight );
+      struct iovec iov;
+      iov.iov_base = &i->data[ 0 ];
+      iov.iov_len = i->data.size();
+      i->index = iovs.size();
+      iovs.push_back( iov );
+    }
+    ring->unregister_buffers();
+    fatal_assert( 0 == ring->register_buffers( &iovs[ 0 ], iovs.size() ) );
+    buffers_registered = true;
+  }
+
+  struct io_uring_sqe *sqe;
+
+  if ( !signal_armed && ( sqe = ring->get_sqe() ) ) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = signal_fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = uring_data( URING_SIGNAL, signal_fd );
+    signal_armed = true;
+  }
+
+  /* Level-triggered, like select(): a one-shot poll completes at once if
+     the fd is already ready, so re-arming each time misses nothing. */
+  for ( std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++ ) {
+    int fd = *i;
+    ReadBuffer *buffer = find_read_buffer( fd );
+    if ( buffer ) {
+      if ( buffer->in_flight || buffer->ready || !( sqe = ring->get_sqe() ) ) {
+	continue;
+      }
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uintptr_t>( &buffer->data[ 0 ] );
+      sqe->len = buffer->data.size();
+      sqe->off = uint64_t( -1 );
+      sqe->buf_index = buffer->index;
+      sqe->user_data = uring_data( URING_READ, fd );
+      buffer->in_flight = true;
+    } else if ( !( fd_events[ fd ] & POLL_ARMED ) && ( sqe = ring->get_sqe() ) ) {
+      /* not POLLPRI: a socket's wakeups always claim it, and those are
+	 passed through as they are */
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll_events = POLLIN;
+      sqe->user_data = uring_data( URING_POLL, fd );
+      fd_events[ fd ] |= POLL_ARMED;
+    }
+  }
+
+  /* Writes to an fd go as one linked chain at a time, so they land in order */
+  for ( std::map<int, WriteQueue>::iterator i = write_queues.begin(); i != write_queues.end(); i++ ) {
+    WriteQueue &queue = i->second;
+    if ( queue.failed || !queue.in_flight.empty() ) {
+      continue;
+    }
+
+    struct io_uring_sqe *last = NULL;
+    while ( !queue.pending.empty()
+	    && ( queue.in_flight.size() < MAX_WRITE_CHAIN )
+	    && ( sqe = ring->get_sqe() ) ) {
+      queue.in_flight.push_back( queue.pending.front() );
+      queue.pending.pop_front();
+
+      const std::string &data = queue.in_flight.back();
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = i->first;
+      sqe->addr = reinterpret_cast<uintptr_t>( data.data() );
+      sqe->len = data.size();
+      sqe->off = uint64_t( -1 );
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = uring_data( URING_WRITE, i->first, queue.in_flight.size() - 1 );
+      last = sqe;
+    }
+    if ( last ) {
+      last->flags = 0; /* end of the chain */
+      queue.results.assign( queue.in_flight.size(), 0 );
+      queue.completed = 0;
+    }
+  }
+#endif
+}
+
+/* Once a whole chain is back, anything short or cancelled goes round again */
+void Select::uring_write_done( int fd, unsigned int index, int result )
+{
+  WriteQueue &queue = write_queues[ fd ];
+  fatal_assert( index < queue.results.size() );
+  queue.results[ index ] = result;
+  if ( ++queue.completed < queue.in_flight.size() ) {
+    return;
+  }
+
+  std::deque<std::string> again;
+  for ( unsigned int i = 0; i < queue.in_flight.size(); i++ ) {
+    const std::string &data = queue.in_flight[ i ];
+    int written = queue.results[ i ];
+
+    if ( !again.empty() ) {
+      again.push_back( data );
+    } else if ( written == int( data.size() ) ) {
+      continue;
+    } else if ( written >= 0 ) {
+      again.push_back( data.substr( written ) );
+    } else if ( ( written == -ECANCELED ) || ( written == -EAGAIN ) || ( written == -EINTR ) ) {
+      again.push_back( data );
+    } else {
+      queue.failed = true;
+      queue.pending.clear();
+      break;
+    }
+  }
+
+  queue.in_flight.clear();
+  queue.results.clear();
+  if ( !queue.failed ) {
+    queue.pending.insert( queue.pending.begin(), again.begin(), again.end() );
+  }
+}
+
+int Select::uring_wait( int timeout )
+{
+#if HAVE_IO_URING
+  /* a read that hasn't been taken yet is still there to be read */
+  int ret = 0;
+  for ( std::list<ReadBuffer>::const_iterator i = read_buffers.begin(); i != read_buffers.end(); i++ ) {
+    if ( i->ready ) {
+      mark( i->fd, READ_READY );
+      ret++;
+      timeout = 0;
+    }
+  }
+
+  uring_arm();
+
+  int err = ring->submit_and_wait( timeout == 0 ? 0 : 1, timeout );
+  if ( err < 0 ) {
+    if ( err == -EINTR ) {
+      return ret;
+    }
+    errno = -err;
+    return -1;
+  }
+
+  struct io_uring_cqe *cqe;
+  while ( ( cqe = ring->peek_cqe() ) ) {
+    unsigned int kind = cqe->user_data >> 56;
+    int fd = ( cqe->user_data >> 32 ) & 0xFFFFFF;
+    int res = cqe->res;
+    unsigned int index = cqe->user_data & 0xFFFFFFFF;
+    ring->cqe_seen();
+
+    switch ( kind ) {
+    case URING_POLL:
+      fd_events[ fd ] &= ~POLL_ARMED;
+      if ( res < 0 ) {
+	mark( fd, ERROR_READY );
+	ret++;
+	break;
+      }
+      if ( res & (POLLIN | POLLHUP | POLLERR) ) {
+	mark( fd, READ_READY );
+	ret++;
+      }
+      break;
+    case URING_SIGNAL:
+      signal_armed = false;
+      read_signals();
+      break;
+    case URING_READ: {
+      ReadBuffer *buffer = find_read_buffer( fd );
+      fatal_assert( buffer );
+      buffer->in_flight = false;
+      buffer->ready = true;
+      buffer->result = res;
+      mark( fd, READ_READY );
+      ret++;
+      break;
+    }
+    case URING_WRITE:
+      uring_write_done( fd, index, res );
+      break;
+    }
+  }
+
+  return ret;
+#else
+  return epoll_wait_for( timeout );
+#endif
+}
+
 void Select::handle_signal( int signum )
 {
   fatal_assert( signum >= 0 );
@@ -37,11 +37,25 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <vector>
+#include <list>
+#include <deque>
+#include <map>
+#include <string>
+#include <sys/types.h>
 
 #include "fatal_assert.h"
 #include "timestamp.h"
 
-/* Convenience wrapper for pselect(2).
+class IOUring;
+
+/* Waits for file descriptors, signals and timeouts.
+
+   On Linux this is an epoll set, with a timerfd for the timeout and a
+   signalfd for the signals; elsewhere, or if the kernel lacks those, it
+   is a wrapper for pselect(2). On request, and where the kernel allows,
+   it can use io_uring(7) instead, which also does the reads and writes
+   set up below as part of the wait.
 
    Any signals blocked by calling sigprocmask() outside this code will still be
    received during Select::select().  So don't do that. */
@@ -55,24 +69,8 @@ public:
   }
 
 private:
-  Select()
-    : max_fd( -1 )
-    , got_any_signal( 0 )
-
-    /* These initializations are not used; they are just
-       here to appease -Weffc++. */
-    , all_fds( dummy_fd_set )
-    , read_fds( dummy_fd_set )
-    , error_fds( dummy_fd_set )
-    , empty_sigset( dummy_sigset )
-  {
-    FD_ZERO( &all_fds );
-    FD_ZERO( &read_fds );
-    FD_ZERO( &error_fds );
-
-    clear_got_signal();
-    fatal_assert( 0 == sigemptyset( &empty_sigset ) );
-  }
+  Select();
+  ~Select();
 
   void clear_got_signal( void )
   {
@@ -84,80 +82,46 @@ private:
   Select &operator=( const Select & );
 
 public:
-  void add_fd( int fd )
+  void add_fd( int fd );
+  /* Forgets fd, and any buffer or writes for it, before it is closed.
+     Not with io_uring, which may have them in flight. */
+  void remove_fd( int fd );
+  void add_signal( int signum );
+
+  /* timeout in milliseconds; negative means wait forever */
+  int select( int timeout );
+
+  /* Switches to io_uring; false if the kernel won't */
+  bool use_io_uring( void );
+
+  /* Reads from fd go into a buffer of len bytes. With io_uring the
+     kernel fills it before select() returns. Either way, after read( fd ),
+     read_data() gives what read(2) would have, valid until the next
+     select(). */
+  void add_read_buffer( int fd, size_t len );
+  ssize_t read_data( int fd, const char **data );
+
+  /* Writes all of buf to fd, like swrite(). With io_uring it is only
+     submitted by the next select(), in order with the other writes to fd.
+     Returns -1 if this or an earlier write to fd has failed. */
+  int queue_write( int fd, const char *buf, size_t len );
+  /* Waits for queued writes to go out */
+  void flush_writes( void );
+
+  /* The fds read() or error() is true for, after select() */
+  const std::vector<int> &ready_fds( void ) const { return ready; }
+
+  /* Whether add_fd() could take fd; pselect() stops at FD_SETSIZE */
+  bool can_hold( int fd ) const;
+
+  bool read( int fd ) const
   {
-    if ( fd > max_fd ) {
-      max_fd = fd;
-    }
-    FD_SET( fd, &all_fds );
+    return ( fd >= 0 ) && ( fd < int( fd_events.size() ) ) && ( fd_events[ fd ] & READ_READY );
   }
 
-  void add_signal( int signum )
+  bool error( int fd ) const
   {
-    fatal_assert( signum >= 0 );
-    fatal_assert( signum <= MAX_SIGNAL_NUMBER );
-
-    /* Block the signal so we don't get it outside of pselect(). */
-    sigset_t to_block;
-    fatal_assert( 0 == sigemptyset( &to_block ) );
-    fatal_assert( 0 == sigaddset( &to_block, signum ) );
-    fatal_assert( 0 == sigprocmask( SIG_BLOCK, &to_block, NULL ) );
-
-    /* Register a handler, which will only be called when pselect()
-       is interrupted by a (possibly queued) signal. */
-    struct sigaction sa;
-    sa.sa_flags = 0;
-    sa.sa_handler = &handle_signal;
-    fatal_assert( 0 == sigfillset( &sa.sa_mask ) );
-    fatal_assert( 0 == sigaction( signum, &sa, NULL ) );
-  }
-
-  int select( int timeout )
-  {
-    memcpy( &read_fds,  &all_fds, sizeof( read_fds  ) );
-    memcpy( &error_fds, &all_fds, sizeof( error_fds ) );
-    clear_got_signal();
-    got_any_signal = 0;
-
-    struct timespec ts;
-    struct timespec *tsp = NULL;
-
-    if ( timeout >= 0 ) {
-      // timeout in milliseconds
-      ts.tv_sec  = timeout / 1000;
-      ts.tv_nsec = 1000000 * (long( timeout ) % 1000);
-      tsp = &ts;
-    }
-    // negative timeout means wait forever
-
-    int ret = ::pselect( max_fd + 1, &read_fds, NULL, &error_fds, tsp, &empty_sigset );
-
-    if ( ( ret == -1 ) && ( errno == EINTR ) ) {
-      /* The user should process events as usual. */
-      FD_ZERO( &read_fds );
-      FD_ZERO( &error_fds );
-      ret = 0;
-    }
-
-    freeze_timestamp();
-
-    return ret;
-  }
-
-  bool read( int fd )
-#if FD_ISSET_IS_CONST
-    const
-#endif
-  {
-    return FD_ISSET( fd, &read_fds );
-  }
-
-  bool error( int fd )
-#if FD_ISSET_IS_CONST
-    const
-#endif
-  {
-    return FD_ISSET( fd, &error_fds );
+    return ( fd >= 0 ) && ( fd < int( fd_events.size() ) ) && ( fd_events[ fd ] & ERROR_READY );
   }
 
   bool signal( int signum ) const
@@ -175,8 +139,32 @@ public:
 private:
   static const int MAX_SIGNAL_NUMBER = 64;
 
+  static const unsigned char READ_READY = 1 << 0;
+  static const unsigned char ERROR_READY = 1 << 1;
+  static const unsigned char POLL_ARMED = 1 << 2; /* io_uring */
+  static const unsigned char ALWAYS_READY = 1 << 3; /* epoll won't take it */
+
   static void handle_signal( int signum );
 
+  int pselect_wait( int timeout );
+  int epoll_wait_for( int timeout );
+  int uring_wait( int timeout );
+  void uring_arm( void );
+  void uring_write_done( int fd, unsigned int index, int result );
+  void read_signals( void );
+
+  void mark( int fd, unsigned char event )
+  {
+    if ( !( fd_events[ fd ] & ( READ_READY | ERROR_READY ) ) ) {
+      ready.push_back( fd );
+    }
+    fd_events[ fd ] |= event;
+  }
+
+  std::vector<int> fds;
+  std::vector<unsigned char> fd_events; /* indexed by fd, from the last select() */
+  std::vector<int> ready; /* those with READ_READY or ERROR_READY */
+  std::vector<int> always_ready; /* those with ALWAYS_READY */
   int max_fd;
 
   /* We assume writes to these ints are atomic, though we also try to mask out
@@ -184,10 +172,49 @@ private:
   int got_any_signal;
   int got_signal[ MAX_SIGNAL_NUMBER + 1 ];
 
+  /* pselect() */
   fd_set all_fds, read_fds, error_fds;
 
   sigset_t empty_sigset;
 
+  /* epoll, or -1 if we're using pselect() */
+  int epoll_fd;
+  int timer_fd;
+  bool timer_armed;
+  int signal_fd;
+  sigset_t signal_set;
+
+  /* io_uring, or NULL */
+  static const unsigned int RING_ENTRIES = 64;
+  static const unsigned int MAX_WRITE_CHAIN = 32;
+  IOUring *ring;
+  bool signal_armed;
+
+  struct ReadBuffer {
+    int fd;
+    std::vector<char> data;
+    unsigned int index; /* among the registered buffers */
+    ssize_t result; /* of the last read */
+    bool in_flight, ready;
+
+    ReadBuffer( int s_fd, size_t len )
+      : fd( s_fd ), data( len ), index( 0 ), result( 0 ), in_flight( false ), ready( false ) {}
+  };
+  std::list<ReadBuffer> read_buffers; /* the kernel has their addresses */
+  bool buffers_registered;
+  ReadBuffer *find_read_buffer( int fd );
+
+  struct WriteQueue {
+    std::deque<std::string> pending; /* not yet submitted */
+    std::deque<std::string> in_flight; /* one linked chain */
+    std::vector<int> results;
+    unsigned int completed;
+    bool failed;
+
+    WriteQueue() : pending(), in_flight(), results(), completed( 0 ), failed( false ) {}
+  };
+  std::map<int, WriteQueue> write_queues;
+
   static fd_set dummy_fd_set;
   static sigset_t dummy_sigset;
 };
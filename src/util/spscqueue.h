@@ -0,0 +1,98 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef SPSCQUEUE_HPP
+#define SPSCQUEUE_HPP
+
+#include <stddef.h>
+
+/* Unbounded queue between exactly one producer thread and one consumer
+   thread, which may push() and pop() concurrently without a lock.
+
+   The consumer owns a stub node whose successor is the front of the
+   queue; the producer only ever writes the link out of the last node.
+   The barriers keep a node's contents visible before its link. */
+
+template <class T>
+class SPSCQueue {
+private:
+  struct Node {
+    T value;
+    Node * volatile next;
+
+    Node() : value(), next( NULL ) {}
+  };
+
+  Node *head; /* consumer's */
+  Node *tail; /* producer's */
+
+  /* not implemented */
+  SPSCQueue( const SPSCQueue & );
+  SPSCQueue &operator=( const SPSCQueue & );
+
+public:
+  SPSCQueue() : head( new Node ), tail( head ) {}
+
+  ~SPSCQueue()
+  {
+    while ( head ) {
+      Node *next = head->next;
+      delete head;
+      head = next;
+    }
+  }
+
+  void push( const T &x )
+  {
+    Node *node = new Node;
+    node->value = x;
+    __sync_synchronize();
+    tail->next = node;
+    tail = node;
+  }
+
+  bool pop( T &x )
+  {
+    Node *node = head->next;
+    if ( !node ) {
+      return false;
+    }
+    __sync_synchronize();
+    x = node->value;
+    node->value = T(); /* it is the new stub */
+    delete head;
+    head = node;
+    return true;
+  }
+};
+
+#endif
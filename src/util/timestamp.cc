@@ -44,7 +44,15 @@
  #include <sys/time.h>
 #endif
 
-static uint64_t millis_cache = -1;
+/* Each thread freezes its own clock. */
+#if HAVE_PTHREAD
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+static THREAD_LOCAL uint64_t millis_cache = -1;
+static THREAD_LOCAL uint64_t micros_cache = -1;
 
 uint64_t frozen_timestamp( void )
 {
@@ -55,6 +63,15 @@ uint64_t frozen_timestamp( void )
   return millis_cache;
 }
 
+uint64_t frozen_timestamp_us( void )
+{
+  if ( micros_cache == uint64_t( -1 ) ) {
+    freeze_timestamp();
+  }
+
+  return micros_cache;
+}
+
 void freeze_timestamp( void )
 {
 #if HAVE_CLOCK_GETTIME
@@ -63,10 +80,11 @@ void freeze_timestamp( void )
   if ( clock_gettime( CLOCK_MONOTONIC, &tp ) < 0 ) {
     /* did not succeed */
   } else {
-    uint64_t millis = tp.tv_nsec / 1000000;
-    millis += uint64_t( tp.tv_sec ) * 1000;
+    uint64_t micros = tp.tv_nsec / 1000;
+    micros += uint64_t( tp.tv_sec ) * 1000000;
 
-    millis_cache = millis;
+    micros_cache = micros;
+    millis_cache = micros / 1000;
     return;
   }
 #elif HAVE_MACH_ABSOLUTE_TIME
@@ -77,8 +95,9 @@ void freeze_timestamp( void )
   }
 
   // NB: mach_absolute_time() returns "absolute time units"
-  // We need to apply a conversion to get milliseconds.
-  millis_cache = ((mach_absolute_time() * s_timebase_info.numer) / (1000000 * s_timebase_info.denom));
+  // We need to apply a conversion to get microseconds.
+  micros_cache = ((mach_absolute_time() * s_timebase_info.numer) / (1000 * s_timebase_info.denom));
+  millis_cache = micros_cache / 1000;
   return;								    
 #elif HAVE_GETTIMEOFDAY
   // NOTE: If time steps backwards, timeouts may be confused.
@@ -86,10 +105,11 @@ void freeze_timestamp( void )
   if ( gettimeofday(&tv, NULL) ) {
     perror( "gettimeofday" );
   } else {
-    uint64_t millis = tv.tv_usec / 1000;
-    millis += uint64_t( tv.tv_sec ) * 1000;
+    uint64_t micros = tv.tv_usec;
+    micros += uint64_t( tv.tv_sec ) * 1000000;
 
-    millis_cache = millis;
+    micros_cache = micros;
+    millis_cache = micros / 1000;
     return;
   }
 #else
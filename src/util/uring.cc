@@ -0,0 +1,207 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#include "config.h"
+
+#if HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int io_uring_setup( unsigned int entries, struct io_uring_params *p )
+{
+  return syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int io_uring_enter( int fd, unsigned int to_submit, unsigned int min_complete,
+			   unsigned int flags, const void *arg, size_t argsz )
+{
+  return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz );
+}
+
+static int io_uring_register( int fd, unsigned int opcode, const void *arg, unsigned int nr_args )
+{
+  return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+IOUring *IOUring::create( unsigned int entries )
+{
+  struct io_uring_params p;
+  memset( &p, 0, sizeof( p ) );
+
+  int fd = io_uring_setup( entries, &p );
+  if ( fd < 0 ) {
+    return NULL; /* ENOSYS, or disabled (EPERM) */
+  }
+
+  /* timeouts on enter, and one mmap for both rings */
+  const unsigned int needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_RW_CUR_POS;
+  if ( (p.features & needed) != needed ) {
+    close( fd );
+    return NULL;
+  }
+
+  IOUring *ring = new IOUring( fd, p );
+  if ( !ring->sqes ) {
+    delete ring;
+    return NULL;
+  }
+  return ring;
+}
+
+IOUring::IOUring( int s_fd, const struct io_uring_params &p )
+  : fd( s_fd ), entries( p.sq_entries ),
+    rings( MAP_FAILED ), rings_len( 0 ),
+    sqes( NULL ), sqes_len( 0 ),
+    sq_head( NULL ), sq_tail( NULL ), sq_mask( NULL ),
+    cq_head( NULL ), cq_tail( NULL ), cq_mask( NULL ), cqes( NULL ),
+    sqe_tail( 0 )
+{
+  rings_len = p.sq_off.array + p.sq_entries * sizeof( unsigned int );
+  size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+  if ( cq_len > rings_len ) {
+    rings_len = cq_len;
+  }
+
+  rings = mmap( NULL, rings_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING );
+  if ( rings == MAP_FAILED ) {
+    return;
+  }
+
+  sqes_len = p.sq_entries * sizeof( struct io_uring_sqe );
+  void *sqes_map = mmap( NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			 fd, IORING_OFF_SQES );
+  if ( sqes_map == MAP_FAILED ) {
+    return;
+  }
+  sqes = static_cast<struct io_uring_sqe *>( sqes_map );
+
+  char *sq = static_cast<char *>( rings );
+  sq_head = reinterpret_cast<unsigned int *>( sq + p.sq_off.head );
+  sq_tail = reinterpret_cast<unsigned int *>( sq + p.sq_off.tail );
+  sq_mask = reinterpret_cast<unsigned int *>( sq + p.sq_off.ring_mask );
+
+  /* entry i always lives in slot i */
+  unsigned int *array = reinterpret_cast<unsigned int *>( sq + p.sq_off.array );
+  for ( unsigned int i = 0; i < p.sq_entries; i++ ) {
+    array[ i ] = i;
+  }
+
+  char *cq = static_cast<char *>( rings );
+  cq_head = reinterpret_cast<unsigned int *>( cq + p.cq_off.head );
+  cq_tail = reinterpret_cast<unsigned int *>( cq + p.cq_off.tail );
+  cq_mask = reinterpret_cast<unsigned int *>( cq + p.cq_off.ring_mask );
+  cqes = reinterpret_cast<struct io_uring_cqe *>( cq + p.cq_off.cqes );
+
+  sqe_tail = *sq_tail;
+}
+
+IOUring::~IOUring()
+{
+  if ( sqes ) {
+    munmap( sqes, sqes_len );
+  }
+  if ( rings != MAP_FAILED ) {
+    munmap( rings, rings_len );
+  }
+  close( fd );
+}
+
+struct io_uring_sqe *IOUring::get_sqe( void )
+{
+  unsigned int head = __atomic_load_n( sq_head, __ATOMIC_ACQUIRE );
+  if ( sqe_tail - head >= entries ) {
+    return NULL;
+  }
+
+  struct io_uring_sqe *sqe = &sqes[ sqe_tail & *sq_mask ];
+  memset( sqe, 0, sizeof( *sqe ) );
+  sqe_tail++;
+  return sqe;
+}
+
+int IOUring::submit_and_wait( unsigned int wait_nr, int timeout )
+{
+  unsigned int to_submit = sqe_tail - *sq_tail;
+  __atomic_store_n( sq_tail, sqe_tail, __ATOMIC_RELEASE );
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset( &arg, 0, sizeof( arg ) );
+  if ( timeout >= 0 ) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = 1000000 * (long( timeout ) % 1000);
+    arg.ts = reinterpret_cast<uintptr_t>( &ts );
+  }
+
+  unsigned int flags = IORING_ENTER_EXT_ARG;
+  if ( wait_nr ) {
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+
+  if ( io_uring_enter( fd, to_submit, wait_nr, flags, &arg, sizeof( arg ) ) < 0 ) {
+    return (errno == ETIME) ? 0 : -errno;
+  }
+  return 0;
+}
+
+struct io_uring_cqe *IOUring::peek_cqe( void )
+{
+  unsigned int head = *cq_head;
+  if ( head == __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE ) ) {
+    return NULL;
+  }
+  return &cqes[ head & *cq_mask ];
+}
+
+void IOUring::cqe_seen( void )
+{
+  __atomic_store_n( cq_head, *cq_head + 1, __ATOMIC_RELEASE );
+}
+
+int IOUring::register_buffers( const struct iovec *iovs, unsigned int count )
+{
+  return io_uring_register( fd, IORING_REGISTER_BUFFERS, iovs, count ) < 0 ? -errno : 0;
+}
+
+int IOUring::unregister_buffers( void )
+{
+  return io_uring_register( fd, IORING_UNREGISTER_BUFFERS, NULL, 0 ) < 0 ? -errno : 0;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+    Mosh: the mobile shell
+    Copyright 2012 Keith Winstein
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    In addition, as a special exception, the copyright holders give
+    permission to link the code of portions of this program with the
+    OpenSSL library under certain conditions as described in each
+    individual source file, and distribute linked combinations including
+    the two.
+
+    You must obey the GNU General Public License in all respects for all
+    of the code used other than OpenSSL. If you modify file(s) with this
+    exception, you may extend this exception to your version of the
+    file(s), but you are not obligated to do so. If you do not wish to do
+    so, delete this exception statement from your version. If you delete
+    this exception statement from all source files in the program, then
+    also delete it here.
+*/
+
+#ifndef URING_HPP
+#define URING_HPP
+
+#include "config.h"
+
+#if HAVE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Just enough of io_uring(7) for Select, on the raw system calls. */
+
+class IOUring {
+private:
+  int fd;
+  unsigned int entries;
+
+  void *rings; /* SQ and CQ, in one mapping */
+  size_t rings_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  unsigned int *sq_head, *sq_tail, *sq_mask;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned int sqe_tail; /* ours, published on submit */
+
+  IOUring( int s_fd, const struct io_uring_params &p );
+
+  /* not implemented */
+  IOUring( const IOUring & );
+  IOUring &operator=( const IOUring & );
+
+public:
+  /* NULL if the kernel doesn't have what we need */
+  static IOUring *create( unsigned int entries );
+  ~IOUring();
+
+  /* a zeroed entry, or NULL if the queue is full */
+  struct io_uring_sqe *get_sqe( void );
+
+  /* Submits everything and waits for at least wait_nr completions, or
+     for timeout ms (negative: no limit). Returns 0 or -errno. */
+  int submit_and_wait( unsigned int wait_nr, int timeout );
+
+  struct io_uring_cqe *peek_cqe( void );
+  void cqe_seen( void );
+
+  int register_buffers( const struct iovec *iovs, unsigned int count );
+  int unregister_buffers( void );
+};
+
+#endif
+
+#endif